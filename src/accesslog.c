@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "accesslog.h"
+#include "utils.h"
+#include "log.h"
+
+/*
+ * One segment writer per thread at a time. Writers of exited threads are reused by new ones, so the number of
+ * open segments follows peak concurrency rather than connection count.
+ */
+struct segment_writer {
+  int id;
+  int fd;
+  unsigned int sequence;
+  struct access_log_header *header;
+  struct access_record *records;
+  uint64_t capacity;
+  long rotate_at;
+  int in_use;
+  struct segment_writer *next;
+};
+
+static const char *log_dir = NULL;
+static size_t segment_size = 16 * 1024 * 1024;
+static unsigned int rotate_interval = 3600;
+static int next_writer_id = 0;
+
+static __thread struct segment_writer *local_writer = NULL;
+static struct segment_writer *writers = NULL;
+static pthread_mutex_t writers_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t writer_key;
+
+/* Unmaps segment and cuts the file down to the records actually written */
+static void close_segment(struct segment_writer *writer) {
+  uint64_t count;
+
+  if (writer->header == NULL) return;
+
+  count = __atomic_load_n(&writer->header->count, __ATOMIC_RELAXED);
+  munmap(writer->header, segment_size);
+  if (ftruncate(writer->fd, (off_t) (sizeof(struct access_log_header) + count * sizeof(struct access_record))) != 0) {
+    log_warn("[access_log] Failed to truncate segment, errno: %d\n", errno);
+  }
+  close(writer->fd);
+  writer->header = NULL;
+}
+
+static int open_segment(struct segment_writer *writer) {
+  char path[1024];
+  long now = get_timestamp();
+
+  snprintf(path, sizeof(path), "%s/access-%d-%d-%ld-%u.clog", log_dir, (int) getpid(), writer->id, now,
+           writer->sequence++);
+
+  writer->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (writer->fd < 0) {
+    log_error("[access_log] Failed to create %s, errno: %d\n", path, errno);
+    return -1;
+  }
+
+  if (ftruncate(writer->fd, (off_t) segment_size) != 0 ||
+      (writer->header = mmap(NULL, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, writer->fd, 0)) == MAP_FAILED) {
+    log_error("[access_log] Failed to map %s, errno: %d\n", path, errno);
+    close(writer->fd);
+    writer->header = NULL;
+    return -1;
+  }
+
+  memcpy(writer->header->magic, ACCESS_LOG_MAGIC, sizeof(writer->header->magic));
+  writer->header->version = ACCESS_LOG_VERSION;
+  writer->header->record_size = sizeof(struct access_record);
+  writer->header->created = (uint64_t) now;
+  writer->records = (struct access_record *) (writer->header + 1);
+  writer->capacity = (segment_size - sizeof(struct access_log_header)) / sizeof(struct access_record);
+  writer->rotate_at = rotate_interval > 0 ? now + rotate_interval : -1;
+  return 0;
+}
+
+static void release_writer(void *ptr) {
+  struct segment_writer *writer = ptr;
+
+  pthread_mutex_lock(&writers_mutex);
+  writer->in_use = 0;
+  pthread_mutex_unlock(&writers_mutex);
+  local_writer = NULL;
+}
+
+static struct segment_writer *acquire_writer() {
+  struct segment_writer *writer;
+
+  pthread_mutex_lock(&writers_mutex);
+  for (writer = writers; writer != NULL && writer->in_use; writer = writer->next);
+
+  if (writer == NULL) {
+    writer = calloc(1, sizeof(struct segment_writer));
+    writer->id = next_writer_id++;
+    writer->next = writers;
+    writers = writer;
+  }
+
+  writer->in_use = 1;
+  pthread_mutex_unlock(&writers_mutex);
+
+  pthread_setspecific(writer_key, writer);
+  local_writer = writer;
+  return writer;
+}
+
+/* Appends record to calling thread's segment, rotating it when full or older than rotate_interval */
+void access_log_append(struct access_record *record) {
+  struct segment_writer *writer;
+  uint64_t count;
+
+  if (log_dir == NULL) return;
+  writer = local_writer != NULL ? local_writer : acquire_writer();
+
+  if (writer->header != NULL && (writer->header->count == writer->capacity ||
+                                 (writer->rotate_at != -1 && get_timestamp() >= writer->rotate_at))) {
+    close_segment(writer);
+  }
+  if (writer->header == NULL && open_segment(writer) != 0) return;
+
+  count = writer->header->count;
+  writer->records[count] = *record;
+  __atomic_store_n(&writer->header->count, count + 1, __ATOMIC_RELEASE);
+}
+
+/* Enables access log when [access_log] path is set */
+int access_log_init(configuration *cfg) {
+  if (cfg->access_log_path == NULL) return 0;
+
+  if (mkdir(cfg->access_log_path, 0755) != 0 && errno != EEXIST) {
+    log_error("[access_log] Can't create directory %s, errno: %d\n", cfg->access_log_path, errno);
+    return -1;
+  }
+
+  if (cfg->access_log_segment_size > 0) segment_size = (size_t) cfg->access_log_segment_size * 1024 * 1024;
+  rotate_interval = cfg->access_log_rotate_interval;
+
+  pthread_key_create(&writer_key, release_writer);
+  log_dir = cfg->access_log_path;
+  log_info("[access_log] Writing %zu MiB segments to %s\n", segment_size / 1024 / 1024, log_dir);
+  return 0;
+}
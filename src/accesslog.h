@@ -0,0 +1,56 @@
+#ifndef CACHR_ACCESSLOG_H
+#define CACHR_ACCESSLOG_H
+
+#include <stdint.h>
+#include "configutils.h"
+
+#define ACCESS_LOG_MAGIC "CACHRLOG"
+#define ACCESS_LOG_VERSION 1
+
+enum cache_result {
+  RESULT_NONE = 0,
+  RESULT_HIT,
+  RESULT_MISS,
+  RESULT_STALE,
+  /* No backend could take the miss */
+  RESULT_REJECTED,
+  /* Miss answered by cluster member owning the key */
+  RESULT_PEER
+};
+
+/* Result as logdump and slow request log print it */
+static inline const char *access_result_name(uint8_t result) {
+  static const char *names[] = {"-", "HIT", "MISS", "STALE", "REJECTED", "PEER"};
+
+  return result < sizeof(names) / sizeof(names[0]) ? names[result] : "?";
+}
+
+/* Fixed 48 byte record in host byte order */
+struct access_record {
+  uint64_t timestamp_us;
+  uint64_t key;
+  uint64_t bytes_out;
+  uint64_t upstream_bytes;
+  uint32_t bytes_in;
+  uint32_t upstream_us;
+  uint32_t total_us;
+  uint16_t status;
+  uint8_t result;
+  /* 0 for identity, content_encoding + 1 otherwise */
+  uint8_t encoding;
+} __attribute__((packed));
+
+/* Segment file header, records follow it. count is updated after every append so live segments can be read */
+struct access_log_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+  uint64_t created;
+  uint64_t count;
+  char reserved[32];
+} __attribute__((packed));
+
+int access_log_init(configuration *cfg);
+void access_log_append(struct access_record *record);
+
+#endif //CACHR_ACCESSLOG_H
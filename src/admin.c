@@ -0,0 +1,220 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "admin.h"
+#include "metrics.h"
+#include "arena.h"
+#include "netutils.h"
+#include "log.h"
+#include "tags.h"
+#include "pathindex.h"
+#include "utils.h"
+#include "libs/picohttpparser.h"
+
+/* Admin requests are small, anything larger is rejected */
+#define ADMIN_REQUEST_MAX 8192
+#define ADMIN_READ_TIMEOUT 1000
+
+static int admin_sck = -1, path_index_enabled = 0;
+
+static void admin_reply(int fd, const char *status, const char *content_type, const char *body, size_t body_len) {
+  char head[256];
+  struct iovec iov[2];
+
+  iov[0].iov_base = head;
+  iov[0].iov_len = (size_t) sprintf(head, "HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\n"
+                                          "Connection: close\r\n\r\n", status, content_type, body_len);
+  iov[1].iov_base = (char *) body;
+  iov[1].iov_len = body_len;
+  write_all(fd, iov, 2);
+}
+
+/* Next value of query parameter name after *offset, percent-decoded into out. Returns its length or -1 */
+static int query_param(const char *path, size_t path_len, const char *name, size_t *offset, char *out,
+                       size_t out_size) {
+  size_t name_len = strlen(name), i = *offset;
+
+  if (i == 0) {
+    while (i < path_len && path[i] != '?') i++;
+  }
+
+  while (i < path_len) {
+    size_t start = ++i, len = 0;
+
+    while (i < path_len && path[i] != '&') i++;
+    if (i - start <= name_len || strncmp(path + start, name, name_len) != 0 || path[start + name_len] != '=') continue;
+
+    for (size_t j = start + name_len + 1; j < i && len + 1 < out_size; j++) {
+      if (path[j] == '%' && j + 2 < i) {
+        char hex[3] = {path[j + 1], path[j + 2], 0};
+        out[len++] = (char) strtol(hex, NULL, 16);
+        j += 2;
+      } else {
+        out[len++] = path[j] == '+' ? ' ' : path[j];
+      }
+    }
+    out[len] = '\0';
+    *offset = i;
+    return (int) len;
+  }
+
+  *offset = path_len;
+  return -1;
+}
+
+static int has_param(const char *path, size_t path_len, const char *name) {
+  char value[2];
+  size_t offset = 0;
+
+  return query_param(path, path_len, name, &offset, value, sizeof(value)) >= 0;
+}
+
+/*
+ * POST /purge?tag=a&prefix=/assets/v123/&path=/img/x*.png[&soft=1] invalidates entries carrying any tag, under any
+ * path prefix or matching any glob. Soft purge marks them stale instead of expiring them.
+ */
+static void handle_purge(int fd, const char *path, size_t path_len) {
+  char value[1024], body[128];
+  size_t offset = 0, purged = 0;
+  int value_len, soft = 0, selectors = 0;
+  long started = get_time_us();
+
+  if (query_param(path, path_len, "soft", &offset, value, sizeof(value)) > 0) soft = strcmp(value, "0") != 0;
+
+  if (!path_index_enabled && (has_param(path, path_len, "prefix") || has_param(path, path_len, "path"))) {
+    admin_reply(fd, "409 Conflict", "text/plain", "Path index is off\n", 18);
+    return;
+  }
+
+  offset = 0;
+  while ((value_len = query_param(path, path_len, "tag", &offset, value, sizeof(value))) >= 0) {
+    if (value_len == 0) continue;
+    purged += tags_purge(value, (size_t) value_len, soft);
+    selectors++;
+  }
+
+  /* Prefix is a glob with its special characters escaped and '*' appended */
+  offset = 0;
+  while ((value_len = query_param(path, path_len, "prefix", &offset, value, sizeof(value))) >= 0) {
+    char pattern[2 * sizeof(value) + 2];
+    size_t len = 0;
+
+    if (value_len == 0) continue;
+    for (int i = 0; i < value_len; i++) {
+      if (strchr("*?[\\", value[i]) != NULL) pattern[len++] = '\\';
+      pattern[len++] = value[i];
+    }
+    pattern[len++] = '*';
+    pattern[len] = '\0';
+
+    purged += path_index_purge(pattern, soft);
+    selectors++;
+  }
+
+  offset = 0;
+  while ((value_len = query_param(path, path_len, "path", &offset, value, sizeof(value))) >= 0) {
+    if (value_len == 0) continue;
+    purged += path_index_purge(value, soft);
+    selectors++;
+  }
+
+  if (selectors == 0) {
+    admin_reply(fd, "400 Bad Request", "text/plain", "Missing tag, prefix or path\n", 28);
+    return;
+  }
+
+  metrics_add(METRIC_CACHE_PURGED, (int64_t) purged);
+  log_info("[admin] %s %zu entries of %d selectors in %ld us\n", soft ? "Soft purged" : "Purged", purged, selectors,
+           get_time_us() - started);
+  admin_reply(fd, "200 OK", "application/json", body,
+              (size_t) sprintf(body, "{\"purged\": %zu, \"soft\": %s}\n", purged, soft ? "true" : "false"));
+}
+
+static void handle_admin_request(int fd, const char *method, size_t method_len, const char *path, size_t path_len) {
+  if (method_len == 4 && strncmp(method, "POST", 4) == 0 && path_len >= 6 && strncmp(path, "/purge", 6) == 0 &&
+      (path_len == 6 || path[6] == '?')) {
+    handle_purge(fd, path, path_len);
+  } else if (method_len == 3 && strncmp(method, "GET", 3) == 0 && path_len == 8 && strncmp(path, "/metrics", 8) == 0) {
+    char *body = NULL;
+    size_t body_len = 0;
+    FILE *out = open_memstream(&body, &body_len);
+
+    metrics_render(out);
+    arena_render(out);
+    fclose(out);
+    admin_reply(fd, "200 OK", "text/plain; version=0.0.4", body, body_len);
+    free(body);
+  } else {
+    admin_reply(fd, "404 Not Found", "text/plain", "Not found\n", 10);
+  }
+}
+
+/* Serves one admin connection on the admin thread, scrapes are rare enough not to need more */
+static void handle_admin_connection(int fd) {
+  char buffer[ADMIN_REQUEST_MAX];
+  const char *method, *path;
+  size_t size = 0, last_len = 0, method_len, path_len, num_headers;
+  struct phr_header headers[64];
+  struct pollfd pfd = {.fd = fd, .events = POLLIN};
+  int minor_version, pret = -2;
+
+  while (pret == -2 && size < sizeof(buffer) && poll(&pfd, 1, ADMIN_READ_TIMEOUT) == 1) {
+    ssize_t rsize = read(fd, buffer + size, sizeof(buffer) - size);
+    if (rsize <= 0) break;
+
+    last_len = size;
+    size += rsize;
+    num_headers = sizeof(headers) / sizeof(headers[0]);
+    pret = phr_parse_request(buffer, size, &method, &method_len, &path, &path_len, &minor_version, headers,
+                             &num_headers, last_len);
+  }
+
+  if (pret > 0) {
+    handle_admin_request(fd, method, method_len, path, path_len);
+  } else {
+    admin_reply(fd, "400 Bad Request", "text/plain", "Bad request\n", 12);
+  }
+  close(fd);
+}
+
+static void *admin_thread(void *ctx) {
+  struct pollfd pfd = {.fd = admin_sck, .events = POLLIN};
+
+  while (poll(&pfd, 1, -1) != -1 || errno == EINTR) {
+    int fd = accept(admin_sck, NULL, NULL);
+    if (fd >= 0) handle_admin_connection(fd);
+  }
+
+  return NULL;
+}
+
+/* Starts admin listener on [admin] host:port, disabled when port is not configured */
+int admin_start(configuration *cfg) {
+  pthread_t thid;
+
+  if (cfg->admin_port == NULL) return 0;
+  path_index_enabled = cfg->path_index;
+
+  admin_sck = prepare_listen_sock(cfg->admin_host != NULL ? cfg->admin_host : "127.0.0.1", cfg->admin_port);
+  if (admin_sck < 0) {
+    log_error("[admin] Failed to listen on port %s\n", cfg->admin_port);
+    return -1;
+  }
+
+  if (pthread_create(&thid, NULL, admin_thread, NULL) != 0) {
+    log_error("[admin] Failed to create admin thread.\n");
+    close(admin_sck);
+    return -1;
+  }
+
+  pthread_detach(thid);
+  log_info("[admin] Listening on port %s\n", cfg->admin_port);
+  return 0;
+}
@@ -0,0 +1,8 @@
+#ifndef CACHR_ADMIN_H
+#define CACHR_ADMIN_H
+
+#include "configutils.h"
+
+int admin_start(configuration *cfg);
+
+#endif //CACHR_ADMIN_H
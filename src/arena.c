@@ -0,0 +1,241 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "arena.h"
+#include "metrics.h"
+#include "log.h"
+
+/*
+ * Cache storage (index, entries and body slices) carved from one region reserved up front and backed by huge pages,
+ * so the hit path walks a few large TLB entries instead of many 4 KiB ones. Blocks come in power-of-two size classes,
+ * a block's class is kept per span rather than in a header, so 4 KiB and 1 MiB slices fill their blocks exactly.
+ * Blocks of entries freed by cache_release() and of responses that weren't cached go to their class's free list and
+ * are reused by the class's next allocation. Spans are never given back, a class keeps the spans of its peak use.
+ * Allocations that don't fit fall back to malloc(), free() tells both apart by address.
+ */
+
+#ifndef MAP_HUGETLB
+#define MAP_HUGETLB 0x40000
+#endif
+
+enum arena_backing {
+  ARENA_BACKING_PAGES = 0,
+  ARENA_BACKING_THP,
+  ARENA_BACKING_HUGETLB
+};
+
+static const char *backing_names[] = {"regular pages", "transparent huge pages", "hugetlbfs pages"};
+
+struct arena_class {
+  pthread_mutex_t lock;
+  /* Freed blocks, each one stores pointer to the next */
+  void *free_list;
+  /* Unused part of the class's current span */
+  char *next;
+  char *end;
+} __attribute__((aligned(64)));
+
+static char *region = NULL;
+static size_t region_size, spans_count, spans_taken = 0;
+static enum arena_backing backing;
+/* Size class of blocks in each span, of the first span for blocks spanning several */
+static uint8_t *span_classes;
+static struct arena_class classes[ARENA_CLASSES];
+static int overflow_logged = 0;
+
+/* Maps region with the best backing mode allows, falls back towards regular pages */
+static char *reserve(size_t size, const char *mode) {
+  char *mapped;
+
+  if (strcmp(mode, "auto") == 0 || strcmp(mode, "hugetlb") == 0) {
+    mapped = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (mapped != MAP_FAILED) {
+      backing = ARENA_BACKING_HUGETLB;
+      return mapped;
+    }
+    log_warn("[arena] No %zu MiB of hugetlbfs pages reserved (vm.nr_hugepages), trying transparent huge pages\n",
+             size >> 20);
+  }
+
+  /* Over-mapped by a span so region can start on a huge page boundary */
+  mapped = mmap(NULL, size + ARENA_SPAN_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                -1, 0);
+  if (mapped == MAP_FAILED) return NULL;
+  mapped = (char *) (((uintptr_t) mapped + ARENA_SPAN_SIZE - 1) & ~(uintptr_t) (ARENA_SPAN_SIZE - 1));
+  backing = ARENA_BACKING_PAGES;
+
+  if (strcmp(mode, "off") != 0) {
+    if (madvise(mapped, size, MADV_HUGEPAGE) == 0) backing = ARENA_BACKING_THP;
+    else log_warn("[arena] madvise(MADV_HUGEPAGE) failed, using regular pages\n");
+  }
+  return mapped;
+}
+
+void arena_init(configuration *cfg) {
+  if (cfg->arena_size == 0) return;
+
+  region_size = ((size_t) cfg->arena_size << 20) & ~(ARENA_SPAN_SIZE - 1);
+  if (region_size == 0) region_size = ARENA_SPAN_SIZE;
+
+  if ((region = reserve(region_size, cfg->arena_huge_pages)) == NULL) {
+    log_error("[arena] Failed to reserve %zu MiB, cache uses malloc\n", region_size >> 20);
+    return;
+  }
+
+  spans_count = region_size >> ARENA_SPAN_SHIFT;
+  span_classes = calloc(spans_count, sizeof(uint8_t));
+  for (int i = 0; i < ARENA_CLASSES; i++) pthread_mutex_init(&classes[i].lock, NULL);
+
+  log_info("[arena] Cache storage in %zu MiB region backed by %s\n", region_size >> 20, backing_names[backing]);
+}
+
+static int size_class(size_t size) {
+  int class = ARENA_MIN_SHIFT;
+
+  while (((size_t) 1 << class) < size) class++;
+  return class;
+}
+
+/* Takes count consecutive spans for class, NULL when region is used up */
+static char *take_spans(size_t count, int class) {
+  size_t taken = __atomic_load_n(&spans_taken, __ATOMIC_RELAXED);
+
+  do {
+    if (taken + count > spans_count) return NULL;
+  } while (!__atomic_compare_exchange_n(&spans_taken, &taken, taken + count, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+  span_classes[taken] = (uint8_t) class;
+  return region + (taken << ARENA_SPAN_SHIFT);
+}
+
+void *arena_malloc(size_t size) {
+  struct arena_class *arena_class;
+  size_t block;
+  void *allocated;
+  int class;
+
+  if (region == NULL || size > region_size) return malloc(size);
+
+  class = size_class(size);
+  block = (size_t) 1 << class;
+  arena_class = &classes[class];
+
+  pthread_mutex_lock(&arena_class->lock);
+  if ((allocated = arena_class->free_list) != NULL) {
+    arena_class->free_list = *(void **) allocated;
+  } else if (block >= ARENA_SPAN_SIZE) {
+    allocated = take_spans(block >> ARENA_SPAN_SHIFT, class);
+  } else {
+    if (arena_class->next == arena_class->end) {
+      arena_class->next = take_spans(1, class);
+      arena_class->end = arena_class->next != NULL ? arena_class->next + ARENA_SPAN_SIZE : NULL;
+    }
+    if ((allocated = arena_class->next) != NULL) arena_class->next += block;
+  }
+  pthread_mutex_unlock(&arena_class->lock);
+
+  if (allocated == NULL) {
+    metrics_add(METRIC_ARENA_FALLBACKS, 1);
+    if (!__atomic_exchange_n(&overflow_logged, 1, __ATOMIC_RELAXED)) {
+      log_warn("[arena] Region is full, further cache storage comes from malloc\n");
+    }
+    return malloc(size);
+  }
+  return allocated;
+}
+
+void *arena_calloc(size_t count, size_t size) {
+  void *allocated = arena_malloc(count * size);
+
+  if (allocated != NULL) memset(allocated, 0, count * size);
+  return allocated;
+}
+
+static int in_region(void *ptr) {
+  return region != NULL && (char *) ptr >= region && (char *) ptr < region + region_size;
+}
+
+static int class_of(void *ptr) {
+  return span_classes[(size_t) ((char *) ptr - region) >> ARENA_SPAN_SHIFT];
+}
+
+void arena_free(void *ptr) {
+  struct arena_class *arena_class;
+
+  if (ptr == NULL) return;
+  if (!in_region(ptr)) {
+    free(ptr);
+    return;
+  }
+
+  arena_class = &classes[class_of(ptr)];
+  pthread_mutex_lock(&arena_class->lock);
+  *(void **) ptr = arena_class->free_list;
+  arena_class->free_list = ptr;
+  pthread_mutex_unlock(&arena_class->lock);
+}
+
+/* Block is kept while size stays in its class, so growing and trimming within a class costs nothing */
+void *arena_realloc(void *ptr, size_t size) {
+  size_t block;
+  void *moved;
+
+  if (ptr == NULL) return arena_malloc(size);
+  if (!in_region(ptr)) return realloc(ptr, size);
+
+  block = (size_t) 1 << class_of(ptr);
+  if (size <= block && size > block / 2) return ptr;
+
+  if ((moved = arena_malloc(size)) == NULL) return NULL;
+  memcpy(moved, ptr, size < block ? size : block);
+  arena_free(ptr);
+  return moved;
+}
+
+/* Huge page backed bytes of region as kernel reports them in smaps */
+static unsigned long long huge_bytes(unsigned long long *page_size) {
+  char line[256];
+  unsigned long long kb, found = 0;
+  int inside = 0;
+  FILE *smaps = fopen("/proc/self/smaps", "r");
+
+  *page_size = 2048 * 1024;
+  if (smaps == NULL) return 0;
+
+  while (fgets(line, sizeof(line), smaps) != NULL) {
+    unsigned long long start, end;
+
+    /* Mapping header lines start with the address range, field lines with a name */
+    if (sscanf(line, "%llx-%llx ", &start, &end) == 2) {
+      inside = start <= (uintptr_t) region && (uintptr_t) region < end;
+    } else if (inside && (sscanf(line, "AnonHugePages: %llu kB", &kb) == 1 ||
+                          sscanf(line, "Private_Hugetlb: %llu kB", &kb) == 1 ||
+                          sscanf(line, "Shared_Hugetlb: %llu kB", &kb) == 1)) {
+      found += kb * 1024;
+    } else if (inside && sscanf(line, "KernelPageSize: %llu kB", &kb) == 1 && backing == ARENA_BACKING_HUGETLB) {
+      *page_size = kb * 1024;
+    }
+  }
+
+  fclose(smaps);
+  return found;
+}
+
+/* Region gauges for /metrics, huge pages are counted from smaps on every scrape */
+void arena_render(FILE *out) {
+  unsigned long long page_size, huge;
+
+  if (region == NULL) return;
+
+  huge = huge_bytes(&page_size);
+  fprintf(out, "# HELP cachr_arena_size_bytes Reserved cache storage region\n"
+               "# TYPE cachr_arena_size_bytes gauge\ncachr_arena_size_bytes %zu\n", region_size);
+  fprintf(out, "# HELP cachr_arena_used_bytes Spans of cache storage region handed out to size classes\n"
+               "# TYPE cachr_arena_used_bytes gauge\ncachr_arena_used_bytes %zu\n",
+          __atomic_load_n(&spans_taken, __ATOMIC_RELAXED) << ARENA_SPAN_SHIFT);
+  fprintf(out, "# HELP cachr_arena_huge_pages Huge pages backing cache storage region\n"
+               "# TYPE cachr_arena_huge_pages gauge\ncachr_arena_huge_pages %llu\n", huge / page_size);
+}
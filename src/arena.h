@@ -0,0 +1,23 @@
+#ifndef CACHR_ARENA_H
+#define CACHR_ARENA_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include "configutils.h"
+
+/* Region is handed out in spans of this size (one 2 MiB huge page), each span holds blocks of a single size class */
+#define ARENA_SPAN_SHIFT 21
+#define ARENA_SPAN_SIZE ((size_t) 1 << ARENA_SPAN_SHIFT)
+
+/* Smallest block is 16 bytes, largest one the whole region */
+#define ARENA_MIN_SHIFT 4
+#define ARENA_CLASSES 48
+
+void arena_init(configuration *cfg);
+void *arena_malloc(size_t size);
+void *arena_calloc(size_t count, size_t size);
+void *arena_realloc(void *ptr, size_t size);
+void arena_free(void *ptr);
+void arena_render(FILE *out);
+
+#endif //CACHR_ARENA_H
@@ -0,0 +1,454 @@
+#define _GNU_SOURCE
+/* Index buckets live in arena with entries and bodies */
+#define uthash_malloc(sz) arena_malloc(sz)
+#define uthash_free(ptr, sz) arena_free(ptr)
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/sysinfo.h>
+
+#include "cache.h"
+#include "arena.h"
+#include "partition.h"
+#include "nodes.h"
+#include "request.h"
+#include "metrics.h"
+#include "utils.h"
+#include "log.h"
+
+/* Head of cache data structure, unused when [cache] partitions keeps an index per partition */
+struct cache_entry *cache = NULL;
+
+/* Cache mutex */
+pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int ttl_3xx, ttl_4xx, ttl_5xx, compression_min_size;
+static int compression;
+
+/*
+ * Front cache of recently found entries, l1_mask + 1 sets per CPU. Connection threads live for one request, so it's
+ * per CPU rather than per thread: a thread touches only its CPU's sets, which no other CPU writes while it runs there.
+ */
+static struct cache_l1_set *l1 = NULL;
+static uint64_t l1_mask;
+static int l1_cpus;
+
+/* Lookup or insert handed to the owner of key's partition */
+struct index_op {
+  uint64_t key;
+  int status;
+  struct cache_entry *entry;
+  struct cache_entry *replaced_entry;
+  uint32_t generation;
+  struct response_meta *meta;
+  const char *index_path;
+  int stored;
+};
+
+void cache_init(configuration *cfg) {
+  ttl_3xx = cfg->ttl_3xx;
+  ttl_4xx = cfg->ttl_4xx;
+  ttl_5xx = cfg->ttl_5xx;
+  compression = cfg->compression;
+  compression_min_size = cfg->compression_min_size;
+
+  if (cfg->cache_l1_sets > 0) {
+    uint64_t sets = 1;
+
+    while (sets * 2 <= cfg->cache_l1_sets) sets *= 2;
+    l1_mask = sets - 1;
+    l1_cpus = get_nprocs_conf();
+    l1 = aligned_alloc(64, sizeof(struct cache_l1_set) * sets * l1_cpus);
+    memset(l1, 0, sizeof(struct cache_l1_set) * sets * l1_cpus);
+    log_info("Front cache: %llu entries per CPU on %d CPUs\n", (unsigned long long) (sets * CACHE_L1_WAYS), l1_cpus);
+  }
+
+  if (cfg->cache_partitions > 0 && partition_start((int) cfg->cache_partitions) != 0) {
+    log_error("Falling back to shared cache index\n");
+    partitions_count = 0;
+  }
+}
+
+static struct cache_l1_set *l1_set(uint64_t key) {
+  int cpu = sched_getcpu();
+
+  /* Thread may migrate right after this, then it just shares a set with the new CPU's threads for a moment */
+  if (cpu < 0) cpu = 0;
+  return &l1[(uint64_t) (cpu % l1_cpus) * (l1_mask + 1) + (mix64(key) & l1_mask)];
+}
+
+void cache_retain(struct cache_entry *entry) {
+  __atomic_add_fetch(&entry->refs, 1, __ATOMIC_RELAXED);
+}
+
+/* Drops a reference, last one frees entry with everything it owns and only then takes its bytes off the gauge */
+void cache_release(struct cache_entry *entry) {
+  if (entry == NULL || __atomic_sub_fetch(&entry->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+
+  metrics_add(METRIC_CACHE_BYTES, -(int64_t) cache_entry_size(entry));
+  for (int i = 0; i < ENCODING_COUNT; i++) free(entry->variants[i].buffer);
+  nodes_release(entry);
+  slice_buffer_free(&entry->body);
+  free(entry->tags);
+  free(entry->head);
+  arena_free(entry);
+}
+
+/* Set is only touched by the thread holding its lock, returns 0 when another one does */
+static int l1_lock(struct cache_l1_set *set) {
+  uint32_t unlocked = 0;
+
+  return __atomic_compare_exchange_n(&set->lock, &unlocked, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static void l1_unlock(struct cache_l1_set *set) {
+  __atomic_store_n(&set->lock, 0, __ATOMIC_RELEASE);
+}
+
+/* New key goes to first way and pushes the other one to second, returns entry that lost its slot (to be released) */
+static struct cache_entry *l1_put(struct cache_l1_set *set, uint64_t key, struct cache_entry *entry,
+                                  uint32_t generation) {
+  struct cache_entry *evicted;
+
+  if (set->keys[0] != key) {
+    evicted = set->entries[1];
+    set->keys[1] = set->keys[0];
+    set->entries[1] = set->entries[0];
+    set->generations[1] = set->generations[0];
+  } else {
+    evicted = set->entries[0];
+  }
+  set->keys[0] = key;
+  set->entries[0] = entry;
+  set->generations[0] = generation;
+  return evicted;
+}
+
+/* Slot takes its own reference, skipped when another thread holds the set */
+static void l1_insert(struct cache_l1_set *set, uint64_t key, struct cache_entry *entry, uint32_t generation) {
+  struct cache_entry *evicted;
+
+  if (!l1_lock(set)) return;
+
+  cache_retain(entry);
+  evicted = l1_put(set, key, entry, generation);
+  l1_unlock(set);
+
+  cache_release(evicted);
+}
+
+/*
+ * Entry from front cache with a reference taken, if it still is the indexed one for key. Hits in second way are moved
+ * to first, slots of unlinked entries are cleared.
+ */
+static struct cache_entry *l1_find(struct cache_l1_set *set, uint64_t key) {
+  struct cache_entry *entry = NULL, *evicted = NULL;
+  int way;
+
+  if (!l1_lock(set)) return NULL;
+
+  for (way = 0; way < CACHE_L1_WAYS; way++) {
+    if (set->entries[way] != NULL && set->keys[way] == key) {
+      entry = set->entries[way];
+      break;
+    }
+  }
+
+  if (entry != NULL && __atomic_load_n(&entry->generation, __ATOMIC_ACQUIRE) != set->generations[way]) {
+    evicted = entry;
+    entry = NULL;
+    set->entries[way] = NULL;
+    set->keys[way] = 0;
+  } else if (entry != NULL) {
+    cache_retain(entry);
+    if (way > 0) {
+      set->entries[way] = NULL;
+      l1_put(set, key, entry, set->generations[way]);
+    }
+  }
+  l1_unlock(set);
+
+  cache_release(evicted);
+  return entry;
+}
+
+static void partition_find(void **state, void *arg) {
+  struct cache_entry *index = *state;
+  struct index_op *op = arg;
+
+  HASH_FIND(hh, index, &op->key, sizeof(uint64_t), op->entry);
+  if (op->entry != NULL) {
+    op->generation = op->entry->generation;
+    cache_retain(op->entry);
+  }
+}
+
+/* Entry indexed under key with a reference taken for caller, who hands it back with cache_release() */
+struct cache_entry *cache_find(uint64_t key) {
+  struct cache_entry *found_entry;
+  struct cache_l1_set *set = NULL;
+  uint32_t generation = 0;
+
+  /* Hot keys are answered here without touching cache_mutex or index */
+  if (l1 != NULL) {
+    set = l1_set(key);
+    if ((found_entry = l1_find(set, key)) != NULL) {
+      metrics_add(METRIC_CACHE_L1_HITS, 1);
+      return found_entry;
+    }
+  }
+
+  if (partitions_count > 0) {
+    struct index_op op = {.key = key};
+
+    partition_call(partition_of(key), partition_find, &op);
+    found_entry = op.entry;
+    generation = op.generation;
+  } else {
+    /* Avoid concurrent access */
+    pthread_mutex_lock(&cache_mutex);
+    HASH_FIND(hh, cache, &key, sizeof(uint64_t), found_entry);
+    if (found_entry != NULL) {
+      generation = found_entry->generation;
+      cache_retain(found_entry);
+    }
+    pthread_mutex_unlock(&cache_mutex);
+  }
+
+  if (found_entry != NULL && set != NULL) l1_insert(set, key, found_entry, generation);
+  return found_entry;
+}
+
+int get_ttl_value(char *header_value) {
+  char *separator = "=";
+  char *key = strtok(header_value, separator);
+  char *value = strtok(NULL, "");
+  if (strcmp(key, "max-age") == 0) {
+    return atoi(value);
+  }
+  return 0;
+};
+
+/* Whether comma separated header value has token, ignoring case */
+static int lists_token(const char *value, const char *token) {
+  size_t len = strlen(token);
+
+  while (*value != '\0') {
+    while (*value == ' ' || *value == '\t' || *value == ',') value++;
+    if (strncasecmp(value, token, len) == 0 && (value[len] == '\0' || value[len] == ',' || value[len] == ' ' ||
+                                                 value[len] == '\t')) {
+      return 1;
+    }
+    while (*value != '\0' && *value != ',') value++;
+  }
+  return 0;
+}
+
+/* Fills meta from parsed response headers, meta->ttl keeps its value unless response has Cache-Control */
+void parse_response_headers(char *head, struct phr_header *headers, size_t num_headers, struct response_meta *meta) {
+  for (size_t i = 0; i != num_headers; ++i) {
+    char *name = malloc(sizeof(char) * (headers[i].name_len + 1));
+    char *value = malloc(sizeof(char) * (headers[i].value_len + 1));
+    sprintf(name, "%.*s", (int) headers[i].name_len, headers[i].name);
+    sprintf(value, "%.*s", (int) headers[i].value_len, headers[i].value);
+
+    log_trace("[%d][%d] %s: %s\n", (int) gettid(), (int) i, name, value);
+
+    if (strcmp("Cache-Control", name) == 0) {
+      /* Override requests caching strategy by response caching strategy */
+      if (strcmp(value, "no-cache") == 0 || strcmp(value, "no-store") == 0) meta->ttl = 0;
+      else {
+        /* Parse "max-age=X" */
+        meta->ttl = get_ttl_value((char *) value);
+      }
+    } else if (strcmp("Content-Length", name) == 0) {
+      meta->content_length = atoll(value);
+    } else if (strcmp("Transfer-Encoding", name) == 0) {
+      if (strcmp("chunked", value) == 0) {
+        log_debug("Detected chunked response...\n");
+        meta->chunked = 1;
+        meta->te_start = headers[i].name - head;
+        meta->te_end = headers[i].value + headers[i].value_len - head;
+        while (head[meta->te_end++] != '\n');
+      }
+    } else if (strcmp("Content-Type", name) == 0) {
+      meta->compressible = is_compressible(value);
+    } else if (strcmp("Content-Encoding", name) == 0) {
+      meta->encoded = 1;
+    } else if (strcasecmp("Vary", name) == 0) {
+      meta->varies_encoding |= strchr(value, '*') != NULL || lists_token(value, "Accept-Encoding");
+    } else if (strcasecmp("Surrogate-Key", name) == 0 || strcasecmp("Cache-Tag", name) == 0) {
+      meta->tags_count = tags_parse(value, headers[i].value_len, meta->tags, meta->tags_count);
+    }
+
+    free(name);
+    free(value);
+  }
+}
+
+/* 2xx keep TTL from headers or [cache] ttl, redirects and errors are capped by their class TTL (0 disables) */
+static int status_ttl(int status, int ttl) {
+  int cap;
+
+  if (status >= 200 && status < 300) return ttl;
+  else if (status >= 300 && status < 400) cap = (int) ttl_3xx;
+  else if (status >= 400 && status < 500) cap = (int) ttl_4xx;
+  else if (status >= 500 && status < 600) cap = (int) ttl_5xx;
+  else return 0;
+
+  return ttl < cap ? ttl : cap;
+}
+
+/*
+ * Links op->entry into index, caller has index to itself (cache_mutex or partition owner). A 5xx never replaces a good
+ * entry, it stays to be served stale. Index's reference to a replaced entry passes to op->replaced_entry. Tag and path
+ * indexes are not partitioned, attaching takes their mutexes even on a partition owner.
+ */
+static void index_insert(struct cache_entry **index, struct index_op *op) {
+  struct cache_entry *entry = op->entry, *kept = NULL;
+
+  op->replaced_entry = NULL;
+  if (op->status >= 500) HASH_FIND(hh, *index, &op->key, sizeof(uint64_t), kept);
+  if (kept != NULL && kept->status < 500) {
+    log_debug("[%d] Keeping cached %d over %d response\n", (int) gettid(), kept->status, op->status);
+    op->stored = 0;
+    return;
+  }
+
+  HASH_REPLACE(hh, *index, key, sizeof(uint64_t), entry, op->replaced_entry);
+  if (op->replaced_entry != NULL) {
+    __atomic_store_n(&op->replaced_entry->generation, op->replaced_entry->generation + 1, __ATOMIC_RELEASE);
+    tags_detach(op->replaced_entry);
+    path_index_detach(op->replaced_entry);
+  }
+  tags_attach(entry, op->meta->tags, op->meta->tags_count);
+  if (op->index_path != NULL) path_index_attach(entry, op->index_path);
+  op->stored = 1;
+}
+
+static void partition_insert(void **state, void *arg) {
+  index_insert((struct cache_entry **) state, arg);
+}
+
+/* Entries getting pre-compressed variants */
+static int gets_variants(struct response_meta *meta, uint64_t body_bytes) {
+  return compression && meta->compressible && !meta->encoded && body_bytes >= compression_min_size;
+}
+
+/*
+ * Identity response of an entry with compressed variants varies on Accept-Encoding too, otherwise caches in front of
+ * us could hand it to clients asking for gzip and the other way round. Returns head to store and send, the old one is
+ * freed when it had to be extended.
+ */
+char *vary_on_encoding(char *head, size_t *headers_size, struct response_meta *meta, uint64_t body_bytes) {
+  char *extended;
+
+  if (!gets_variants(meta, body_bytes) || meta->varies_encoding) return head;
+
+  extended = append_header(head, *headers_size, "Vary: Accept-Encoding\r\n", headers_size);
+  free(head);
+  meta->varies_encoding = 1;
+  return extended;
+}
+
+/*
+ * Inserts response under key when its status and TTL allow it. On success the entry takes over head and body
+ * slices and is returned with a reference for caller, who keeps sending from them until cache_release(). Otherwise
+ * they stay with the caller (returns NULL).
+ */
+struct cache_entry *cache_store(uint64_t key, int status, char *head, size_t headers_size, struct slice_buffer *body,
+                                struct response_meta *meta, const char *index_path) {
+  struct cache_entry *entry;
+  struct index_op op = {.key = key, .status = status, .meta = meta, .index_path = index_path};
+  int ttl = status_ttl(status, meta->ttl);
+
+  /* Save to cache only if TTL is greater than zero */
+  if (ttl <= 0) return NULL;
+
+  entry = (struct cache_entry *) arena_calloc(1, sizeof(struct cache_entry));
+  entry->key = key;
+  /* One for index, one for caller */
+  entry->refs = 2;
+  entry->timestamp = get_timestamp() + ttl;
+  entry->bytes = headers_size + body->bytes;
+  entry->headers_size = (u_int32_t) headers_size;
+  entry->status = status;
+  entry->head = head;
+  entry->body = *body;
+  entry->node = (int16_t) nodes_of_memory(body->count > 0 ? body->slices[0] : head);
+
+  op.entry = entry;
+
+  if (partitions_count > 0) {
+    partition_call(partition_of(key), partition_insert, &op);
+  } else {
+    /* Avoid concurrent writes */
+    pthread_mutex_lock(&cache_mutex);
+    index_insert(&cache, &op);
+    pthread_mutex_unlock(&cache_mutex);
+  }
+
+  if (!op.stored) {
+    arena_free(entry);
+    return NULL;
+  }
+
+  metrics_add(METRIC_CACHE_BYTES, (int64_t) entry->bytes);
+  if (op.replaced_entry != NULL) {
+    /* Threads still sending replaced entry hold their own references, it's freed after the last one */
+    metrics_add(METRIC_CACHE_EVICTIONS, 1);
+    cache_release(op.replaced_entry);
+  } else {
+    metrics_add(METRIC_CACHE_ENTRIES, 1);
+  }
+
+  /* Encoded variants are produced by the compression pool, off this thread */
+  if (gets_variants(meta, body->bytes)) {
+    compression_enqueue(entry, headers_size);
+  }
+
+  return entry;
+}
+
+/* Unlinks op->entry if index still maps its key to it, caller has index to itself like for index_insert() */
+static void index_remove(struct cache_entry **index, struct index_op *op) {
+  struct cache_entry *found;
+
+  op->stored = 0;
+  HASH_FIND(hh, *index, &op->entry->key, sizeof(uint64_t), found);
+  if (found != op->entry) return;
+
+  HASH_DEL(*index, found);
+  __atomic_store_n(&found->generation, found->generation + 1, __ATOMIC_RELEASE);
+  tags_detach(found);
+  path_index_detach(found);
+  op->stored = 1;
+}
+
+static void partition_remove(void **state, void *arg) {
+  index_remove((struct cache_entry **) state, arg);
+}
+
+/*
+ * Takes entry out of cache for a hard purge and drops index's reference. It's freed once threads still sending it are
+ * done and front cache slots holding it have seen its generation change on their next lookup. Caller holds its own
+ * reference and no tag or path index mutex. Entry already replaced is left alone.
+ */
+void cache_remove(struct cache_entry *entry) {
+  struct index_op op = {.key = entry->key, .entry = entry};
+
+  if (partitions_count > 0) {
+    partition_call(partition_of(entry->key), partition_remove, &op);
+  } else {
+    pthread_mutex_lock(&cache_mutex);
+    index_remove(&cache, &op);
+    pthread_mutex_unlock(&cache_mutex);
+  }
+
+  if (op.stored) {
+    metrics_add(METRIC_CACHE_ENTRIES, -1);
+    cache_release(entry);
+  }
+}
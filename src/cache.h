@@ -0,0 +1,99 @@
+#ifndef CACHR_CACHE_H
+#define CACHR_CACHE_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "libs/uthash.h"
+#include "libs/picohttpparser.h"
+#include "configutils.h"
+#include "compression.h"
+#include "slices.h"
+#include "tags.h"
+#include "pathindex.h"
+
+/* Pre-encoded copy of a cached response (head and body in one buffer), published once bytes is non-zero */
+struct cache_variant {
+  char *buffer;
+  u_int32_t bytes;
+};
+
+struct cache_entry {
+  uint64_t key;
+  /* Held by index, front cache slots, requests sending entry and its compression task, see cache_release() */
+  uint32_t refs;
+  char* head;
+  /* Expiry in seconds, purges set it to 0 */
+  long timestamp;
+  uint64_t bytes;
+  u_int32_t headers_size;
+  int status;
+  struct slice_buffer body;
+  struct cache_variant variants[ENCODING_COUNT];
+  /* Surrogate keys, guarded by tags.c lock */
+  struct cache_tag_ref *tags;
+  uint16_t tags_count;
+  /* Place in path index when [cache] path_index is on, guarded by pathindex.c lock */
+  struct path_node *path_node;
+  uint32_t path_slot;
+  /* Bumped when entry is unlinked from index, front cache copies taken before that stop matching */
+  uint32_t generation;
+  /* NUMA node holding body (-1 unknown), hits from other nodes and lazily allocated per-node copies, see nodes.c */
+  int16_t node;
+  uint32_t remote_hits;
+  struct cache_replica **replicas;
+  struct UT_hash_handle hh;
+};
+
+#define CACHE_L1_WAYS 2
+
+/*
+ * Set of per-CPU front cache, one cache line. Each slot holds a reference to its entry and generation tells whether
+ * it's still the indexed one. lock is 1 while a thread uses the set.
+ */
+struct cache_l1_set {
+  uint32_t lock;
+  uint32_t generations[CACHE_L1_WAYS];
+  uint64_t keys[CACHE_L1_WAYS];
+  struct cache_entry *entries[CACHE_L1_WAYS];
+} __attribute__((aligned(64)));
+
+/* Bytes held by entry including variants published so far */
+static inline uint64_t cache_entry_size(struct cache_entry *entry) {
+  uint64_t bytes = entry->bytes;
+
+  for (int i = 0; i < ENCODING_COUNT; i++) bytes += __atomic_load_n(&entry->variants[i].bytes, __ATOMIC_ACQUIRE);
+  return bytes;
+}
+
+/* What response headers say about body framing and caching, filled by parse_response_headers() */
+struct response_meta {
+  int ttl;
+  long long content_length;
+  int chunked;
+  /* Offsets of the Transfer-Encoding line in response head */
+  size_t te_start;
+  size_t te_end;
+  int compressible;
+  int encoded;
+  /* Vary already covers Accept-Encoding (or is "*") */
+  int varies_encoding;
+  uint64_t tags[CACHE_TAGS_MAX];
+  int tags_count;
+};
+
+extern struct cache_entry *cache;
+extern pthread_mutex_t cache_mutex;
+
+void cache_init(configuration *cfg);
+struct cache_entry *cache_find(uint64_t key);
+void cache_retain(struct cache_entry *entry);
+void cache_release(struct cache_entry *entry);
+int get_ttl_value(char *header_value);
+void parse_response_headers(char *head, struct phr_header *headers, size_t num_headers, struct response_meta *meta);
+char *vary_on_encoding(char *head, size_t *headers_size, struct response_meta *meta, uint64_t body_bytes);
+struct cache_entry *cache_store(uint64_t key, int status, char *head, size_t headers_size, struct slice_buffer *body,
+                               struct response_meta *meta, const char *index_path);
+void cache_remove(struct cache_entry *entry);
+
+#endif //CACHR_CACHE_H
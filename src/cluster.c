@@ -0,0 +1,363 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+
+#include "cluster.h"
+#include "cache.h"
+#include "netutils.h"
+#include "metrics.h"
+#include "log.h"
+#include "utils.h"
+
+/*
+ * Members listed in [cluster] peer split keys by rendezvous hashing: a key belongs to the member with the highest
+ * mix64(key ^ id). Misses for keys owned elsewhere are fetched from the owner over persistent connections to its peer
+ * listener, owner answers from its cache or fetches from origin and caches the response. Peer listener never forwards
+ * further, so a request makes at most one hop. Ejected members lose their keys to the next member in rank.
+ */
+
+/* Requests forwarded by peers are GETs without body, anything larger is rejected */
+#define CLUSTER_REQUEST_MAX 65536
+
+static struct peer *peers = NULL;
+static int peers_count = 0;
+static struct peer *self = NULL;
+static configuration *cluster_cfg;
+static int listen_sck = -1;
+
+static int parse_peer(const char *line, struct peer *peer) {
+  char host[256];
+  unsigned int port;
+
+  if (sscanf(line, "[%255[^]]]:%u", host, &port) != 2 && sscanf(line, "%255[^:]:%u", host, &port) != 2) return -1;
+
+  memset(peer, 0, sizeof(struct peer));
+  peer->name = strdup(line);
+  peer->id = mix64(hash_buffer(peer->name));
+  peer->self = cluster_cfg->cluster_self != NULL && strcmp(line, cluster_cfg->cluster_self) == 0;
+  if (!peer->self) peer->resolved = resolver_add(host, (unsigned short) port);
+  pthread_mutex_init(&peer->lock, NULL);
+  return 0;
+}
+
+/* Reads [cluster] peers, has to run before upstream_init() starts resolver thread */
+int cluster_init(configuration *cfg) {
+  if (cfg->cluster_peers_count == 0) return 0;
+
+  cluster_cfg = cfg;
+  peers = calloc(cfg->cluster_peers_count, sizeof(struct peer));
+
+  for (int i = 0; i < cfg->cluster_peers_count; i++) {
+    if (parse_peer(cfg->cluster_peers[i], &peers[peers_count]) != 0) {
+      log_error("[cluster] Invalid peer '%s'\n", cfg->cluster_peers[i]);
+      continue;
+    }
+    if (peers[peers_count].self) self = &peers[peers_count];
+    peers_count++;
+  }
+
+  if (self == NULL) {
+    log_error("[cluster] self = '%s' is not one of the peers\n", cfg->cluster_self != NULL ? cfg->cluster_self : "");
+    return -1;
+  }
+
+  log_info("[cluster] Member %s of %d, peers are ejected after %u failures for %u ms\n", self->name, peers_count,
+           cfg->cluster_max_fails, cfg->cluster_fail_timeout);
+  return 0;
+}
+
+/* Peer owning key, NULL when it's this member or cluster is off */
+struct peer *cluster_owner(uint64_t key) {
+  struct peer *owner = NULL;
+  uint64_t best = 0;
+  long now;
+
+  if (peers_count < 2) return NULL;
+
+  now = get_time_ms();
+  for (int i = 0; i < peers_count; i++) {
+    uint64_t score;
+
+    if (!peers[i].self && __atomic_load_n(&peers[i].ejected_until, __ATOMIC_RELAXED) > now) continue;
+
+    score = mix64(key ^ peers[i].id);
+    if (owner == NULL || score > best) {
+      owner = &peers[i];
+      best = score;
+    }
+  }
+
+  return owner == self ? NULL : owner;
+}
+
+static void peer_failed(struct peer *peer) {
+  long now = get_time_ms();
+
+  metrics_add(METRIC_CLUSTER_ERRORS, 1);
+  if (__atomic_add_fetch(&peer->fails, 1, __ATOMIC_RELAXED) < (int) cluster_cfg->cluster_max_fails) return;
+
+  /* Keys of ejected peer go to next member in rank until fail_timeout passes, then one failure ejects it again */
+  if (__atomic_exchange_n(&peer->ejected_until, now + cluster_cfg->cluster_fail_timeout, __ATOMIC_RELAXED) <= now) {
+    log_warn("[cluster] Peer %s ejected for %u ms\n", peer->name, cluster_cfg->cluster_fail_timeout);
+    metrics_add(METRIC_CLUSTER_EJECTIONS, 1);
+  }
+
+  pthread_mutex_lock(&peer->lock);
+  while (peer->idle_count > 0) close(peer->idle[--peer->idle_count]);
+  pthread_mutex_unlock(&peer->lock);
+}
+
+static void peer_succeeded(struct peer *peer) {
+  if (__atomic_exchange_n(&peer->fails, 0, __ATOMIC_RELAXED) >= (int) cluster_cfg->cluster_max_fails) {
+    log_info("[cluster] Peer %s is back\n", peer->name);
+  }
+}
+
+/* Most recently used idle connection, it's the least likely to be closed by now */
+static int take_connection(struct peer *peer) {
+  int fd = -1;
+
+  pthread_mutex_lock(&peer->lock);
+  if (peer->idle_count > 0) fd = peer->idle[--peer->idle_count];
+  pthread_mutex_unlock(&peer->lock);
+  return fd;
+}
+
+static void give_connection(struct peer *peer, int fd) {
+  pthread_mutex_lock(&peer->lock);
+  if (peer->idle_count < CLUSTER_IDLE_MAX) {
+    peer->idle[peer->idle_count++] = fd;
+    fd = -1;
+  }
+  pthread_mutex_unlock(&peer->lock);
+
+  if (fd >= 0) close(fd);
+}
+
+/*
+ * Sends client's request as it is to owning peer, so owner computes the same cache key. Returns 0 with response
+ * filled in, which caller frees with fetch_response_free(), or -1 when peer failed or answered with a 5xx.
+ */
+int cluster_fetch(struct peer *peer, char *request, size_t size, struct fetch_response *response) {
+  long started = get_time_us();
+  int fd = -1, ret = -1;
+
+  memset(response, 0, sizeof(struct fetch_response));
+
+  /* Owner may have closed an idle connection meanwhile, that's retried once on a new one */
+  for (int attempt = 0; attempt < 2; attempt++) {
+    int reused = (fd = take_connection(peer)) >= 0;
+
+    if (!reused) {
+      if ((fd = fetch_connect(peer->resolved, cluster_cfg->connect_timeout)) < 0) break;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int) {1}, sizeof(int));
+    }
+
+    fetch_response_free(response);
+    memset(response, 0, sizeof(struct fetch_response));
+    response->meta.content_length = -1;
+
+    if (fetch_send(fd, request, size, cluster_cfg->idle_timeout) == 0) {
+      ret = fetch_read_response(fd, cluster_cfg->cluster_timeout, cluster_cfg->idle_timeout, started, response);
+    } else {
+      ret = -2;
+    }
+
+    if (ret == 0) break;
+    close(fd);
+    fd = -1;
+    if (!reused) break;
+  }
+
+  if (ret != 0) {
+    log_warn("[cluster] Peer %s failed to answer\n", peer->name);
+    fetch_response_free(response);
+    peer_failed(peer);
+    return -1;
+  }
+
+  peer_succeeded(peer);
+  metrics_add(METRIC_CLUSTER_REQUESTS, 1);
+
+  /* Owner keeps connection open unless body was delimited by closing it */
+  if (response->meta.content_length != -1 || response->status == 204 || response->status == 304) {
+    give_connection(peer, fd);
+  } else {
+    close(fd);
+  }
+
+  /* Owner couldn't get a response from its origin, requester tries its own origin path and max_stale */
+  if (response->status >= 500) {
+    log_warn("[cluster] Peer %s answered %d, falling back to origin\n", peer->name, response->status);
+    fetch_response_free(response);
+    return -1;
+  }
+  return 0;
+}
+
+/* Whether body of head is delimited by Content-Length, otherwise connection has to be closed after it */
+static int framed(char *head, size_t headers_size) {
+  struct phr_header headers[100];
+  size_t num_headers = sizeof(headers) / sizeof(headers[0]), msg_len;
+  const char *msg;
+  int minor_version, status;
+
+  if (phr_parse_response(head, headers_size, &minor_version, &status, &msg, &msg_len, headers, &num_headers, 0) <= 0) {
+    return 0;
+  }
+  if (status == 204 || status == 304) return 1;
+
+  for (size_t i = 0; i < num_headers; i++) {
+    if (headers[i].name_len == 14 && strncasecmp(headers[i].name, "Content-Length", 14) == 0) return 1;
+  }
+  return 0;
+}
+
+/* Returns -1 when connection can't carry another response */
+static int send_to_peer(int fd, char *head, size_t headers_size, struct slice_buffer *body) {
+  int iovcnt = 1 + slice_buffer_span(0, body->bytes), ret;
+  struct iovec *iov = malloc(sizeof(struct iovec) * iovcnt);
+
+  iov[0].iov_base = head;
+  iov[0].iov_len = headers_size;
+  slice_buffer_iovecs(body, 0, body->bytes, iov + 1);
+
+  ret = write_all(fd, iov, iovcnt);
+  free(iov);
+  return ret == 0 && framed(head, headers_size) ? 0 : -1;
+}
+
+/* Answers forwarded request from cache or origin, it's never forwarded again */
+static int serve_peer_request(int fd, struct fetch_pool *pool, struct fetch_request *request) {
+  static const char bad_gateway[] = "HTTP/1.1 502 Bad Gateway\r\nContent-Length: 0\r\n\r\n";
+  struct fetch_response response;
+  struct cache_entry *found;
+  struct iovec iov;
+  int ret;
+
+  metrics_add(METRIC_REQUESTS, 1);
+  metrics_add(METRIC_CLUSTER_SERVED, 1);
+
+  found = cache_find(request->key);
+  if (found != NULL && found->timestamp > get_timestamp()) {
+    metrics_add(METRIC_CACHE_HITS, 1);
+    ret = send_to_peer(fd, found->head, found->headers_size, &found->body);
+    cache_release(found);
+    return ret;
+  }
+  cache_release(found);
+
+  metrics_add(METRIC_CACHE_MISSES, 1);
+  if (fetch_origin(pool, request, &response) != 0) {
+    iov.iov_base = (char *) bad_gateway;
+    iov.iov_len = sizeof(bad_gateway) - 1;
+    return write_all(fd, &iov, 1);
+  }
+
+  ret = send_to_peer(fd, response.head, response.headers_size, &response.body);
+  fetch_response_free(&response);
+  return ret;
+}
+
+/* Persistent connection from another member, requests on it are served one by one */
+static void *peer_connection(void *ctx) {
+  int fd = (int) (long) ctx;
+  char *buffer = malloc(CLUSTER_REQUEST_MAX);
+  size_t size = 0;
+  struct fetch_pool pool;
+  struct fetch_request request;
+  struct timeval idle = {cluster_cfg->idle_timeout / 1000, (cluster_cfg->idle_timeout % 1000) * 1000};
+
+  fetch_pool_init(&pool, cluster_cfg);
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+
+  while (1) {
+    ssize_t rsize = read(fd, buffer + size, CLUSTER_REQUEST_MAX - size);
+    int pret;
+
+    if (rsize == -1 && errno == EINTR) continue;
+    if (rsize <= 0) break;
+    size += rsize;
+    metrics_add(METRIC_BYTES_IN, rsize);
+
+    request.buffer = buffer;
+    request.size = size;
+    pret = fetch_parse_request(&request);
+    if (pret == -2 && size < CLUSTER_REQUEST_MAX) continue;
+    if (pret < 0) break;
+
+    /* Only headers, requests with body are never forwarded */
+    request.size = (size_t) request.headers_size;
+    if (serve_peer_request(fd, &pool, &request) != 0) break;
+
+    memmove(buffer, buffer + request.headers_size, size - (size_t) request.headers_size);
+    size -= (size_t) request.headers_size;
+  }
+
+  fetch_pool_close(&pool);
+  free(buffer);
+  close(fd);
+  return NULL;
+}
+
+static void *peer_listener(void *ctx) {
+  struct pollfd pfd = {.fd = listen_sck, .events = POLLIN};
+
+  while (1) {
+    pthread_t thid;
+    int fd;
+
+    if (poll(&pfd, 1, -1) <= 0) continue;
+    if ((fd = accept(listen_sck, NULL, NULL)) < 0) continue;
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int) {1}, sizeof(int));
+    if (pthread_create(&thid, NULL, peer_connection, (void *) (long) fd) == 0) {
+      pthread_detach(thid);
+    } else {
+      log_error("[cluster] Failed to create peer connection thread.\n");
+      close(fd);
+    }
+  }
+
+  return NULL;
+}
+
+/* Listens for other members on self's address */
+int cluster_start() {
+  char host[256], port[8];
+  unsigned int port_number;
+  pthread_t thid;
+
+  if (self == NULL) return 0;
+
+  if (sscanf(self->name, "[%255[^]]]:%u", host, &port_number) != 2 &&
+      sscanf(self->name, "%255[^:]:%u", host, &port_number) != 2) {
+    return -1;
+  }
+  sprintf(port, "%u", port_number);
+
+  listen_sck = prepare_listen_sock(host, port);
+  if (listen_sck < 0) {
+    log_error("[cluster] Failed to listen on %s\n", self->name);
+    return -1;
+  }
+
+  if (pthread_create(&thid, NULL, peer_listener, NULL) != 0) {
+    log_error("[cluster] Failed to create peer listener thread.\n");
+    return -1;
+  }
+
+  pthread_detach(thid);
+  log_info("[cluster] Listening for peers on %s\n", self->name);
+  return 0;
+}
@@ -0,0 +1,36 @@
+#ifndef CACHR_CLUSTER_H
+#define CACHR_CLUSTER_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "configutils.h"
+#include "resolver.h"
+#include "fetch.h"
+
+/* Idle connections kept open to each peer at most */
+#define CLUSTER_IDLE_MAX 64
+
+struct peer {
+  /* "host:port" of peer listener, as written in [cluster] peer */
+  char *name;
+  struct resolved_host *resolved;
+  /* Rendezvous hashing seed, hash of name so that every member ranks peers the same way */
+  uint64_t id;
+  int self;
+
+  /* Ejected until ejected_until (ms) after max_fails consecutive failures */
+  int fails;
+  long ejected_until;
+
+  /* Persistent connections waiting for next request, guarded by lock */
+  int idle[CLUSTER_IDLE_MAX];
+  int idle_count;
+  pthread_mutex_t lock;
+};
+
+int cluster_init(configuration *cfg);
+int cluster_start();
+struct peer *cluster_owner(uint64_t key);
+int cluster_fetch(struct peer *peer, char *request, size_t size, struct fetch_response *response);
+
+#endif //CACHR_CLUSTER_H
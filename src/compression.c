@@ -0,0 +1,305 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <pthread.h>
+#ifdef CACHR_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef CACHR_HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+#ifdef CACHR_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "compression.h"
+#include "cache.h"
+#include "tasks.h"
+#include "metrics.h"
+#include "request.h"
+#include "log.h"
+#include "libs/picohttpparser.h"
+
+/* Content-Encoding and Content-Length lines with a 20 digit length, ETag's encoding suffix and empty line */
+#define VARIANT_HEAD_FIXED 96
+
+struct compression_job {
+  struct cache_entry *entry;
+  size_t headers_size;
+};
+
+static int pool_level = 6;
+
+static const char *compressible_types[] = {
+  "text/", "application/json", "application/javascript", "application/xml", "application/xhtml+xml",
+  "image/svg+xml", NULL
+};
+
+int is_compressible(const char *content_type) {
+  for (int i = 0; compressible_types[i] != NULL; i++) {
+    if (strncasecmp(content_type, compressible_types[i], strlen(compressible_types[i])) == 0) return 1;
+  }
+  return 0;
+}
+
+const char *encoding_name(int encoding) {
+  switch (encoding) {
+    case ENCODING_BROTLI:
+      return "br";
+    case ENCODING_ZSTD:
+      return "zstd";
+    case ENCODING_GZIP:
+      return "gzip";
+    default:
+      return "identity";
+  }
+}
+
+static int encoding_available(int encoding) {
+  switch (encoding) {
+#ifdef CACHR_HAVE_BROTLI
+    case ENCODING_BROTLI:
+      return 1;
+#endif
+#ifdef CACHR_HAVE_ZSTD
+    case ENCODING_ZSTD:
+      return 1;
+#endif
+#ifdef CACHR_HAVE_ZLIB
+    case ENCODING_GZIP:
+      return 1;
+#endif
+    default:
+      return 0;
+  }
+}
+
+/* Returns bitmask of (1 << encoding) for every coding the client accepts */
+int parse_accept_encoding(const char *value) {
+  int accepted = 0;
+  char *copy = strdup(value), *saveptr = NULL, *token;
+
+  for (token = strtok_r(copy, ",", &saveptr); token != NULL; token = strtok_r(NULL, ",", &saveptr)) {
+    char *params = strchr(token, ';');
+
+    while (*token == ' ') token++;
+    if (params != NULL) {
+      *params++ = '\0';
+      while (*params == ' ') params++;
+
+      /* "q=0" explicitly refuses the coding */
+      if (strncmp(params, "q=0", 3) == 0 && strspn(params + 3, ".0") == strlen(params + 3)) continue;
+    }
+    token[strcspn(token, " ")] = '\0';
+
+    for (int encoding = 0; encoding < ENCODING_COUNT; encoding++) {
+      if (strcasecmp(token, encoding_name(encoding)) == 0) accepted |= 1 << encoding;
+    }
+  }
+
+  free(copy);
+  return accepted;
+}
+
+/* Picks the most preferred variant that is both accepted and already compressed, -1 for identity */
+int select_encoding(int accepted, struct cache_entry *entry) {
+  if (accepted == 0) return -1;
+
+  for (int encoding = 0; encoding < ENCODING_COUNT; encoding++) {
+    if ((accepted & (1 << encoding)) && __atomic_load_n(&entry->variants[encoding].bytes, __ATOMIC_ACQUIRE) > 0) {
+      return encoding;
+    }
+  }
+  return -1;
+}
+
+int encode_buffer(int encoding, int level, const char *in, size_t in_len, char **out, size_t *out_len) {
+  switch (encoding) {
+#ifdef CACHR_HAVE_ZLIB
+    case ENCODING_GZIP: {
+      z_stream strm;
+      memset(&strm, 0, sizeof(strm));
+
+      /* 15 + 16 window bits selects gzip framing */
+      if (deflateInit2(&strm, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) return -1;
+
+      *out_len = deflateBound(&strm, (uLong) in_len);
+      *out = malloc(*out_len);
+      strm.next_in = (Bytef *) in;
+      strm.avail_in = (uInt) in_len;
+      strm.next_out = (Bytef *) *out;
+      strm.avail_out = (uInt) *out_len;
+
+      if (deflate(&strm, Z_FINISH) != Z_STREAM_END) {
+        deflateEnd(&strm);
+        free(*out);
+        return -1;
+      }
+
+      *out_len = strm.total_out;
+      deflateEnd(&strm);
+      return 0;
+    }
+#endif
+#ifdef CACHR_HAVE_BROTLI
+    case ENCODING_BROTLI: {
+      /* Brotli quality goes up to 11, map zlib-style levels onto it */
+      int quality = level > BROTLI_MAX_QUALITY ? BROTLI_MAX_QUALITY : level;
+
+      *out_len = BrotliEncoderMaxCompressedSize(in_len);
+      *out = malloc(*out_len);
+
+      if (!BrotliEncoderCompress(quality, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, in_len, (const uint8_t *) in,
+                                 out_len, (uint8_t *) *out)) {
+        free(*out);
+        return -1;
+      }
+      return 0;
+    }
+#endif
+#ifdef CACHR_HAVE_ZSTD
+    case ENCODING_ZSTD: {
+      size_t ret;
+
+      *out_len = ZSTD_compressBound(in_len);
+      *out = malloc(*out_len);
+      ret = ZSTD_compress(*out, *out_len, in, in_len, level);
+
+      if (ZSTD_isError(ret)) {
+        free(*out);
+        return -1;
+      }
+      *out_len = ret;
+      return 0;
+    }
+#endif
+    default:
+      return -1;
+  }
+}
+
+/*
+ * Copies response head without Content-Length and appends encoding headers followed by encoded body. Identity head
+ * already varies on Accept-Encoding (see vary_on_encoding()). Variant's ETag gets encoding's suffix, it's a different
+ * representation and must not validate against the identity one.
+ */
+static char *build_variant(const char *response_head, size_t headers_size, int encoding, const char *body,
+                           size_t body_len, size_t *variant_len) {
+  int minor_version, status;
+  const char *msg;
+  size_t msg_len, num_headers;
+  struct phr_header headers[100];
+  char *buffer, *status_end;
+  size_t offset;
+
+  num_headers = sizeof(headers) / sizeof(headers[0]);
+  if (phr_parse_response(response_head, headers_size, &minor_version, &status, &msg, &msg_len, headers,
+                         &num_headers, 0) != (int) headers_size) {
+    return NULL;
+  }
+
+  status_end = memchr(response_head, '\n', headers_size);
+  offset = (size_t) (status_end - response_head) + 1;
+  buffer = malloc(offset + headers_emit_size(headers, num_headers) + VARIANT_HEAD_FIXED + body_len);
+  memcpy(buffer, response_head, offset);
+
+  for (size_t i = 0; i < num_headers; i++) {
+    if (headers[i].name == NULL ||
+        (headers[i].name_len == 14 && strncasecmp(headers[i].name, "Content-Length", 14) == 0)) {
+      continue;
+    }
+    if (headers[i].name_len == 4 && strncasecmp(headers[i].name, "ETag", 4) == 0) {
+      /* "tag" becomes "tag-br", W/"tag" stays weak. Unquoted tags are invalid, they are dropped */
+      if (headers[i].value_len >= 2 && headers[i].value[headers[i].value_len - 1] == '"') {
+        offset += sprintf(buffer + offset, "ETag: %.*s-%s\"\r\n", (int) headers[i].value_len - 1, headers[i].value,
+                          encoding_name(encoding));
+      }
+      continue;
+    }
+    offset += sprintf(buffer + offset, "%.*s: %.*s\r\n", (int) headers[i].name_len, headers[i].name,
+                      (int) headers[i].value_len, headers[i].value);
+  }
+
+  offset += sprintf(buffer + offset, "Content-Encoding: %s\r\nContent-Length: %zu\r\n\r\n",
+                    encoding_name(encoding), body_len);
+  memcpy(buffer + offset, body, body_len);
+
+  *variant_len = offset + body_len;
+  return buffer;
+}
+
+static void compress_entry(struct cache_entry *entry, size_t headers_size) {
+  size_t identity_len = (size_t) entry->body.bytes;
+  char *identity = entry->body.count > 0 ? entry->body.slices[0] : NULL;
+
+  /* Variant sizes are 32-bit */
+  if (identity_len == 0 || identity_len > UINT32_MAX / 2) return;
+
+  /* Encoders need contiguous input, bodies spanning several slices are copied together for the job's duration */
+  if (entry->body.count > 1) {
+    identity = malloc(identity_len);
+    for (u_int32_t i = 0; i < entry->body.count; i++) {
+      size_t start = (size_t) i * SLICE_SIZE;
+      memcpy(identity + start, entry->body.slices[i],
+             identity_len - start < SLICE_SIZE ? identity_len - start : SLICE_SIZE);
+    }
+  }
+
+  for (int encoding = 0; encoding < ENCODING_COUNT; encoding++) {
+    char *body, *variant;
+    size_t body_len, variant_len;
+
+    if (!encoding_available(encoding)) continue;
+    if (encode_buffer(encoding, pool_level, identity, identity_len, &body, &body_len) != 0) {
+      continue;
+    }
+
+    /* Keep only variants that actually save bandwidth */
+    if (body_len < identity_len) {
+      variant = build_variant(entry->head, headers_size, encoding, body, body_len, &variant_len);
+
+      if (variant != NULL) {
+        entry->variants[encoding].buffer = variant;
+        __atomic_store_n(&entry->variants[encoding].bytes, (u_int32_t) variant_len, __ATOMIC_RELEASE);
+        metrics_add(METRIC_CACHE_BYTES, (int64_t) variant_len);
+        log_debug("[compression] %s variant: %d -> %d bytes\n", encoding_name(encoding), (int) identity_len,
+                  (int) body_len);
+      }
+    }
+    free(body);
+  }
+
+  if (entry->body.count > 1) free(identity);
+}
+
+static void compression_task(void *arg) {
+  struct compression_job *job = arg;
+
+  compress_entry(job->entry, job->headers_size);
+  cache_release(job->entry);
+  free(job);
+}
+
+void compression_init(int level) {
+  pool_level = level > 0 ? level : 6;
+}
+
+/* Schedules pre-compression of a freshly inserted entry on the task pool, returns -1 when pool is off or full */
+int compression_enqueue(struct cache_entry *entry, size_t headers_size) {
+  struct compression_job *job = malloc(sizeof(struct compression_job));
+
+  /* Job keeps entry alive while it's compressed, even when it's replaced meanwhile */
+  cache_retain(entry);
+  job->entry = entry;
+  job->headers_size = headers_size;
+
+  /* Entries the pool can't take now are served uncompressed */
+  if (tasks_submit(compression_task, job, -1) != 0) {
+    cache_release(entry);
+    free(job);
+    return -1;
+  }
+  return 0;
+}
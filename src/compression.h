@@ -0,0 +1,25 @@
+#ifndef CACHR_COMPRESSION_H
+#define CACHR_COMPRESSION_H
+
+#include <stddef.h>
+
+/* Encodings stored next to the identity body, in order of preference */
+enum content_encoding {
+  ENCODING_BROTLI = 0,
+  ENCODING_ZSTD,
+  ENCODING_GZIP,
+  ENCODING_COUNT
+};
+
+struct cache_entry;
+
+int is_compressible(const char *content_type);
+int parse_accept_encoding(const char *value);
+int select_encoding(int accepted, struct cache_entry *entry);
+const char *encoding_name(int encoding);
+int encode_buffer(int encoding, int level, const char *in, size_t in_len, char **out, size_t *out_len);
+
+void compression_init(int level);
+int compression_enqueue(struct cache_entry *entry, size_t headers_size);
+
+#endif //CACHR_COMPRESSION_H
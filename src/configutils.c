@@ -1,6 +1,39 @@
 #include <string.h>
 #include <stdlib.h>
 #include "configutils.h"
+#include "log.h"
+
+/* Values used when option is missing from config */
+void set_config_defaults(configuration *pconfig) {
+  pconfig->log_level = LOG_INFO;
+  pconfig->slow_request_threshold = 1000;
+  pconfig->slow_request_sample = 1;
+  pconfig->access_log_segment_size = 16;
+  pconfig->access_log_rotate_interval = 3600;
+  pconfig->connect_timeout = 3000;
+  pconfig->first_byte_timeout = 30000;
+  pconfig->idle_timeout = 30000;
+  pconfig->max_fails = 3;
+  pconfig->fail_timeout = 10000;
+  pconfig->concurrency_max = 1000;
+  pconfig->latency_tolerance = 2.0;
+  pconfig->dns_refresh = 30000;
+  pconfig->dns_min_ttl = 1000;
+  pconfig->ttl_3xx = 300;
+  pconfig->ttl_4xx = 10;
+  pconfig->cache_l1_sets = 256;
+  pconfig->cache_partitions = 0;
+  pconfig->arena_size = 0;
+  pconfig->arena_huge_pages = "auto";
+  pconfig->prefetch_concurrency = 8;
+  pconfig->cluster_timeout = 5000;
+  pconfig->cluster_max_fails = 3;
+  pconfig->cluster_fail_timeout = 10000;
+  pconfig->numa_replicate_hits = 100;
+  pconfig->numa_replica_memory = 256;
+  pconfig->tasks_threads = 2;
+  pconfig->tasks_queue = 1024;
+}
 
 /* Ini -> Struct parser */
 int config_handler(void *user, const char *section, const char *name, const char *value) {
@@ -11,16 +44,118 @@ int config_handler(void *user, const char *section, const char *name, const char
     pconfig->target_port = (unsigned short) atoi(value);
   } else if (MATCH("target", "host")) {
     pconfig->target_host = strdup(value);
+  } else if (MATCH("target", "connect_timeout")) {
+    pconfig->connect_timeout = (unsigned int) atoi(value);
+  } else if (MATCH("target", "first_byte_timeout")) {
+    pconfig->first_byte_timeout = (unsigned int) atoi(value);
+  } else if (MATCH("target", "idle_timeout")) {
+    pconfig->idle_timeout = (unsigned int) atoi(value);
   } else if (MATCH("listen", "port")) {
     pconfig->listen_port = strdup(value);
   } else if (MATCH("listen", "host")) {
     pconfig->listen_host = strdup(value);
+  } else if (MATCH("log", "level")) {
+    /* Unknown names keep the default */
+    if (parse_log_level(value) >= 0) pconfig->log_level = parse_log_level(value);
+  } else if (MATCH("trace", "slow_threshold")) {
+    pconfig->slow_request_threshold = (unsigned int) atoi(value);
+  } else if (MATCH("trace", "slow_sample")) {
+    pconfig->slow_request_sample = (unsigned int) atoi(value);
+  } else if (MATCH("access_log", "path")) {
+    pconfig->access_log_path = strdup(value);
+  } else if (MATCH("access_log", "segment_size")) {
+    pconfig->access_log_segment_size = (unsigned int) atoi(value);
+  } else if (MATCH("access_log", "rotate_interval")) {
+    pconfig->access_log_rotate_interval = (unsigned int) atoi(value);
+  } else if (MATCH("admin", "host")) {
+    pconfig->admin_host = strdup(value);
+  } else if (MATCH("admin", "port")) {
+    pconfig->admin_port = strdup(value);
   } else if (MATCH("poll", "fds_count")) {
     pconfig->fds_count = (unsigned short) atoi(value);
   } else if (MATCH("socket", "non_blocking")) {
     pconfig->non_blocking = (unsigned short) atoi(value);
   } else if (MATCH("cache", "ttl")) {
     pconfig->ttl = (unsigned short) atoi(value);
+  } else if (MATCH("cache", "ttl_3xx")) {
+    pconfig->ttl_3xx = (unsigned int) atoi(value);
+  } else if (MATCH("cache", "ttl_4xx")) {
+    pconfig->ttl_4xx = (unsigned int) atoi(value);
+  } else if (MATCH("cache", "ttl_5xx")) {
+    pconfig->ttl_5xx = (unsigned int) atoi(value);
+  } else if (MATCH("cache", "path_index")) {
+    pconfig->path_index = (unsigned short) atoi(value);
+  } else if (MATCH("cache", "l1_sets")) {
+    pconfig->cache_l1_sets = (unsigned int) atoi(value);
+  } else if (MATCH("cache", "partitions")) {
+    pconfig->cache_partitions = (unsigned int) atoi(value);
+  } else if (MATCH("cache", "arena_size")) {
+    pconfig->arena_size = (unsigned int) atoi(value);
+  } else if (MATCH("cache", "arena_huge_pages")) {
+    pconfig->arena_huge_pages = strdup(value);
+  } else if (MATCH("cache", "max_stale")) {
+    pconfig->max_stale = (unsigned int) atoi(value);
+  } else if (MATCH("upstream", "backend")) {
+    pconfig->backends = realloc(pconfig->backends, sizeof(char *) * (pconfig->backends_count + 1));
+    pconfig->backends[pconfig->backends_count++] = strdup(value);
+  } else if (MATCH("upstream", "balancing")) {
+    pconfig->balancing = strdup(value);
+  } else if (MATCH("upstream", "health_check_interval")) {
+    pconfig->health_check_interval = (unsigned int) atoi(value);
+  } else if (MATCH("upstream", "health_check_path")) {
+    pconfig->health_check_path = strdup(value);
+  } else if (MATCH("upstream", "max_fails")) {
+    pconfig->max_fails = (unsigned short) atoi(value);
+  } else if (MATCH("upstream", "fail_timeout")) {
+    pconfig->fail_timeout = (unsigned int) atoi(value);
+  } else if (MATCH("upstream", "concurrency_limit")) {
+    pconfig->concurrency_limit = (unsigned int) atoi(value);
+  } else if (MATCH("upstream", "concurrency_max")) {
+    pconfig->concurrency_max = (unsigned int) atoi(value);
+  } else if (MATCH("upstream", "latency_tolerance")) {
+    pconfig->latency_tolerance = atof(value);
+  } else if (MATCH("upstream", "dns_refresh")) {
+    pconfig->dns_refresh = (unsigned int) atoi(value);
+  } else if (MATCH("upstream", "dns_min_ttl")) {
+    pconfig->dns_min_ttl = (unsigned int) atoi(value);
+  } else if (MATCH("compression", "enabled")) {
+    pconfig->compression = (unsigned short) atoi(value);
+  } else if (MATCH("compression", "level")) {
+    pconfig->compression_level = (unsigned short) atoi(value);
+  } else if (MATCH("compression", "min_size")) {
+    pconfig->compression_min_size = (unsigned int) atoi(value);
+  } else if (MATCH("prefetch", "file")) {
+    pconfig->prefetch_file = strdup(value);
+  } else if (MATCH("prefetch", "concurrency")) {
+    pconfig->prefetch_concurrency = (unsigned int) atoi(value);
+  } else if (MATCH("prefetch", "rate")) {
+    pconfig->prefetch_rate = (unsigned int) atoi(value);
+  } else if (MATCH("prefetch", "host")) {
+    pconfig->prefetch_host = strdup(value);
+  } else if (MATCH("prefetch", "headers")) {
+    pconfig->prefetch_headers = strdup(value);
+  } else if (MATCH("cluster", "peer")) {
+    pconfig->cluster_peers = realloc(pconfig->cluster_peers, sizeof(char *) * (pconfig->cluster_peers_count + 1));
+    pconfig->cluster_peers[pconfig->cluster_peers_count++] = strdup(value);
+  } else if (MATCH("cluster", "self")) {
+    pconfig->cluster_self = strdup(value);
+  } else if (MATCH("cluster", "timeout")) {
+    pconfig->cluster_timeout = (unsigned int) atoi(value);
+  } else if (MATCH("cluster", "max_fails")) {
+    pconfig->cluster_max_fails = (unsigned int) atoi(value);
+  } else if (MATCH("cluster", "fail_timeout")) {
+    pconfig->cluster_fail_timeout = (unsigned int) atoi(value);
+  } else if (MATCH("numa", "enabled")) {
+    pconfig->numa = (unsigned short) atoi(value);
+  } else if (MATCH("numa", "replicate_hits")) {
+    pconfig->numa_replicate_hits = (unsigned int) atoi(value);
+  } else if (MATCH("numa", "replica_memory")) {
+    pconfig->numa_replica_memory = (unsigned int) atoi(value);
+  } else if (MATCH("tasks", "threads") || MATCH("compression", "threads")) {
+    /* [compression] threads predates the shared pool */
+    pconfig->tasks_threads = (unsigned short) atoi(value);
+  } else if (MATCH("tasks", "queue")) {
+    pconfig->tasks_queue = (unsigned int) atoi(value);
   } else {
     return 0;
   }
@@ -5,15 +5,102 @@ typedef struct {
   const char *target_host;
   unsigned short target_port;
 
+  /* Upstream timeouts in milliseconds */
+  unsigned int connect_timeout;
+  unsigned int first_byte_timeout;
+  unsigned int idle_timeout;
+
   const char *listen_host;
   const char *listen_port;
 
+  /* Binary access log directory (disabled when unset), segment size in MiB, rotation in seconds */
+  const char *access_log_path;
+  unsigned int access_log_segment_size;
+  unsigned int access_log_rotate_interval;
+
+  /* Admin listener (metrics), disabled without port */
+  const char *admin_host;
+  const char *admin_port;
+
+  /* Runtime log level, levels above CACHR_LOG_LEVEL are compiled out regardless */
+  int log_level;
+
+  /* Requests slower than threshold (ms, 0 disables) get their phase breakdown logged, one in slow_request_sample */
+  unsigned int slow_request_threshold;
+  unsigned int slow_request_sample;
+
   unsigned short fds_count;
   unsigned short non_blocking;
 
   unsigned int ttl;
+  /* Seconds 3xx, 4xx and 5xx responses may be cached for at most, 0 doesn't cache the class */
+  unsigned int ttl_3xx;
+  unsigned int ttl_4xx;
+  unsigned int ttl_5xx;
+  /* Seconds past expiry an entry may still be served while no backend can take the request */
+  unsigned int max_stale;
+  /* Radix tree over request paths for prefix and wildcard purges */
+  unsigned short path_index;
+  /* Sets (2 entries each) of per-CPU front cache in front of cache index, 0 disables it */
+  unsigned int cache_l1_sets;
+  /* Cache index split over this many pinned owner threads, 0 keeps one index under a mutex */
+  unsigned int cache_partitions;
+  /* MiB region for index, entries and bodies (0 uses malloc) and its backing: auto, hugetlb, thp or off */
+  unsigned int arena_size;
+  const char *arena_huge_pages;
+
+  /* [upstream] backends as "host:port [weight=N]", [target] is used when empty */
+  char **backends;
+  unsigned short backends_count;
+  const char *balancing;
+  unsigned int health_check_interval;
+  const char *health_check_path;
+  unsigned short max_fails;
+  unsigned int fail_timeout;
+
+  /* Adaptive per-backend concurrency limit, 0 disables it */
+  unsigned int concurrency_limit;
+  unsigned int concurrency_max;
+  double latency_tolerance;
+
+  /* Backend names are re-resolved when their TTL expires, capped by dns_refresh (ms) */
+  unsigned int dns_refresh;
+  unsigned int dns_min_ttl;
+
+  unsigned short compression;
+  unsigned short compression_level;
+  unsigned int compression_min_size;
+
+  /* URL list fetched into cache at startup (off when unset), concurrent fetches and their rate (req/s, 0 unlimited) */
+  const char *prefetch_file;
+  unsigned int prefetch_concurrency;
+  unsigned int prefetch_rate;
+  /* Host header of relative URLs (defaults to listen address) and file of header lines sent with every request */
+  const char *prefetch_host;
+  const char *prefetch_headers;
+
+  /* [cluster] members as "host:port" of their peer listeners, same list on every member, self is this one's entry */
+  char **cluster_peers;
+  unsigned short cluster_peers_count;
+  const char *cluster_self;
+  /* Milliseconds to wait for owner's response headers, owner may have to go to origin first */
+  unsigned int cluster_timeout;
+  /* Peers are ejected after max_fails consecutive failures for fail_timeout ms */
+  unsigned int cluster_max_fails;
+  unsigned int cluster_fail_timeout;
+
+  /* [numa] listener and connection threads per node with node-local allocations */
+  unsigned short numa;
+  /* Remote hits before an entry is copied to the hitting node (0 never copies) and MiB per node for copies */
+  unsigned int numa_replicate_hits;
+  unsigned int numa_replica_memory;
+
+  /* [tasks] work-stealing pool for CPU-heavy background work (pre-compression), tasks beyond queue are refused */
+  unsigned short tasks_threads;
+  unsigned int tasks_queue;
 } configuration;
 
+void set_config_defaults(configuration *pconfig);
 int config_handler(void *user, const char *section, const char *name, const char *value);
 
 #endif //CACHR_CONFIGUTILS_H
@@ -0,0 +1,310 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "fetch.h"
+#include "request.h"
+#include "pathindex.h"
+#include "metrics.h"
+#include "log.h"
+#include "utils.h"
+
+/*
+ * Blocking origin fetches for threads without a client socket (prefetch workers, cluster peer connections). Responses
+ * are read and stored the same way as client misses, connections are kept alive between requests.
+ */
+
+/* Picked backend may be saturated, wait for another one this often */
+#define FETCH_BACKEND_WAIT_US 50000
+
+/* Parses request->buffer and computes its cache key. Returns -2 while request is incomplete and -1 when it's invalid */
+int fetch_parse_request(struct fetch_request *request) {
+  request->num_headers = sizeof(request->headers) / sizeof(request->headers[0]);
+  request->headers_size = phr_parse_request(request->buffer, request->size, &request->method, &request->method_len,
+                                            &request->path, &request->path_len, &request->minor_version,
+                                            request->headers, &request->num_headers, 0);
+  if (request->headers_size < 0) return request->headers_size;
+
+  request->key = get_cache_key(request->buffer, request->size, request->headers, request->num_headers);
+  return 0;
+}
+
+/* Blocking socket with connect timeout (ms), reads and writes get their own timeouts */
+int fetch_connect(struct resolved_host *resolved, unsigned int timeout) {
+  int fd;
+
+  if ((fd = resolver_connect(resolved, timeout)) < 0) {
+    log_warn("Connect to %s:%d failed on every address\n", resolved->host, resolved->port);
+    return -1;
+  }
+
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+  return fd;
+}
+
+static void set_timeout(int fd, int option, unsigned int timeout) {
+  struct timeval tv = {timeout / 1000, (timeout % 1000) * 1000};
+
+  setsockopt(fd, SOL_SOCKET, option, &tv, sizeof(tv));
+}
+
+int fetch_send(int fd, const char *request, size_t len, unsigned int timeout) {
+  size_t sent = 0;
+
+  set_timeout(fd, SO_SNDTIMEO, timeout);
+  while (sent < len) {
+    ssize_t written = write(fd, request + sent, len - sent);
+
+    if (written == -1 && errno == EINTR) continue;
+    if (written <= 0) return -1;
+    sent += written;
+  }
+  return 0;
+}
+
+static int connection_close(struct phr_header *headers, size_t num_headers) {
+  for (size_t i = 0; i < num_headers; i++) {
+    if (headers[i].name_len == 10 && strncasecmp(headers[i].name, "Connection", 10) == 0) {
+      return headers[i].value_len == 5 && strncasecmp(headers[i].value, "close", 5) == 0;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Reads one response, body is de-chunked the same way as for clients. Returns 0 when it's complete, -2 when
+ * connection was closed or reset before any byte arrived (a reused connection the other side already dropped) and -1
+ * otherwise.
+ * response must be zeroed with meta.ttl and meta.content_length = -1 set.
+ */
+int fetch_read_response(int fd, unsigned int first_byte_timeout, unsigned int idle_timeout, long started,
+                        struct fetch_response *response) {
+  struct phr_header headers[100];
+  struct phr_chunked_decoder decoder = {0};
+  size_t size = 0, capacity = FETCH_BUFSIZE, last_len = 0, num_headers, msg_len;
+  char *buffer = malloc(capacity);
+  const char *msg;
+  int parsed = 0, minor_version, pret = 0;
+  ssize_t rsize;
+
+  set_timeout(fd, SO_RCVTIMEO, first_byte_timeout);
+
+  while (1) {
+    char *target = buffer + size;
+    size_t available = capacity - size;
+    int leftover = 0;
+
+    if (parsed) target = slice_buffer_tail(&response->body, &available);
+
+    rsize = read(fd, target, available);
+    if (rsize == -1 && errno == EINTR) continue;
+    if (rsize <= 0) {
+      /* Without Content-Length or chunked framing, body ends with connection */
+      if (rsize == 0 && parsed && !response->meta.chunked && response->meta.content_length == -1) {
+        response->keep_alive = 0;
+        break;
+      }
+      free(buffer);
+      return (rsize == 0 || errno == ECONNRESET) && size == 0 && !parsed ? -2 : -1;
+    }
+
+    metrics_add(METRIC_UPSTREAM_BYTES_IN, rsize);
+    response->received += rsize;
+
+    if (!parsed) {
+      size += rsize;
+      num_headers = sizeof(headers) / sizeof(headers[0]);
+      pret = phr_parse_response(buffer, size, &minor_version, &response->status, &msg, &msg_len, headers,
+                                &num_headers, last_len);
+      last_len = size;
+
+      if (pret == -2) {
+        if (size == capacity) {
+          capacity *= 2;
+          buffer = realloc(buffer, capacity);
+        }
+        continue;
+      } else if (pret == -1) {
+        free(buffer);
+        return -1;
+      }
+
+      parse_response_headers(buffer, headers, num_headers, &response->meta);
+      response->keep_alive = minor_version == 1 && !connection_close(headers, num_headers);
+      response->latency = get_time_us() - started;
+      parsed = 1;
+      decoder.consume_trailer = 1;
+      set_timeout(fd, SO_RCVTIMEO, idle_timeout);
+
+      /* These never have a body */
+      if (response->status == 204 || response->status == 304 || response->status < 200) break;
+
+      target = buffer + pret;
+      rsize = size - pret;
+      size = (size_t) pret;
+      leftover = 1;
+    }
+
+    if (response->meta.chunked) {
+      size_t chunk_bytes = (size_t) rsize;
+      ssize_t dret = phr_decode_chunked(&decoder, target, &chunk_bytes);
+
+      if (leftover) slice_buffer_append(&response->body, target, chunk_bytes);
+      else slice_buffer_commit(&response->body, chunk_bytes);
+
+      if (dret == -1) {
+        free(buffer);
+        return -1;
+      } else if (dret >= 0) {
+        break;
+      }
+      continue;
+    }
+
+    if (leftover) slice_buffer_append(&response->body, target, (size_t) rsize);
+    else slice_buffer_commit(&response->body, (size_t) rsize);
+
+    if (response->meta.content_length != -1 && response->body.bytes >= (uint64_t) response->meta.content_length) {
+      break;
+    }
+  }
+
+  slice_buffer_trim(&response->body);
+  response->headers_size = (size_t) pret;
+  response->head = buffer;
+
+  if (response->meta.chunked) {
+    response->head = rewrite_chunked_head(buffer, (size_t) pret, response->meta.te_start, response->meta.te_end,
+                                          response->body.bytes, &response->headers_size);
+    free(buffer);
+  }
+  response->head = vary_on_encoding(response->head, &response->headers_size, &response->meta, response->body.bytes);
+  return 0;
+}
+
+/* Frees head and body, or drops the reference to the cache entry that took them over */
+void fetch_response_free(struct fetch_response *response) {
+  if (response->entry != NULL) {
+    cache_release(response->entry);
+    response->entry = NULL;
+    response->head = NULL;
+    memset(&response->body, 0, sizeof(struct slice_buffer));
+    return;
+  }
+
+  free(response->head);
+  response->head = NULL;
+  slice_buffer_free(&response->body);
+}
+
+void fetch_pool_init(struct fetch_pool *pool, configuration *cfg) {
+  pool->cfg = cfg;
+  pool->count = cfg->backends_count > 0 ? cfg->backends_count : 1;
+  pool->connections = calloc(pool->count, sizeof(struct fetch_connection));
+}
+
+static void close_connection(struct fetch_connection *connection) {
+  if (connection->fd >= 0) close(connection->fd);
+  connection->fd = -1;
+}
+
+void fetch_pool_close(struct fetch_pool *pool) {
+  for (size_t i = 0; i < pool->count; i++) {
+    if (pool->connections[i].backend != NULL) close_connection(&pool->connections[i]);
+  }
+  free(pool->connections);
+  pool->connections = NULL;
+}
+
+/* Pooled connection to backend, opened lazily */
+static struct fetch_connection *pool_connection(struct fetch_pool *pool, struct backend *backend) {
+  size_t i;
+
+  for (i = 0; i < pool->count && pool->connections[i].backend != NULL; i++) {
+    if (pool->connections[i].backend == backend) return &pool->connections[i];
+  }
+
+  /* Backends never go away, pool has a slot for each of them */
+  pool->connections[i].backend = backend;
+  pool->connections[i].fd = -1;
+  return &pool->connections[i];
+}
+
+/*
+ * Fetches request from a backend picked by upstream_select() and stores response in cache like a client miss.
+ * Returns 0 with response filled in (response->entry tells whether cache took it) and -1 when no backend answered.
+ */
+int fetch_origin(struct fetch_pool *pool, struct fetch_request *request, struct fetch_response *response) {
+  configuration *cfg = pool->cfg;
+  struct fetch_connection *connection;
+  struct backend *backend;
+  char *upstream_request, *index_path = NULL;
+  long started, deadline;
+  int ret = -1;
+
+  memset(response, 0, sizeof(struct fetch_response));
+
+  /* Saturated backends are waited for at most connect_timeout */
+  deadline = get_time_ms() + cfg->connect_timeout;
+  while ((backend = upstream_select(request->key)) == NULL && get_time_ms() < deadline) usleep(FETCH_BACKEND_WAIT_US);
+  if (backend == NULL) {
+    metrics_add(METRIC_UPSTREAM_REJECTED, 1);
+    return -1;
+  }
+
+  connection = pool_connection(pool, backend);
+  upstream_request = rewrite_request(request->buffer, request->headers, request->headers_size,
+                                     (int) request->num_headers, (int) request->size, (char *) request->method,
+                                     request->method_len, (char *) request->path, request->path_len,
+                                     request->minor_version, cfg->target_host != NULL ? cfg->target_host : backend->host);
+  started = get_time_us();
+
+  /* A pooled connection may have been closed by backend meanwhile, that's retried once on a new one */
+  for (int attempt = 0; attempt < 2; attempt++) {
+    int reused = connection->fd >= 0;
+
+    fetch_response_free(response);
+    memset(response, 0, sizeof(struct fetch_response));
+    response->meta.ttl = (int) cfg->ttl;
+    response->meta.content_length = -1;
+
+    if (!reused && (connection->fd = fetch_connect(backend->resolved, cfg->connect_timeout)) < 0) break;
+
+    if (fetch_send(connection->fd, upstream_request, strlen(upstream_request), cfg->idle_timeout) == 0) {
+      ret = fetch_read_response(connection->fd, cfg->first_byte_timeout, cfg->idle_timeout, started, response);
+    } else {
+      ret = -2;
+    }
+
+    if (ret == 0 || !reused) break;
+    close_connection(connection);
+  }
+
+  free(upstream_request);
+
+  if (ret != 0) {
+    log_warn("Fetching %.*s from %s:%d failed\n", (int) request->path_len, request->path, backend->host,
+             backend->port);
+    upstream_release(backend, 0, 0);
+    close_connection(connection);
+    fetch_response_free(response);
+    return -1;
+  }
+
+  /* 5xx counts towards opening backend's circuit */
+  upstream_release(backend, response->status < 500, response->latency);
+  if (!response->keep_alive) close_connection(connection);
+
+  if (cfg->path_index) index_path = path_index_key(request->path, request->path_len);
+  response->entry = cache_store(request->key, response->status, response->head, response->headers_size,
+                                &response->body, &response->meta, index_path);
+  free(index_path);
+  return 0;
+}
@@ -0,0 +1,65 @@
+#ifndef CACHR_FETCH_H
+#define CACHR_FETCH_H
+
+#include <stdint.h>
+#include "configutils.h"
+#include "cache.h"
+#include "upstream.h"
+#include "resolver.h"
+#include "libs/picohttpparser.h"
+
+/* Size of buffer for response headers, doubled while they don't fit */
+#define FETCH_BUFSIZE 4096
+
+/* Request as a client sends it, parsed by fetch_parse_request() */
+struct fetch_request {
+  char *buffer;
+  size_t size;
+  int headers_size;
+  const char *method;
+  const char *path;
+  size_t method_len;
+  size_t path_len;
+  int minor_version;
+  struct phr_header headers[100];
+  size_t num_headers;
+  uint64_t key;
+};
+
+struct fetch_response {
+  char *head;
+  size_t headers_size;
+  int status;
+  int keep_alive;
+  /* Microseconds from sending request to parsed response headers */
+  long latency;
+  uint64_t received;
+  struct slice_buffer body;
+  struct response_meta meta;
+  /* Entry that took over head and body once stored, referenced until fetch_response_free() */
+  struct cache_entry *entry;
+};
+
+struct fetch_connection {
+  struct backend *backend;
+  int fd;
+};
+
+/* Keep-alive connections of one thread, at most one per backend */
+struct fetch_pool {
+  configuration *cfg;
+  struct fetch_connection *connections;
+  size_t count;
+};
+
+int fetch_parse_request(struct fetch_request *request);
+int fetch_connect(struct resolved_host *resolved, unsigned int timeout);
+int fetch_send(int fd, const char *request, size_t len, unsigned int timeout);
+int fetch_read_response(int fd, unsigned int first_byte_timeout, unsigned int idle_timeout, long started,
+                        struct fetch_response *response);
+void fetch_response_free(struct fetch_response *response);
+void fetch_pool_init(struct fetch_pool *pool, configuration *cfg);
+void fetch_pool_close(struct fetch_pool *pool);
+int fetch_origin(struct fetch_pool *pool, struct fetch_request *request, struct fetch_response *response);
+
+#endif //CACHR_FETCH_H
@@ -0,0 +1,199 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "log.h"
+
+/* Bytes buffered per thread, lines longer than LOG_LINE_MAX are truncated */
+#define LOG_RING_SIZE 16384
+#define LOG_LINE_MAX 1024
+/* Writer sleep when every ring is empty, in microseconds */
+#define LOG_IDLE_SLEEP 1000
+
+enum ring_state {
+  RING_FREE = 0,
+  RING_ACTIVE,
+  /* Owner exited, writer frees it once drained */
+  RING_RETIRED
+};
+
+/* Single producer (owning thread), single consumer (writer thread). Records are [u16 length][bytes] */
+struct log_ring {
+  uint64_t head __attribute__((aligned(64)));
+  uint64_t dropped;
+  uint64_t tail __attribute__((aligned(64)));
+  uint64_t reported;
+  int state;
+  struct log_ring *next;
+  char data[LOG_RING_SIZE];
+};
+
+int log_level = LOG_INFO;
+
+static __thread struct log_ring *local_ring = NULL;
+static struct log_ring *rings = NULL;
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+static int writer_running = 0;
+
+static const char *level_names[] = {"error", "warn", "info", "debug", "trace"};
+
+int parse_log_level(const char *name) {
+  for (int level = LOG_ERROR; level <= LOG_TRACE; level++) {
+    if (strcasecmp(name, level_names[level]) == 0) return level;
+  }
+  return -1;
+}
+
+static void retire_ring(void *ptr) {
+  __atomic_store_n(&((struct log_ring *) ptr)->state, RING_RETIRED, __ATOMIC_RELEASE);
+  local_ring = NULL;
+}
+
+static struct log_ring *register_ring() {
+  struct log_ring *ring;
+
+  for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+    int expected = RING_FREE;
+    if (__atomic_compare_exchange_n(&ring->state, &expected, RING_ACTIVE, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      break;
+    }
+  }
+
+  if (ring == NULL) {
+    if (posix_memalign((void **) &ring, 64, sizeof(struct log_ring)) != 0) return NULL;
+    memset(ring, 0, offsetof(struct log_ring, data));
+    ring->state = RING_ACTIVE;
+
+    pthread_mutex_lock(&rings_mutex);
+    ring->next = rings;
+    __atomic_store_n(&rings, ring, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&rings_mutex);
+  }
+
+  pthread_setspecific(ring_key, ring);
+  local_ring = ring;
+  return ring;
+}
+
+static void ring_copy_in(struct log_ring *ring, uint64_t at, const void *src, size_t len) {
+  size_t offset = at % LOG_RING_SIZE, first = len < LOG_RING_SIZE - offset ? len : LOG_RING_SIZE - offset;
+
+  memcpy(ring->data + offset, src, first);
+  memcpy(ring->data, (const char *) src + first, len - first);
+}
+
+static void ring_copy_out(struct log_ring *ring, uint64_t at, void *dst, size_t len) {
+  size_t offset = at % LOG_RING_SIZE, first = len < LOG_RING_SIZE - offset ? len : LOG_RING_SIZE - offset;
+
+  memcpy(dst, ring->data + offset, first);
+  memcpy((char *) dst + first, ring->data, len - first);
+}
+
+/* Formats into calling thread's ring, never blocks: a full ring drops the line */
+void log_write(int level, const char *format, ...) {
+  char line[LOG_LINE_MAX];
+  struct log_ring *ring;
+  uint16_t len;
+  uint64_t head;
+  va_list args;
+  int written;
+
+  va_start(args, format);
+  written = vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+
+  if (written < 0) return;
+  len = (uint16_t) (written < (int) sizeof(line) ? written : (int) sizeof(line) - 1);
+
+  /* Before writer starts (and if a ring can't be had) lines go straight out */
+  if (!__atomic_load_n(&writer_running, __ATOMIC_ACQUIRE) ||
+      (ring = local_ring != NULL ? local_ring : register_ring()) == NULL) {
+    fwrite(line, 1, len, stdout);
+    return;
+  }
+
+  head = ring->head;
+  if (LOG_RING_SIZE - (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) < len + sizeof(len)) {
+    __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  ring_copy_in(ring, head, &len, sizeof(len));
+  ring_copy_in(ring, head + sizeof(len), line, len);
+  __atomic_store_n(&ring->head, head + sizeof(len) + len, __ATOMIC_RELEASE);
+}
+
+/* Copies every complete record out of ring, returns number of bytes consumed */
+static uint64_t drain_ring(struct log_ring *ring) {
+  char line[LOG_LINE_MAX];
+  uint64_t tail = ring->tail, head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE), start = tail;
+  uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+
+  while (tail < head) {
+    uint16_t len;
+
+    ring_copy_out(ring, tail, &len, sizeof(len));
+    ring_copy_out(ring, tail + sizeof(len), line, len);
+    fwrite(line, 1, len, stdout);
+    tail += sizeof(len) + len;
+  }
+  __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+  if (dropped != ring->reported) {
+    printf("[log] %llu lines dropped, ring full\n", (unsigned long long) (dropped - ring->reported));
+    ring->reported = dropped;
+  }
+
+  return tail - start;
+}
+
+static void *log_writer(void *ctx) {
+  while (1) {
+    uint64_t drained = 0;
+
+    for (struct log_ring *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+      int state = __atomic_load_n(&ring->state, __ATOMIC_ACQUIRE);
+
+      if (state == RING_FREE) continue;
+      drained += drain_ring(ring);
+
+      /* Retired before this drain started, so nothing more can arrive */
+      if (state == RING_RETIRED) {
+        ring->dropped = ring->reported = 0;
+        __atomic_store_n(&ring->state, RING_FREE, __ATOMIC_RELEASE);
+      }
+    }
+
+    if (drained > 0) {
+      fflush(stdout);
+    } else {
+      usleep(LOG_IDLE_SLEEP);
+    }
+  }
+
+  return NULL;
+}
+
+/* Starts writer thread, from then on threads log into their own rings */
+int log_start() {
+  pthread_t thid;
+
+  pthread_key_create(&ring_key, retire_ring);
+
+  if (pthread_create(&thid, NULL, log_writer, NULL) != 0) {
+    fprintf(stderr, "[log] Failed to create writer thread, logging synchronously.\n");
+    return -1;
+  }
+
+  pthread_detach(thid);
+  fflush(stdout);
+  __atomic_store_n(&writer_running, 1, __ATOMIC_RELEASE);
+  return 0;
+}
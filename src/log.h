@@ -0,0 +1,36 @@
+#ifndef CACHR_LOG_H
+#define CACHR_LOG_H
+
+enum log_level {
+  LOG_ERROR = 0,
+  LOG_WARN,
+  LOG_INFO,
+  LOG_DEBUG,
+  LOG_TRACE
+};
+
+/* Most verbose level compiled in, calls above it are removed by the compiler */
+#ifndef CACHR_LOG_LEVEL
+#define CACHR_LOG_LEVEL LOG_DEBUG
+#endif
+
+/* Runtime level, set from [log] level */
+extern int log_level;
+
+/* Arguments are not evaluated when level is disabled */
+#define log_at(level, ...) \
+  do { \
+    if ((level) <= CACHR_LOG_LEVEL && (level) <= log_level) log_write((level), __VA_ARGS__); \
+  } while (0)
+
+#define log_error(...) log_at(LOG_ERROR, __VA_ARGS__)
+#define log_warn(...) log_at(LOG_WARN, __VA_ARGS__)
+#define log_info(...) log_at(LOG_INFO, __VA_ARGS__)
+#define log_debug(...) log_at(LOG_DEBUG, __VA_ARGS__)
+#define log_trace(...) log_at(LOG_TRACE, __VA_ARGS__)
+
+int parse_log_level(const char *name);
+void log_write(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+int log_start();
+
+#endif //CACHR_LOG_H
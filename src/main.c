@@ -12,139 +12,209 @@
 #include "configutils.h"
 #include "netutils.h"
 #include "utils.h"
+#include "cache.h"
+#include "prefetch.h"
+#include "cluster.h"
+#include "nodes.h"
+#include "arena.h"
+#include "tasks.h"
+#include "fetch.h"
+#include "compression.h"
+#include "range.h"
+#include "upstream.h"
+#include "metrics.h"
+#include "admin.h"
+#include "log.h"
+#include "accesslog.h"
+#include "request.h"
+#include "trace.h"
+#include "pathindex.h"
 #include "libs/picohttpparser.h"
 
 /* Size of buffer/chunk read */
 #define BUFSIZE 4096
 
-/* Cached sockaddr_in structure as we're calling the same target */
-struct sockaddr_in target_serv_addr;
-
-/* Head of cache data structure */
-struct cache_entry *cache = NULL;
-
 /* Parsed configuration structure */
 configuration cfg;
 
-/* Cache mutex */
-pthread_mutex_t cache_mutex;
+/* State of the request served by this thread, finished by connection_finished() */
+struct request_context {
+  long started;
+  /* Thread's traffic counters when request started, record gets the difference */
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  uint64_t upstream_bytes;
+  struct access_record record;
+  struct request_trace trace;
+  /* Normalized path for path index, NULL when it's off */
+  char *index_path;
+  /* Entry found or stored by this request, its reference is dropped once connection is finished */
+  struct cache_entry *entry;
+};
 
-struct cache_entry {
-  uint64_t key;
-  char* buffer;
-  long timestamp;
-  u_int32_t bytes;
-  struct UT_hash_handle hh;
+static __thread struct request_context current_request;
+
+/* Target's addresses, tried in turn until one of them connects or connect_timeout is spent */
+struct connect_attempt {
+  struct backend *backend;
+  struct address_set addresses;
+  int next;
+  long deadline;
 };
 
-int initialize_new_socket() {
-  int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-  if (sockfd < 0)
-    handle_error(sockfd, errno, "ERROR opening socket");
+/*
+ * Starts non-blocking connect to attempt's next address, completion is reported by POLLOUT. Addresses failing right
+ * away are skipped, deadline gets this address's share of time left. Returns -1 when no address is left.
+ */
+int initialize_new_socket(struct connect_attempt *attempt, long *deadline) {
+  char address[INET6_ADDRSTRLEN];
+  int sockfd;
 
-  printf("Connecting to %s:%d\n", cfg.target_host, cfg.target_port);
+  while (attempt->next < attempt->addresses.count) {
+    int i = attempt->next++;
 
-  if (connect(sockfd, (struct sockaddr *) &target_serv_addr, sizeof(target_serv_addr)) < 0)
-    handle_error(1, errno, "Error while connecting");
+    sockfd = socket(attempt->addresses.addrs[i].ss_family, SOCK_STREAM, 0);
+    if (sockfd < 0) {
+      log_error("Failed to open socket, errno: %d\n", errno);
+      continue;
+    }
 
-  return sockfd;
-}
+    log_debug("Connecting to %s:%d (%s)\n", attempt->backend->host, attempt->backend->port,
+              format_address(&attempt->addresses.addrs[i], address, sizeof(address)));
+
+    if (make_socket_non_blocking(sockfd) == -1 ||
+        (connect(sockfd, (struct sockaddr *) &attempt->addresses.addrs[i], attempt->addresses.lens[i]) < 0 &&
+         errno != EINPROGRESS)) {
+      log_warn("Failed to connect, errno: %d\n", errno);
+      close(sockfd);
+      continue;
+    }
 
-int get_ttl_value(char *header_value) {
-  char *separator = "=";
-  char *key = strtok(header_value, separator);
-  char *value = strtok(NULL, "");
-  if (strcmp(key, "max-age") == 0) {
-    return atoi(value);
+    *deadline = get_time_ms() + time_left_ms(attempt->deadline) / (attempt->addresses.count - i);
+    return sockfd;
   }
-  return 0;
-};
 
-void serve_response_from_cache(struct cache_entry *found_entry, int fd) {
-  printf("[%d] Serving response from cache (%d bytes) to fd: %d\n", (int) gettid(), found_entry->bytes, fd);
+  return -1;
+}
 
-  struct pollfd *fds = (struct pollfd *) calloc(1, sizeof(struct pollfd));
-  int tid = (int) gettid();
+/* Replies with 502/504 when target can't be reached in time (503 when none may be tried), then ends connection's thread */
+void fail_upstream(int fd, int upstream_fd, int code, struct backend *backend) {
+  const char *response = code == 504 ?
+                         "HTTP/1.1 504 Gateway Timeout\r\nContent-Length: 0\r\nConnection: close\r\n\r\n" :
+                         code == 503 ?
+                         "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n" :
+                         "HTTP/1.1 502 Bad Gateway\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+  struct iovec iov = {(char *) response, strlen(response)};
+
+  log_warn("[%d] Target failed, replying %d to fd: %d\n", (int) gettid(), code, fd);
+
+  upstream_release(backend, 0, 0);
+  current_request.record.status = (uint16_t) code;
+  if (upstream_fd >= 0) close(upstream_fd);
+  write_all(fd, &iov, 1);
+  close(fd);
+  pthread_exit(NULL);
+}
 
-  fds[0].fd = fd;
-  fds[0].events = POLLOUT;
+/* Connect on sockfd failed, moves on to target's next address. Fails request once none is left */
+static int retry_connect(int fd, int sockfd, struct connect_attempt *attempt, long *deadline) {
+  close(sockfd);
+  if ((sockfd = initialize_new_socket(attempt, deadline)) < 0) {
+    fail_upstream(fd, -1, time_left_ms(attempt->deadline) == 0 ? 504 : 502, attempt->backend);
+  }
+  return sockfd;
+}
 
-  while (poll(fds, (nfds_t) 1, -1)) {
-    if (fds[0].revents & POLLOUT) {
-      fds[0].revents = 0;
-      ssize_t bytes_sent = 0, total_bytes_sent = 0;
-
-      if (total_bytes_sent < found_entry->bytes) {
-        printf("[%d] Sending cached response...\n", tid);
-        while ((bytes_sent = write(fds[0].fd, found_entry->buffer + total_bytes_sent,
-                                   (size_t) (found_entry->bytes - total_bytes_sent)))) {
-          /* Writing should be continued later */
-          if (bytes_sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-            printf("[%d] Sending would block.\n", tid);
-            break;
-          }
+/* Cleanup handler of connection threads, runs on every pthread_exit() */
+void connection_finished(void *ctx) {
+  struct request_context *request = ctx;
+  long duration = get_time_us() - request->started;
+
+  metrics_add(METRIC_CONNECTIONS_CLOSED, 1);
+  metrics_observe(HISTOGRAM_REQUEST_DURATION, (uint64_t) duration);
+
+  /* Connections closed before a request was parsed are not logged */
+  if (request->record.key != 0) {
+    request->record.total_us = (uint32_t) duration;
+    request->record.bytes_in = (uint32_t) (metrics_value(METRIC_BYTES_IN) - request->bytes_in);
+    request->record.bytes_out = metrics_value(METRIC_BYTES_OUT) - request->bytes_out;
+    request->record.upstream_bytes = metrics_value(METRIC_UPSTREAM_BYTES_IN) - request->upstream_bytes;
+    trace_finish(&request->trace, &request->record);
+    access_log_append(&request->record);
+  }
 
-          total_bytes_sent += bytes_sent;
+  free(request->index_path);
+  request->index_path = NULL;
+  cache_release(request->entry);
+  request->entry = NULL;
+}
 
-          printf("[%d] %d / %d bytes sent. (%d in this tick)\n", tid, (int) total_bytes_sent, found_entry->bytes,
-                 (int) bytes_sent);
+/* Sends head and body slices (or a pre-compressed variant) to client */
+void send_response(int fd, char *head, size_t headers_size, struct slice_buffer *body) {
+  int iovcnt = 1 + slice_buffer_span(0, body->bytes);
+  struct iovec *iov = malloc(sizeof(struct iovec) * iovcnt);
 
-          if (total_bytes_sent == found_entry->bytes) {
-            close(fds[0].fd);
+  iov[0].iov_base = head;
+  iov[0].iov_len = headers_size;
+  slice_buffer_iovecs(body, 0, body->bytes, iov + 1);
 
-            printf("[%d] Cached response sent.\n", tid);
-            pthread_exit(NULL);
-          }
-        }
-      }
-    }
+  if (write_all(fd, iov, iovcnt) != 0) {
+    log_warn("[%d] Failed to send response to fd: %d\n", (int) gettid(), fd);
   }
+  free(iov);
 }
 
-char *rewrite_request(char *response_buffer, struct phr_header *headers, int headers_size, int headers_count,
-                      int total_size, char* method, size_t method_len, char *path, size_t path_len, int minor_version) {
-  size_t bufsize = method_len + path_len + 12, header_size = 0;
-  char *buffer = malloc(sizeof(char) * bufsize);
+/* Identity response comes from replica, a copy on this thread's NUMA node, when it's not NULL */
+void serve_response_from_cache(struct cache_entry *found_entry, struct cache_replica *replica, int fd,
+                               int accept_encoding) {
+  int encoding = select_encoding(accept_encoding, found_entry);
 
-  printf("Initial buffer: \n%s\n", response_buffer);
+  current_request.record.status = (uint16_t) found_entry->status;
 
-  sprintf(buffer, "%.*s %.*s HTTP/1.%d\r\n\0", (int) method_len, method, (int) path_len, path, minor_version);
+  /* Pre-compressed variant, if client accepts one and it's ready */
+  if (encoding >= 0) {
+    struct iovec iov = {found_entry->variants[encoding].buffer, found_entry->variants[encoding].bytes};
 
-  /* Rewrite headers */
-  for (int i = 0; i < headers_count; i++) {
-    char *name = malloc(sizeof(char) * headers[i].name_len);
-    char *value = malloc(sizeof(char) * headers[i].value_len);
-    sprintf(name, "%.*s\0", (int) headers[i].name_len, headers[i].name);
-    sprintf(value, "%.*s\0", (int) headers[i].value_len, headers[i].value);
+    log_debug("[%d] Serving response from cache (%d bytes, %s) to fd: %d\n", (int) gettid(), (int) iov.iov_len,
+              encoding_name(encoding), fd);
+    write_all(fd, &iov, 1);
+    current_request.record.encoding = (uint8_t) (encoding + 1);
+  } else {
+    log_debug("[%d] Serving response from cache (%llu bytes, identity) to fd: %d\n", (int) gettid(),
+              (unsigned long long) found_entry->bytes, fd);
+    if (replica != NULL) send_response(fd, replica->head, found_entry->headers_size, &replica->body);
+    else send_response(fd, found_entry->head, found_entry->headers_size, &found_entry->body);
+  }
 
-    header_size = headers[i].name_len + 4;
+  close(fd);
+  log_debug("[%d] Cached response sent.\n", (int) gettid());
+  pthread_exit(NULL);
+}
 
-    if (strcmp("Host", name) == 0) {
-      printf("[%d] Writing custom host...\n", (int) gettid());
-      free(value);
-      value = malloc(sizeof(char) * (strlen(cfg.target_host) + 2));
-      strcpy(value, cfg.target_host);
-      value[strlen(value)] = '\0';
+/* Answers a miss with response of cluster member owning its key, returns when that member failed or answered 5xx */
+void serve_response_from_peer(struct peer *peer, int fd, char *request, size_t size, char *range_header) {
+  struct fetch_response response;
+  int range_status;
 
-      header_size += strlen(cfg.target_host);
-    } else {
-      header_size += (int) headers[i].value_len;
-    }
+  if (cluster_fetch(peer, request, size, &response) != 0) return;
 
-    buffer = realloc(buffer, sizeof(char) * (bufsize + header_size));
-    sprintf(buffer + bufsize, "%s: %s\r\n\0", name, value);
-    bufsize += header_size;
+  log_debug("[%d] Response for fd: %d fetched from peer %s\n", (int) gettid(), fd, peer->name);
+  trace_mark(&current_request.trace, TRACE_RESPONSE_READ);
+  current_request.record.result = RESULT_PEER;
+  current_request.record.status = (uint16_t) response.status;
+  current_request.record.upstream_us = (uint32_t) response.latency;
 
-    free(name);
-    free(value);
+  if (range_header != NULL && response.status == 200 &&
+      (range_status = send_range_response(fd, response.head, response.headers_size, &response.body,
+                                          range_header)) > 0) {
+    current_request.record.status = (uint16_t) range_status;
+  } else {
+    send_response(fd, response.head, response.headers_size, &response.body);
   }
 
-  /* Rewrite rest of request */
-  buffer = realloc(buffer, (size_t) (bufsize + total_size - headers_size + 2));
-  memcpy(buffer + bufsize, response_buffer + headers_size, total_size - headers_size);
-  buffer[strlen(buffer)] = '\n';
-
-  return buffer;
+  fetch_response_free(&response);
+  close(fd);
+  pthread_exit(NULL);
 }
 
 /*
@@ -155,18 +225,41 @@ char *rewrite_request(char *response_buffer, struct phr_header *headers, int hea
  *  3: Sending back data to requester
  */
 void* handle_tcp_connection(void *ctx) {
-  int tid = (int) gettid(), read_timeout = -1, write_timeout = -1, status = -1, request_content_length = -1,
-      response_content_length = -1, ttl = cfg.ttl, i, req_parsed = 0, res_parsed = 0, res_minor_version, res_status,
+  int tid = (int) gettid(), read_timeout = -1, status = -1, request_content_length = -1,
+      i, req_parsed = 0, res_parsed = 0, res_minor_version, res_status,
       minor_version, pret = -2;
-  int sck = (int) ctx, chunked = 0;
+  int sck = (int) ctx, accept_encoding = 0, if_range = 0, stored = 0, connected = 0, complete = 0, ready,
+      range_status;
+  /* Single upstream deadline, this thread serves one connection so it's the whole timer structure */
+  long deadline, upstream_started = 0, upstream_latency = 0;
   uint64_t key;
   size_t method_len, path_len, num_headers;
-  char *buffer = malloc(BUFSIZE), *req_method, *req_path;
+  /* Bytes already seen by the parser, passed back as last_len so partial reads are not re-scanned */
+  size_t req_last_len = 0, res_last_len = 0;
+  size_t response_headers_size = 0;
+  /* Caching and framing of response, TTL starts from config and request headers */
+  struct response_meta meta = {.ttl = (int) cfg.ttl, .content_length = -1};
+  struct phr_chunked_decoder decoder = {0};
+  /* Response body, read straight into fixed-size slices */
+  struct slice_buffer body = {0};
+  char *buffer = malloc(BUFSIZE), *req_method, *req_path, *range_header = NULL;
   struct cache_entry *found_entry = NULL;
+  struct cache_replica *replica = NULL;
   struct phr_header headers[100];
   struct phr_header res_headers[100];
   struct pollfd *fds = (struct pollfd *) calloc(1, sizeof(struct pollfd));
 
+  memset(&current_request, 0, sizeof(current_request));
+  trace_mark(&current_request.trace, TRACE_ACCEPTED);
+  current_request.started = get_time_us();
+  current_request.record.timestamp_us = get_epoch_us();
+  current_request.bytes_in = metrics_value(METRIC_BYTES_IN);
+  current_request.bytes_out = metrics_value(METRIC_BYTES_OUT);
+  current_request.upstream_bytes = metrics_value(METRIC_UPSTREAM_BYTES_IN);
+
+  metrics_add(METRIC_CONNECTIONS_OPENED, 1);
+  pthread_cleanup_push(connection_finished, &current_request);
+
   buffer = memset(buffer, 0, BUFSIZE);
 
   num_headers = sizeof(headers) / sizeof(headers[0]);
@@ -174,165 +267,271 @@ void* handle_tcp_connection(void *ctx) {
   fds[0].fd = (int) ctx;
   fds[0].events = POLLIN;
 
-  printf("[%d] Polling... FD: %d\n", (int) gettid(), sck);
+  log_debug("[%d] Polling... FD: %d\n", (int) gettid(), sck);
 
   while (poll(fds, (nfds_t) 1, read_timeout) && (status != 0)) {
     if (fds[0].revents & POLLHUP) {
-      printf("[%d] Fd: %d was disconnected.\n", tid, sck);
+      log_debug("[%d] Fd: %d was disconnected.\n", tid, sck);
       pthread_exit(NULL);
     } else if (fds[0].revents & POLLNVAL) {
-      printf("[%d] Fd: %d is invalid.\n", tid, sck);
+      log_warn("[%d] Fd: %d is invalid.\n", tid, sck);
     } else if (fds[0].revents & POLLERR) {
-      printf("[%d] Fd: %d is broken.\n", tid, sck);
+      log_warn("[%d] Fd: %d is broken.\n", tid, sck);
     } else if (fds[0].revents & POLLIN && status == -1) {
       /* Handle Incoming Request to proxy */
-      printf("[%d] POLLIN OUTER - %d\n", tid, sck);
+      log_trace("[%d] POLLIN OUTER - %d\n", tid, sck);
       fds[0].revents = 0;
       size_t size = 0;
       ssize_t rsize = 0, capacity = BUFSIZE;
 
       while ((rsize = read(fds[0].fd, buffer + size, capacity - size))) {
         if (rsize == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-          printf("[%d] Would block\n", tid);
+          log_trace("[%d] Would block\n", tid);
           break;
         }
 
         /* Else (positive number of bytes) */
         size += rsize;
+        metrics_add(METRIC_BYTES_IN, rsize);
 
         /* Each dot informs about chunk of data, just for debugging purposes */
-        printf("[%d] Receiving bytes: %d\n", tid, (int) rsize);
+        log_trace("[%d] Receiving bytes: %d\n", tid, (int) rsize);
 
         if (size == capacity) {
-          printf("[%d] Reallocating buffer to capacity: %d\n", tid, (int) (capacity * 2));
+          log_trace("[%d] Reallocating buffer to capacity: %d\n", tid, (int) (capacity * 2));
           capacity *= 2;
           buffer = realloc(buffer, (size_t) capacity);
 
           if (buffer == NULL) {
-            printf("[%d] Failed to rellocate the buffer!\n", tid);
+            log_error("[%d] Failed to rellocate the buffer!\n", tid);
             exit(EXIT_FAILURE);
           }
         }
 
         /* Parse request headers only once */
         if (req_parsed != 1) {
+          num_headers = sizeof(headers) / sizeof(headers[0]);
           pret = phr_parse_request(buffer, size, &req_method, &method_len, &req_path, &path_len,
-                                   &minor_version, headers, &num_headers, 0);
+                                   &minor_version, headers, &num_headers, req_last_len);
+          req_last_len = size;
 
           /* Request is incomplete */
           if (pret == -2) {
-            printf("[%d] Request incomplete, continue.\n", tid);
+            log_trace("[%d] Request incomplete, continue.\n", tid);
             continue;
           }
 
           /* Parse Error */
           if (pret == -1) {
-            printf("[%d] Parse Error! rsize=%d, buffer:\n%s\n", tid, (int) rsize, buffer);
+            log_warn("[%d] Parse Error! rsize=%d, buffer:\n%s\n", tid, (int) rsize, buffer);
             continue;
           }
 
           /* Else pret = number of bytes consumed */
 
           status = 1;
-          printf("[%d] Request parsed!\n", tid);
+          log_debug("[%d] Request parsed!\n", tid);
 
           for (i = 0; i != num_headers; ++i) {
-            char *name = malloc(sizeof(char) * headers[i].name_len);
-            char *value = malloc(sizeof(char) * headers[i].value_len);
+            char *name = malloc(sizeof(char) * (headers[i].name_len + 1));
+            char *value = malloc(sizeof(char) * (headers[i].value_len + 1));
             sprintf(name, "%.*s", (int) headers[i].name_len, headers[i].name);
             sprintf(value, "%.*s", (int) headers[i].value_len, headers[i].value);
 
             if(strcmp(name, "Cache-Control") == 0) {
-              if (strcmp(value, "no-cache") == 0 || strcmp(value, "no-store") == 0) ttl = 0;
+              if (strcmp(value, "no-cache") == 0 || strcmp(value, "no-store") == 0) meta.ttl = 0;
               else {
-                ttl = get_ttl_value(value);
+                meta.ttl = get_ttl_value(value);
               }
-
-              break;
             } else if (strcmp("Content-Length", name) == 0) {
               request_content_length = atoi(value);
             } else if (strcmp("Pragma", name) == 0) {
-              if (strcmp("no-cache", value) == 0) ttl = 0;
+              if (strcmp("no-cache", value) == 0) meta.ttl = 0;
+            } else if (strcmp("Accept-Encoding", name) == 0) {
+              accept_encoding = parse_accept_encoding(value);
+            } else if (strcmp("Range", name) == 0) {
+              range_header = strdup(value);
+            } else if (strcmp("If-Range", name) == 0) {
+              if_range = 1;
             }
 
             free(name);
             free(value);
           }
+
+          /* Ranges are served only for GET, If-Range validators aren't checked so full object is sent instead */
+          if (range_header != NULL && (if_range || method_len != 3 || strncmp(req_method, "GET", 3) != 0)) {
+            free(range_header);
+            range_header = NULL;
+          }
+          if (cfg.path_index) current_request.index_path = path_index_key(req_path, path_len);
           req_parsed = 1;
         }
 
         /* Content-Length header was present and it's value is bigger than downloaded bytes */
         if (request_content_length != -1) {
           if (size < request_content_length + pret) {
-            printf("[%d] request_content_length: %d but read so far: %d, retrying...\n", tid,
-                   request_content_length, (int) size);
+            log_trace("[%d] request_content_length: %d but read so far: %d, retrying...\n", tid,
+                      request_content_length, (int) size);
             continue;
           } else {
-            printf("[%d] Whole request captured, break\n", tid);
+            log_trace("[%d] Whole request captured, break\n", tid);
             break;
           }
+        } else {
+          /* No request body, headers are the whole request */
+          break;
         }
       }
 
-      key = hash_buffer(buffer);
-
-      /* Avoid concurrent access */
-      pthread_mutex_lock(&cache_mutex);
-      HASH_FIND_INT(cache, &key, found_entry);
-      pthread_mutex_unlock(&cache_mutex);
+      trace_mark(&current_request.trace, TRACE_REQUEST_READ);
+      key = get_cache_key(buffer, size, headers, num_headers);
+      metrics_add(METRIC_REQUESTS, 1);
+
+      found_entry = current_request.entry = cache_find(key);
+      if (found_entry && found_entry->timestamp > get_timestamp()) replica = nodes_hit(found_entry);
+
+      trace_mark(&current_request.trace, TRACE_CACHE_LOOKUP);
+      current_request.record.key = key;
+
+      if (found_entry && found_entry->timestamp > get_timestamp() && range_header != NULL &&
+          found_entry->status == 200 &&
+          (range_status = send_range_response(fds[0].fd, replica != NULL ? replica->head : found_entry->head,
+                                              found_entry->headers_size,
+                                              replica != NULL ? &replica->body : &found_entry->body,
+                                              range_header)) > 0) {
+        metrics_add(METRIC_CACHE_HITS, 1);
+        current_request.record.result = RESULT_HIT;
+        current_request.record.status = (uint16_t) range_status;
+        close(fds[0].fd);
+        pthread_exit(NULL);
+      }
 
       if (found_entry && found_entry->timestamp > get_timestamp()) {
-        serve_response_from_cache(found_entry, fds[0].fd);
+        metrics_add(METRIC_CACHE_HITS, 1);
+        current_request.record.result = RESULT_HIT;
+        serve_response_from_cache(found_entry, replica, fds[0].fd, accept_encoding);
       } else {
         if (found_entry) {
-          printf("[%d] Entry found but was too old. %d vs %d\n", tid, (int) found_entry->timestamp,
-                 (int) get_timestamp());
+          log_debug("[%d] Entry found but was too old. %d vs %d\n", tid, (int) found_entry->timestamp,
+                    (int) get_timestamp());
         }
+        /* Cacheable GETs for keys another cluster member owns are fetched from it, origin is the fallback */
+        struct peer *peer;
+        if (method_len == 3 && strncmp(req_method, "GET", 3) == 0 && request_content_length == -1 && meta.ttl != 0 &&
+            (peer = cluster_owner(key)) != NULL) {
+          serve_response_from_peer(peer, fds[0].fd, buffer, size, range_header);
+        }
+
         /* Request not found in internal cache, requesting target */
+        struct backend *backend = upstream_select(key);
+        metrics_add(METRIC_CACHE_MISSES, 1);
+        current_request.record.result = RESULT_MISS;
+
+        /* Backends are saturated or their circuits open, don't queue more work on them */
+        if (backend == NULL) {
+          if (found_entry && cfg.max_stale > 0 && found_entry->timestamp + cfg.max_stale > get_timestamp()) {
+            log_info("[%d] No backend available, serving stale entry\n", tid);
+            metrics_add(METRIC_CACHE_STALE, 1);
+            current_request.record.result = RESULT_STALE;
+            serve_response_from_cache(found_entry, NULL, fds[0].fd, accept_encoding);
+          }
+          log_warn("[%d] No backend available\n", tid);
+          metrics_add(METRIC_UPSTREAM_REJECTED, 1);
+          current_request.record.result = RESULT_REJECTED;
+          fail_upstream(sck, -1, 503, NULL);
+        }
+        upstream_started = get_time_us();
         char * request_buffer = rewrite_request(buffer, headers, pret, (int) num_headers, (int) size, req_method,
-                                                method_len, req_path, path_len, minor_version);
+                                                method_len, req_path, path_len, minor_version,
+                                                cfg.target_host != NULL ? cfg.target_host : backend->host);
 
 //        printf("Request buffer: %s\n", request_buffer);
 
-        int req_sockfd = initialize_new_socket();
+        /* Addresses are kept fresh by resolver thread, request path never waits on DNS */
+        struct connect_attempt attempt = {.backend = backend, .deadline = get_time_ms() + cfg.connect_timeout};
+        if (resolver_addresses(backend->resolved, &attempt.addresses) != 0) {
+          log_warn("No address for %s yet\n", backend->host);
+          fail_upstream(sck, -1, 502, backend);
+        }
+
+        int req_sockfd = initialize_new_socket(&attempt, &deadline);
         ssize_t bytes_sent = 0, total_bytes_sent = 0;
-        printf("[%d] New socket: %d (sending request to target)\n", tid, req_sockfd);
+        log_debug("[%d] New socket: %d (sending request to target)\n", tid, req_sockfd);
         size = 0;
 
+        if (req_sockfd < 0) fail_upstream(sck, -1, 502, backend);
+
         struct pollfd *req_fds = (struct pollfd *) calloc(1, sizeof(struct pollfd));
         req_fds[0].fd = req_sockfd;
         req_fds[0].events = POLLOUT;
 
-        while (poll(req_fds, (nfds_t) 1, write_timeout)) {
-          if (fds[0].revents & POLLHUP) {
-            printf("[%d] Fd: %d was disconnected.\n", tid, req_fds[0].fd);
-            sleep(1);
-          } else if (req_fds[0].revents & POLLNVAL) {
-            printf("[%d] Fd: %d is invalid.\n", tid, req_fds[0].fd);
-          } else if (req_fds[0].revents & POLLERR) {
-            printf("[%d] Fd: %d is broken.\n", tid, req_fds[0].fd);
+        while (1) {
+          ready = poll(req_fds, (nfds_t) 1, (int) time_left_ms(deadline));
+          if (ready == -1 && errno == EINTR) continue;
+          if (ready == -1) {
+            log_warn("[%d] Poll on target failed, errno: %d\n", tid, errno);
+            fail_upstream(sck, req_fds[0].fd, 502, backend);
+          }
+
+          /* Address that doesn't answer or refuses gives way to the next one */
+          if (!connected && (ready == 0 || (req_fds[0].revents & (POLLERR | POLLHUP)))) {
+            log_warn("[%d] Connect to fd: %d %s\n", tid, req_sockfd, ready == 0 ? "timed out" : "failed");
+            req_fds[0].fd = req_sockfd = retry_connect(sck, req_sockfd, &attempt, &deadline);
+            continue;
+          }
+
+          if (ready == 0) {
+            log_warn("[%d] Target timed out (status: %d, connected: %d)\n", tid, status, connected);
+            fail_upstream(sck, req_sockfd, 504, backend);
+          }
+
+          if (req_fds[0].revents & POLLNVAL) {
+            log_warn("[%d] Fd: %d is invalid.\n", tid, req_fds[0].fd);
+            fail_upstream(sck, req_sockfd, 502, backend);
+          } else if (status == 1 && (req_fds[0].revents & (POLLERR | POLLHUP))) {
+            log_warn("[%d] Fd: %d is broken.\n", tid, req_fds[0].fd);
+            fail_upstream(sck, req_sockfd, 502, backend);
           } else if (req_fds[0].revents & POLLOUT && status == 1) {
-            printf("[%d] POLLOUT INNER\n", tid);
+            log_trace("[%d] POLLOUT INNER\n", tid);
             req_fds[0].revents = 0;
 
+            /* First writability means non-blocking connect finished, check how */
+            if (!connected) {
+              int so_error = 0;
+              socklen_t so_error_len = sizeof(so_error);
+
+              if (getsockopt(req_sockfd, SOL_SOCKET, SO_ERROR, &so_error, &so_error_len) == -1 || so_error != 0) {
+                log_warn("[%d] Connect failed, error: %d\n", tid, so_error);
+                req_fds[0].fd = req_sockfd = retry_connect(sck, req_sockfd, &attempt, &deadline);
+                continue;
+              }
+              connected = 1;
+              trace_mark(&current_request.trace, TRACE_UPSTREAM_CONNECTED);
+            }
+            deadline = get_time_ms() + cfg.idle_timeout;
+
             if (total_bytes_sent < strlen(request_buffer)) {
-              printf("[%d] Sending...\n", tid);
+              log_trace("[%d] Sending...\n", tid);
               while ((bytes_sent = write(req_sockfd, request_buffer + total_bytes_sent,
                                          strlen(request_buffer) - total_bytes_sent))) {
                 /* Writing should be continued later or end of transmission */
                 if (bytes_sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-                  printf("[%d] Sending would block.\n", tid);
+                  log_trace("[%d] Sending would block.\n", tid);
                   break;
+                } else if (bytes_sent == -1) {
+                  log_warn("[%d] Failed to send request, errno: %d\n", tid, errno);
+                  fail_upstream(sck, req_sockfd, 502, backend);
                 }
 
                 total_bytes_sent += bytes_sent;
 
-                printf("[%d] %d / %d bytes sent. (%d in this tick)\n", tid, (int) total_bytes_sent,
-                       (int) strlen(request_buffer), (int) bytes_sent);
+                log_trace("[%d] %d / %d bytes sent. (%d in this tick)\n", tid, (int) total_bytes_sent,
+                          (int) strlen(request_buffer), (int) bytes_sent);
               }
 
             } else {
-              printf("[%d] Whole request sent.\n", tid);
+              log_debug("[%d] Whole request sent.\n", tid);
               req_fds[0].events = POLLIN;
               free(request_buffer);
               buffer = malloc(BUFSIZE);
@@ -340,172 +539,202 @@ void* handle_tcp_connection(void *ctx) {
               size = 0;
               capacity = BUFSIZE;
               status = 2;
+              trace_mark(&current_request.trace, TRACE_REQUEST_SENT);
+              deadline = get_time_ms() + cfg.first_byte_timeout;
             }
-          } if (req_fds[0].revents & POLLIN && status == 2) {
+          } if (req_fds[0].revents & (POLLIN | POLLHUP | POLLERR) && status == 2) {
             char *msg;
             size_t msg_len;
 
-            printf("[%d] POLLIN INNER rsize: %d, size: %d, capacity: %d, buffer: %s\n", tid, (int) rsize, (int) size,
-                   (int) capacity, buffer);
+            log_trace("[%d] POLLIN INNER rsize: %d, size: %d, capacity: %d, buffer: %s\n", tid, (int) rsize, (int) size,
+                      (int) capacity, buffer);
             req_fds[0].revents = 0;
 
-            while ((rsize = read(req_fds[0].fd, buffer + size, capacity - size))) {
+            while (1) {
+              char *target = buffer + size;
+              size_t available = capacity - size;
+              int leftover = 0;
+
+              /* Once headers are parsed body is read straight into slices, never into one growing buffer */
+              if (res_parsed == 1) target = slice_buffer_tail(&body, &available);
+
+              rsize = read(req_fds[0].fd, target, available);
+
               /* Reading should be continued later or end of transmission */
               if (rsize == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-                printf("[%d] would block\n", tid);
+                log_trace("[%d] would block\n", tid);
                 break;
+              } else if (rsize == 0 && res_parsed == 1 && !meta.chunked && meta.content_length == -1) {
+                /* Without Content-Length or chunked framing, body ends with connection */
+                complete = 1;
+                break;
+              } else if (rsize <= 0) {
+                /* Cut off before headers, Content-Length bytes or last chunk, never cache or serve it */
+                log_warn("[%d] Target closed or failed mid-response (read: %d, errno: %d)\n", tid, (int) rsize,
+                         rsize == 0 ? 0 : errno);
+                slice_buffer_free(&body);
+                fail_upstream(sck, req_fds[0].fd, 502, backend);
               }
 
-              /* Else (positive number of bytes) */
-              size += rsize;
+              /* Target is alive, from now on only idle time between reads counts */
+              deadline = get_time_ms() + cfg.idle_timeout;
+              metrics_add(METRIC_UPSTREAM_BYTES_IN, rsize);
 
-              printf("[%d] Receiving bytes from target: %d, errno: %d\n", tid, (int) rsize, errno);
+              log_trace("[%d] Receiving bytes from target: %d, errno: %d\n", tid, (int) rsize, errno);
 
               if (res_parsed != 1) {
+                size += rsize;
                 num_headers = sizeof(res_headers) / sizeof(res_headers[0]);
-                pret = phr_parse_response(buffer, strlen(buffer), &res_minor_version, &res_status, &msg, &msg_len,
-                                          res_headers,
-                                          &num_headers, 0);
+                pret = phr_parse_response(buffer, size, &res_minor_version, &res_status, &msg, &msg_len,
+                                          res_headers, &num_headers, res_last_len);
+                res_last_len = size;
 
                 if (pret == -2) {
-                  /* Keep on receiving, request incomplete */
+                  /* Keep on receiving, headers incomplete */
+                  if (size == capacity) {
+                    log_trace("[%d] Reallocating buffer to capacity: %d\n", tid, (int) (capacity * 2));
+                    capacity *= 2;
+                    buffer = realloc(buffer, (size_t) capacity);
+
+                    if (buffer == NULL) {
+                      log_error("[%d] Failed to reallocate the buffer!\n", tid);
+                      exit(EXIT_FAILURE);
+                    }
+                  }
                   continue;
                 } else if (pret == -1) {
-                  printf("Response parse error! pret=1%s\n", buffer);
+                  log_warn("Response parse error! pret=1%s\n", buffer);
+                  complete = 1;
                   break;
                 }
 
-                printf("[%d] Response parsed! Headers: %d\n", tid, (int) num_headers);
-
-                for (i = 0; i != num_headers; ++i) {
-                  char *name = malloc(sizeof(char) * res_headers[i].name_len);
-                  char *value = malloc(sizeof(char) * res_headers[i].value_len);
-                  sprintf(name, "%.*s", (int) res_headers[i].name_len, res_headers[i].name);
-                  sprintf(value, "%.*s", (int) res_headers[i].value_len, res_headers[i].value);
-
-                  printf("[%d][%d] %s: %s\n", tid, i, name, value);
-
-                  if (strcmp("Cache-Control", name) == 0) {
-                    /* Override requests caching strategy by response caching strategy */
-                    if (strcmp(value, "no-cache") == 0 || strcmp(value, "no-store") == 0) ttl = 0;
-                    else {
-                      /* Parse "max-age=X" */
-                      ttl = get_ttl_value((char *) value);
-                    }
-                  } else if (strcmp("Content-Length", name) == 0) {
-                    response_content_length = atoi(value);
-                  } else if (strcmp("Transfer-Encoding", name) == 0) {
-                    if (strcmp("chunked", value) == 0) {
-                      printf("Detected chunked response...\n");
-                      chunked = 1;
-                    }
-                  }
+                log_debug("[%d] Response parsed! Headers: %d\n", tid, (int) num_headers);
 
-                  free(name);
-                  free(value);
-                }
+                parse_response_headers(buffer, res_headers, num_headers, &meta);
 
                 res_parsed = 1;
+                decoder.consume_trailer = 1;
+                upstream_latency = get_time_us() - upstream_started;
+                trace_mark(&current_request.trace, TRACE_RESPONSE_HEADERS);
+
+                /* Bytes read past the headers are the beginning of body */
+                target = buffer + pret;
+                rsize = size - pret;
+                size = (size_t) pret;
+                leftover = 1;
               }
 
-              if (size == capacity) {
-                printf("[%d] Reallocating buffer to capacity: %d\n", tid, (int) (capacity * 2));
-                capacity *= 2;
-                buffer = realloc(buffer, (size_t) capacity);
-
-                if (buffer == NULL) {
-                  printf("[%d] Failed to reallocate the buffer!\n", tid);
-                  exit(EXIT_FAILURE);
+              /* De-chunk only the bytes received by this read, in place */
+              if (meta.chunked) {
+                size_t chunk_bytes = (size_t) rsize;
+                ssize_t dret = phr_decode_chunked(&decoder, target, &chunk_bytes);
+
+                if (leftover) slice_buffer_append(&body, target, chunk_bytes);
+                else slice_buffer_commit(&body, chunk_bytes);
+
+                /* Body decoded so far is not the response, never cache or serve it */
+                if (dret == -1) {
+                  log_warn("[%d] Chunked response decode error!\n", tid);
+                  slice_buffer_free(&body);
+                  fail_upstream(sck, req_fds[0].fd, 502, backend);
+                } else if (dret >= 0) {
+                  log_trace("[%d] End of chunked response\n", tid);
+                  complete = 1;
+                  break;
                 }
+                continue;
               }
 
+              if (leftover) slice_buffer_append(&body, target, (size_t) rsize);
+              else slice_buffer_commit(&body, (size_t) rsize);
+
               /* Content-Length header was present and it's value is bigger than downloaded bytes */
-              if (response_content_length != -1) {
-                if (size < response_content_length + pret) {
-                  printf("[%d] response_content_length: %d but read so far: %d, retrying...\n", tid,
-                         response_content_length, (int) size);
+              if (meta.content_length != -1) {
+                if (body.bytes < (uint64_t) meta.content_length) {
                   continue;
                 } else {
-                  printf("[%d] Whole request downloaded\n", tid);
+                  log_debug("[%d] Whole response downloaded\n", tid);
+                  complete = 1;
                   break;
                 }
               }
+            }
 
-              if (chunked == 1 && buffer[strlen(buffer) - 1] == 10 && buffer[strlen(buffer) - 2] == 13) {
-                printf("[%d] End of chunked response\n", tid);
-                break;
-              } else continue;
+            /* Wait for more data until idle deadline */
+            if (!complete) continue;
+
+            if (res_parsed != 1) {
+              log_warn("[%d] No valid response from target, closing fd: %d\n", tid, sck);
+              fail_upstream(sck, req_fds[0].fd, 502, backend);
             }
 
+            trace_mark(&current_request.trace, TRACE_RESPONSE_READ);
 
-            /* Save to cache only if TTL is greater than zero */
-            if (ttl > 0) {
-              struct cache_entry *entry = (struct cache_entry *) malloc(sizeof(struct cache_entry));
-              entry->key = key;
-              entry->timestamp = get_timestamp() + ttl;
-              entry->buffer = malloc(size);
-              entry->bytes = (u_int32_t) size;
-              strcpy(entry->buffer, buffer);
+            /* 5xx counts towards opening backend's circuit */
+            upstream_release(backend, res_status < 500, upstream_latency);
 
-              /* Avoid concurrent writes */
-              pthread_mutex_lock(&cache_mutex);
-              HASH_ADD_INT(cache, key, entry);
-              pthread_mutex_unlock(&cache_mutex);
+            slice_buffer_trim(&body);
+            response_headers_size = (size_t) pret;
+
+            /* Store and serve the de-chunked body with an explicit Content-Length */
+            if (meta.chunked) {
+              char *head = rewrite_chunked_head(buffer, (size_t) pret, meta.te_start, meta.te_end, body.bytes,
+                                                &response_headers_size);
+              free(buffer);
+              buffer = head;
             }
+            buffer = vary_on_encoding(buffer, &response_headers_size, &meta, body.bytes);
+
+            /* Entry takes over head and slices, they are sent to this client from there too */
+            cache_release(current_request.entry);
+            found_entry = NULL;
+            current_request.entry = cache_store(key, res_status, buffer, response_headers_size, &body, &meta,
+                                                current_request.index_path);
+            stored = current_request.entry != NULL;
 
             close(req_fds[0].fd);
             status = 3;
             fds[0].events = POLLOUT;
-            printf("[%d] Closing sock=%d, status: %d\n", tid, req_fds[0].fd, status);
+            log_debug("[%d] Closing sock=%d, status: %d\n", tid, req_fds[0].fd, status);
             break;
           }
         }
       }
     } else if (fds[0].revents & POLLOUT) {
-      printf("[%d] POLLOUT OUTER - %d, status=%d\n", tid, sck, status);
+      log_trace("[%d] POLLOUT OUTER - %d, status=%d\n", tid, sck, status);
       if (status == 3) {
         fds[0].revents = 0;
-        ssize_t bytes_sent = 0, total_bytes_sent = 0;
-
-        if (total_bytes_sent < strlen(buffer)) {
-          printf("[%d] Sending...\n", tid);
-          while ((bytes_sent = write(fds[0].fd, buffer + total_bytes_sent, strlen(buffer) - total_bytes_sent))) {
-            /* Writing should be continued later */
-            if (bytes_sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-              printf("[%d] Sending would block.\n", tid);
-              break;
-            }
 
-            total_bytes_sent += bytes_sent;
+        current_request.record.status = (uint16_t) res_status;
+        current_request.record.upstream_us = (uint32_t) upstream_latency;
 
-            printf("[%d] %d / %d bytes sent. (%d in this tick)\n", tid, (int) total_bytes_sent, (int) strlen(buffer),
-                   (int) bytes_sent);
-
-            if (total_bytes_sent == strlen(buffer)) {
-              close(fds[0].fd);
-              printf("[%d] End\n", tid);
-              status = 0;
-              break;
-            }
-          }
+        if (range_header != NULL && res_status == 200 &&
+            (range_status = send_range_response(fds[0].fd, buffer, response_headers_size, &body, range_header)) > 0) {
+          current_request.record.status = (uint16_t) range_status;
+          log_debug("[%d] Range response sent\n", tid);
         } else {
-          printf("[%d] Whole response sent!\n", tid);
-
-          close(fds[0].fd);
-          free(buffer);
-          free(fds);
-          pthread_exit(NULL);
+          send_response(fds[0].fd, buffer, response_headers_size, &body);
+          log_debug("[%d] Whole response sent!\n", tid);
         }
+
+        close(fds[0].fd);
+        status = 0;
       } else {
-        printf("[%d] Incorrect status! %d\n", tid, status);
+        log_error("[%d] Incorrect status! %d\n", tid, status);
       }
     }
   }
 
-  free(buffer);
+  /* Cached responses are owned by their cache entry */
+  if (!stored) {
+    free(buffer);
+    slice_buffer_free(&body);
+  }
   free(fds);
+  free(range_header);
 
-  printf("[%d] poll outer end, status: %d\n", tid, status);
+  log_debug("[%d] poll outer end, status: %d\n", tid, status);
+  pthread_cleanup_pop(1);
   pthread_exit(NULL);
 }
 
@@ -515,16 +744,16 @@ void handle_socket(int newsockfd) {
 
   rc = pthread_create(&thid, NULL, handle_tcp_connection, (void *) newsockfd);
   if (rc == 0) {
-    printf("[%d] Thread created. Sock: %d\n", (int) thid, newsockfd);
+    log_trace("[%d] Thread created. Sock: %d\n", (int) thid, newsockfd);
     rc = pthread_detach(thid);
 
     if (rc == 0) {
-      printf("[%d] Thread detached.\n", (int) thid);
+      log_trace("[%d] Thread detached.\n", (int) thid);
     } else {
-      printf("Failed to detach thread. Rc: %d, Errno: %d\n", rc, errno);
+      log_error("Failed to detach thread. Rc: %d, Errno: %d\n", rc, errno);
     }
   } else {
-    printf("Failed to create thread. Rc: %d, Errno: %d\n", rc, errno);
+    log_error("Failed to create thread. Rc: %d, Errno: %d\n", rc, errno);
   }
 }
 
@@ -540,16 +769,10 @@ void run(int listen_sck_fd, configuration cfg) {
   fds[0].fd = listen_sck_fd;
   fds[0].events = POLLIN;
 
-  /* Get sockaddr_in structure only once as it's unlikely to change */
-  target_serv_addr = get_server_addr(cfg);
-  if (target_serv_addr.sin_addr.s_addr == 0) {
-    handle_error(1, errno, "Failed to create sockaddr_in structure");
-    exit(EXIT_FAILURE);
-  }
-
   while (poll(fds, (nfds_t) 1, -1)) {
     fds[0].revents = 0;
 
+    clilen = sizeof(cli_addr);
     int newsockfd = accept(listen_sck_fd, (struct sockaddr *) &cli_addr, &clilen);
     if (newsockfd > 0) {
       handle_socket(newsockfd);
@@ -557,23 +780,118 @@ void run(int listen_sck_fd, configuration cfg) {
   }
 }
 
+/* Accept loop of one NUMA node's listener */
+void *run_node(void *ctx) {
+  run((int) (intptr_t) ctx, cfg);
+  return NULL;
+}
+
+/*
+ * One SO_REUSEPORT listener per NUMA node. Main thread binds itself to each node before creating that node's accept
+ * thread, which inherits CPUs and memory policy and passes them on to its connection threads. Lowest node is served by
+ * main thread.
+ */
+void run_nodes() {
+  int first_sck = -1, first_node = -1;
+
+  for (int node = 0; node < nodes_count(); node++) {
+    pthread_t thread;
+    int listen_sck;
+
+    /* Nodes with memory only can't run threads */
+    if (nodes_bind(node) != 0) continue;
+
+    listen_sck = prepare_in_sock_shared(cfg);
+    if (listen_sck < 0) {
+      handle_error(1, errno, "listen_sck");
+    }
+
+    if (first_sck < 0) {
+      first_sck = listen_sck;
+      first_node = node;
+    } else if (pthread_create(&thread, NULL, run_node, (void *) (intptr_t) listen_sck) == 0) {
+      pthread_detach(thread);
+      log_info("[numa] Accepting on node %d\n", node);
+    } else {
+      handle_error(1, errno, "Failed to create listener thread");
+    }
+  }
+
+  if (first_sck < 0) {
+    handle_error(1, EINVAL, "No NUMA node to listen on");
+  }
+
+  nodes_bind(first_node);
+  log_info("[numa] Accepting on node %d\n", first_node);
+  run(first_sck, cfg);
+}
+
 int main(int argc, char **argv) {
   char *config_name;
 
   if (argc >= 2) {
-    config_name = malloc(sizeof(char) * strlen(argv[1]));
+    config_name = malloc(sizeof(char) * (strlen(argv[1]) + 1));
     strcpy(config_name, argv[1]);
   } else {
     config_name = "config.ini";
   }
 
+  set_config_defaults(&cfg);
+
   if (ini_parse(config_name, config_handler, &cfg) < 0) {
     handle_error(1, EACCES, "Can't load config");
     return 1;
   }
 
-  printf("Cachr started with config from '%s': host=%s, port=%s...\n",
-         config_name, cfg.listen_host, cfg.listen_port);
+  log_level = cfg.log_level;
+  log_start();
+
+  log_info("Cachr started with config from '%s': host=%s, port=%s...\n",
+           config_name, cfg.listen_host, cfg.listen_port);
+  trace_init(&cfg);
+  nodes_init(&cfg);
+  arena_init(&cfg);
+  cache_init(&cfg);
+
+  if (cluster_init(&cfg) != 0) {
+    handle_error(1, EINVAL, "Invalid [cluster] configuration");
+    return 1;
+  }
+
+  /* Backends are resolved before accepting connections, then refreshed by resolver thread */
+  if (upstream_init(&cfg) != 0) {
+    handle_error(1, errno, "Failed to initialize upstream backends");
+    return 1;
+  }
+
+  if (cfg.tasks_threads > 0 && tasks_start(cfg.tasks_threads, (int) cfg.tasks_queue) != 0) {
+    log_warn("Task pool is not running, responses won't be pre-compressed\n");
+  }
+
+  if (cfg.compression) {
+    compression_init(cfg.compression_level);
+  }
+
+  admin_start(&cfg);
+
+  if (cluster_start() != 0) {
+    handle_error(1, errno, "Failed to start cluster listener");
+    return 1;
+  }
+
+  if (prefetch_start(&cfg) != 0) {
+    handle_error(1, errno, "Failed to start prefetch");
+    return 1;
+  }
+
+  if (access_log_init(&cfg) != 0) {
+    handle_error(1, errno, "Failed to initialize access log");
+    return 1;
+  }
+
+  if (nodes_count() > 1) {
+    run_nodes();
+  }
 
   int listen_sck = prepare_in_sock(cfg);
   if (listen_sck < 0) {
@@ -582,6 +900,6 @@ int main(int argc, char **argv) {
 
   run(listen_sck, cfg);
 
-  free(cache);
+  arena_free(cache);
   return 0;
 }
@@ -0,0 +1,213 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "metrics.h"
+
+struct metric_info {
+  const char *name;
+  const char *help;
+  const char *type;
+  /* Label pairs without braces, series with the same name share HELP and TYPE lines */
+  const char *labels;
+};
+
+static const struct metric_info metric_infos[METRIC_COUNT] = {
+  {"cachr_connections_opened_total", "Client connections accepted", "counter"},
+  {"cachr_connections_closed_total", "Client connections finished", "counter"},
+  {"cachr_requests_total", "Requests parsed", "counter"},
+  {"cachr_cache_hits_total", "Requests served from a fresh cache entry", "counter"},
+  {"cachr_cache_l1_hits_total", "Lookups answered by per-CPU front cache without locking cache index", "counter"},
+  {"cachr_cache_misses_total", "Requests sent to a backend", "counter"},
+  {"cachr_cache_stale_total", "Expired entries served while no backend could take the request", "counter"},
+  {"cachr_cache_evictions_total", "Entries removed from cache index", "counter"},
+  {"cachr_cache_purged_total", "Entries invalidated through admin purge", "counter"},
+  {"cachr_cache_entries", "Entries in cache index", "gauge"},
+  {"cachr_cache_bytes", "Bytes held by cache entries and their encoded variants", "gauge"},
+  {"cachr_bytes_in_total", "Bytes read from clients", "counter"},
+  {"cachr_bytes_out_total", "Bytes written to clients", "counter"},
+  {"cachr_upstream_requests_total", "Requests finished by backends", "counter"},
+  {"cachr_upstream_errors_total", "Backend requests that failed, timed out or returned 5xx", "counter"},
+  {"cachr_upstream_rejected_total", "Misses refused because every backend was saturated or its circuit open", "counter"},
+  {"cachr_upstream_bytes_in_total", "Bytes read from backends", "counter"},
+  {"cachr_prefetch_requests_total", "URLs fetched by prefetch, stored or not", "counter"},
+  {"cachr_prefetch_errors_total", "URLs prefetch failed to fetch", "counter"},
+  {"cachr_cluster_requests_total", "Misses answered by the cluster member owning their key", "counter"},
+  {"cachr_cluster_errors_total", "Requests to cluster members that failed", "counter"},
+  {"cachr_cluster_ejections_total", "Times a cluster member was ejected after repeated failures", "counter"},
+  {"cachr_cluster_served_total", "Requests answered for other cluster members", "counter"},
+  {"cachr_numa_local_hits_total", "Hits served from memory on the serving thread's NUMA node", "counter"},
+  {"cachr_numa_remote_hits_total", "Hits served from memory on another NUMA node", "counter"},
+  {"cachr_numa_replicas_total", "Entries copied to another NUMA node after repeated remote hits", "counter"},
+  {"cachr_arena_fallbacks_total", "Cache allocations served by malloc because arena region was full", "counter"},
+  {"cachr_tasks_completed_total", "Background tasks run by the task pool", "counter"},
+  {"cachr_tasks_stolen_total", "Tasks an idle worker took from another worker's deque", "counter"},
+  {"cachr_tasks_rejected_total", "Tasks refused because the task pool's queue was full", "counter"},
+};
+
+static const struct metric_info histogram_infos[HISTOGRAM_COUNT] = {
+  {"cachr_request_duration_seconds", "Time from accepting connection to closing it", "summary"},
+  {"cachr_upstream_latency_seconds", "Time from picking backend to parsed response headers", "summary"},
+  {"cachr_request_phase_seconds", "Time spent in each phase of a request", "summary", "phase=\"client_read\""},
+  {"cachr_request_phase_seconds", "", "summary", "phase=\"cache_lookup\""},
+  {"cachr_request_phase_seconds", "", "summary", "phase=\"upstream_connect\""},
+  {"cachr_request_phase_seconds", "", "summary", "phase=\"upstream_send\""},
+  {"cachr_request_phase_seconds", "", "summary", "phase=\"upstream_ttfb\""},
+  {"cachr_request_phase_seconds", "", "summary", "phase=\"upstream_body\""},
+  {"cachr_request_phase_seconds", "", "summary", "phase=\"client_write\""},
+};
+
+static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+__thread struct metrics_shard *metrics_local = NULL;
+
+/* Every shard ever created, reused after their thread exits. Totals of exited threads are folded into retired */
+static struct metrics_shard *shards = NULL, retired;
+static pthread_mutex_t shards_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t shard_key;
+static pthread_once_t shard_key_once = PTHREAD_ONCE_INIT;
+
+static void fold_shard(struct metrics_shard *into, struct metrics_shard *from) {
+  for (int i = 0; i < METRIC_COUNT; i++) {
+    into->counters[i] += __atomic_load_n(&from->counters[i], __ATOMIC_RELAXED);
+  }
+
+  for (int i = 0; i < HISTOGRAM_COUNT; i++) {
+    for (int j = 0; j < HISTOGRAM_BUCKETS; j++) {
+      into->histograms[i].counts[j] += __atomic_load_n(&from->histograms[i].counts[j], __ATOMIC_RELAXED);
+    }
+    into->histograms[i].sum += __atomic_load_n(&from->histograms[i].sum, __ATOMIC_RELAXED);
+  }
+}
+
+/* Thread exit: keep its totals and give the shard back */
+static void release_shard(void *ptr) {
+  struct metrics_shard *shard = ptr;
+
+  pthread_mutex_lock(&shards_mutex);
+  fold_shard(&retired, shard);
+  memset(shard->counters, 0, sizeof(shard->counters));
+  memset(shard->histograms, 0, sizeof(shard->histograms));
+  shard->in_use = 0;
+  pthread_mutex_unlock(&shards_mutex);
+
+  metrics_local = NULL;
+}
+
+static void create_shard_key() {
+  pthread_key_create(&shard_key, release_shard);
+}
+
+/* Slow path of metrics_shard(), once per thread */
+struct metrics_shard *metrics_register() {
+  struct metrics_shard *shard;
+
+  pthread_once(&shard_key_once, create_shard_key);
+  pthread_mutex_lock(&shards_mutex);
+
+  for (shard = shards; shard != NULL && shard->in_use; shard = shard->next);
+
+  if (shard == NULL) {
+    if (posix_memalign((void **) &shard, 64, sizeof(struct metrics_shard)) != 0) abort();
+    memset(shard, 0, sizeof(struct metrics_shard));
+    shard->next = shards;
+    shards = shard;
+  }
+
+  shard->in_use = 1;
+  pthread_mutex_unlock(&shards_mutex);
+
+  pthread_setspecific(shard_key, shard);
+  metrics_local = shard;
+  return shard;
+}
+
+int histogram_bucket(uint64_t value) {
+  int exponent;
+
+  if (value < HISTOGRAM_SUB_BUCKETS) return (int) value;
+
+  exponent = 63 - __builtin_clzll(value);
+  if (exponent > HISTOGRAM_MAX_EXPONENT) return HISTOGRAM_BUCKETS - 1;
+
+  return (exponent - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS +
+         (int) ((value >> (exponent - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+/* Middle of the value range covered by bucket */
+static double bucket_value(int bucket) {
+  int group = bucket / HISTOGRAM_SUB_BUCKETS, sub = bucket % HISTOGRAM_SUB_BUCKETS, shift;
+
+  if (group == 0) return sub;
+
+  shift = group - 1;
+  return (double) ((uint64_t) (HISTOGRAM_SUB_BUCKETS + sub) << shift) + ((1ULL << shift) - 1) / 2.0;
+}
+
+/* Value (us) below which fraction q of recorded values fall */
+double histogram_quantile(struct histogram *histogram, double q) {
+  uint64_t count = 0, rank, seen = 0;
+
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++) count += histogram->counts[i];
+  if (count == 0) return 0;
+
+  rank = (uint64_t) (q * count);
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    seen += histogram->counts[i];
+    if (seen > rank || seen == count) return bucket_value(i);
+  }
+  return 0;
+}
+
+static void render_histogram(FILE *out, const struct metric_info *info, struct histogram *histogram, int header) {
+  const char *labels = info->labels != NULL ? info->labels : "", *separator = info->labels != NULL ? "," : "";
+  uint64_t count = 0;
+
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++) count += histogram->counts[i];
+
+  if (header) fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", info->name, info->help, info->name, info->type);
+
+  for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+    fprintf(out, "%s{%s%squantile=\"%g\"} %.6f\n", info->name, labels, separator, quantiles[q],
+            histogram_quantile(histogram, quantiles[q]) / 1e6);
+  }
+
+  if (info->labels != NULL) {
+    fprintf(out, "%s_sum{%s} %.6f\n%s_count{%s} %llu\n", info->name, labels, histogram->sum / 1e6, info->name,
+            labels, (unsigned long long) count);
+  } else {
+    fprintf(out, "%s_sum %.6f\n%s_count %llu\n", info->name, histogram->sum / 1e6, info->name,
+            (unsigned long long) count);
+  }
+}
+
+/* Aggregates all shards, the only place that pays for per-thread counters */
+void metrics_render(FILE *out) {
+  struct metrics_shard *total;
+
+  if (posix_memalign((void **) &total, 64, sizeof(struct metrics_shard)) != 0) return;
+  memset(total, 0, sizeof(struct metrics_shard));
+
+  pthread_mutex_lock(&shards_mutex);
+  fold_shard(total, &retired);
+  for (struct metrics_shard *shard = shards; shard != NULL; shard = shard->next) {
+    if (shard->in_use) fold_shard(total, shard);
+  }
+  pthread_mutex_unlock(&shards_mutex);
+
+  for (int i = 0; i < METRIC_COUNT; i++) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n%s %lld\n", metric_infos[i].name, metric_infos[i].help,
+            metric_infos[i].name, metric_infos[i].type, metric_infos[i].name, (long long) total->counters[i]);
+  }
+
+  fprintf(out, "# HELP cachr_connections_active Client connections being served\n"
+               "# TYPE cachr_connections_active gauge\ncachr_connections_active %lld\n",
+          (long long) (total->counters[METRIC_CONNECTIONS_OPENED] - total->counters[METRIC_CONNECTIONS_CLOSED]));
+
+  for (int i = 0; i < HISTOGRAM_COUNT; i++) {
+    render_histogram(out, &histogram_infos[i], &total->histograms[i],
+                     i == 0 || strcmp(histogram_infos[i].name, histogram_infos[i - 1].name) != 0);
+  }
+
+  free(total);
+}
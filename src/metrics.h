@@ -0,0 +1,105 @@
+#ifndef CACHR_METRICS_H
+#define CACHR_METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* Log-linear histogram: 16 sub-buckets per power of two (~6% error), values up to 2^36 us */
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_EXPONENT 36
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_EXPONENT - HISTOGRAM_SUB_BITS + 2) * HISTOGRAM_SUB_BUCKETS)
+
+/* Counters, gauges are kept as counters of increments and decrements */
+enum metric {
+  METRIC_CONNECTIONS_OPENED = 0,
+  METRIC_CONNECTIONS_CLOSED,
+  METRIC_REQUESTS,
+  METRIC_CACHE_HITS,
+  METRIC_CACHE_L1_HITS,
+  METRIC_CACHE_MISSES,
+  METRIC_CACHE_STALE,
+  METRIC_CACHE_EVICTIONS,
+  METRIC_CACHE_PURGED,
+  METRIC_CACHE_ENTRIES,
+  METRIC_CACHE_BYTES,
+  METRIC_BYTES_IN,
+  METRIC_BYTES_OUT,
+  METRIC_UPSTREAM_REQUESTS,
+  METRIC_UPSTREAM_ERRORS,
+  METRIC_UPSTREAM_REJECTED,
+  METRIC_UPSTREAM_BYTES_IN,
+  METRIC_PREFETCH_REQUESTS,
+  METRIC_PREFETCH_ERRORS,
+  METRIC_CLUSTER_REQUESTS,
+  METRIC_CLUSTER_ERRORS,
+  METRIC_CLUSTER_EJECTIONS,
+  METRIC_CLUSTER_SERVED,
+  METRIC_NUMA_LOCAL_HITS,
+  METRIC_NUMA_REMOTE_HITS,
+  METRIC_NUMA_REPLICAS,
+  METRIC_ARENA_FALLBACKS,
+  METRIC_TASKS_COMPLETED,
+  METRIC_TASKS_STOLEN,
+  METRIC_TASKS_REJECTED,
+  METRIC_COUNT
+};
+
+enum histogram_type {
+  HISTOGRAM_REQUEST_DURATION = 0,
+  HISTOGRAM_UPSTREAM_LATENCY,
+  /* Request phases in trace_mark order, see trace.h */
+  HISTOGRAM_PHASE_CLIENT_READ,
+  HISTOGRAM_PHASE_CACHE_LOOKUP,
+  HISTOGRAM_PHASE_UPSTREAM_CONNECT,
+  HISTOGRAM_PHASE_UPSTREAM_SEND,
+  HISTOGRAM_PHASE_UPSTREAM_TTFB,
+  HISTOGRAM_PHASE_UPSTREAM_BODY,
+  HISTOGRAM_PHASE_CLIENT_WRITE,
+  HISTOGRAM_COUNT
+};
+
+struct histogram {
+  uint64_t counts[HISTOGRAM_BUCKETS];
+  uint64_t sum;
+};
+
+/* Written only by its owning thread, so updates are plain loads and stores without lock prefix */
+struct metrics_shard {
+  uint64_t counters[METRIC_COUNT];
+  struct histogram histograms[HISTOGRAM_COUNT];
+  struct metrics_shard *next;
+  int in_use;
+} __attribute__((aligned(64)));
+
+extern __thread struct metrics_shard *metrics_local;
+
+struct metrics_shard *metrics_register();
+int histogram_bucket(uint64_t value);
+double histogram_quantile(struct histogram *histogram, double q);
+void metrics_render(FILE *out);
+
+static inline struct metrics_shard *metrics_shard() {
+  return metrics_local != NULL ? metrics_local : metrics_register();
+}
+
+static inline void metrics_add(int metric, int64_t n) {
+  uint64_t *counter = &metrics_shard()->counters[metric];
+  __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + (uint64_t) n, __ATOMIC_RELAXED);
+}
+
+/* Calling thread's own value of a counter */
+static inline uint64_t metrics_value(int metric) {
+  return __atomic_load_n(&metrics_shard()->counters[metric], __ATOMIC_RELAXED);
+}
+
+/* Records value in microseconds */
+static inline void metrics_observe(int type, uint64_t value) {
+  struct histogram *histogram = &metrics_shard()->histograms[type];
+  uint64_t *count = &histogram->counts[histogram_bucket(value)];
+
+  __atomic_store_n(count, __atomic_load_n(count, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&histogram->sum, __atomic_load_n(&histogram->sum, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+#endif //CACHR_METRICS_H
@@ -5,7 +5,17 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/uio.h>
 #include "configutils.h"
+#include "netutils.h"
+#include "metrics.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
 
 int make_socket_non_blocking(int sfd) {
   int  s = fcntl(sfd, F_SETFL, O_NONBLOCK);
@@ -16,7 +26,23 @@ int make_socket_non_blocking(int sfd) {
   return 0;
 }
 
+static int listen_sock(const char *host, const char *port, int reuse_port);
+
 int prepare_in_sock(configuration cfg) {
+  return listen_sock(cfg.listen_host, cfg.listen_port, 0);
+}
+
+/* Client listener that other sockets can bind too (SO_REUSEPORT), kernel spreads connections between them */
+int prepare_in_sock_shared(configuration cfg) {
+  return listen_sock(cfg.listen_host, cfg.listen_port, 1);
+}
+
+/* Non-blocking listening socket bound to host:port */
+int prepare_listen_sock(const char *host, const char *port) {
+  return listen_sock(host, port, 0);
+}
+
+static int listen_sock(const char *host, const char *port, int reuse_port) {
   struct addrinfo hints;
   struct addrinfo *result, *rp;
   int s, sfd;
@@ -26,7 +52,7 @@ int prepare_in_sock(configuration cfg) {
   hints.ai_socktype = SOCK_STREAM;
   hints.ai_flags = AI_PASSIVE;
 
-  s = getaddrinfo(cfg.listen_host, cfg.listen_port, &hints, &result);
+  s = getaddrinfo(host, port, &hints, &result);
   if (s != 0) {
     return -1;
   }
@@ -37,6 +63,7 @@ int prepare_in_sock(configuration cfg) {
       continue;
 
     setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &(int){ 1 }, sizeof(int));
+    if (reuse_port) setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, &(int){ 1 }, sizeof(int));
 
     s = bind(sfd, rp->ai_addr, rp->ai_addrlen);
     if (s == 0) {
@@ -60,19 +87,36 @@ int prepare_in_sock(configuration cfg) {
   return -1;
 }
 
-struct sockaddr_in get_server_addr(configuration cfg) {
-  struct sockaddr_in serv_addr;
-  struct hostent *server;
+/* Writes every iovec, waiting on POLLOUT when socket would block */
+int write_all(int fd, struct iovec *iov, int iovcnt) {
+  struct pollfd pfd = {.fd = fd, .events = POLLOUT};
 
-  server = gethostbyname(cfg.target_host);
-  if (server == NULL) {
-    exit(0);
-  }
+  while (iovcnt > 0) {
+    ssize_t written = writev(fd, iov, iovcnt > IOV_MAX ? IOV_MAX : iovcnt);
 
-  bzero((char *) &serv_addr, sizeof(serv_addr));
-  serv_addr.sin_family = AF_INET;
-  bcopy(server->h_addr, (char *) &serv_addr.sin_addr.s_addr, (size_t) server->h_length);
-  serv_addr.sin_port = htons(cfg.target_port);
+    if (written == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        poll(&pfd, 1, -1);
+        continue;
+      } else if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+
+    metrics_add(METRIC_BYTES_OUT, written);
+
+    while (iovcnt > 0 && (size_t) written >= iov->iov_len) {
+      written -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
 
-  return serv_addr;
+    if (iovcnt > 0) {
+      iov->iov_base = (char *) iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+
+  return 0;
 }
@@ -1,10 +1,13 @@
 #ifndef CACHR_NETURILS_H
 #define CACHR_NETURILS_H
 
+#include <sys/uio.h>
 #include "configutils.h"
 
 int prepare_in_sock(configuration cfg);
-struct sockaddr_in get_server_addr(configuration cfg);
+int prepare_in_sock_shared(configuration cfg);
+int prepare_listen_sock(const char *host, const char *port);
 int make_socket_non_blocking(int sfd);
+int write_all(int fd, struct iovec *iov, int iovcnt);
 
 #endif //CACHR_NETURILS_H
@@ -0,0 +1,202 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#ifdef CACHR_HAVE_NUMA
+#include <numa.h>
+#endif
+
+#include "nodes.h"
+#include "metrics.h"
+#include "log.h"
+
+/*
+ * NUMA placement. Each node gets its own client listener whose accept thread is bound to the node's CPUs with local
+ * allocation, connection threads inherit both, so a miss stores its body on the node that accepted it. Hits are
+ * counted as local or remote against the node entry's memory is on, entries hit remotely often enough get a copy on the
+ * hitting node, allocated on that node and freed with the entry.
+ */
+
+/* Claimed while a copy is made, stays when node's replica memory is exhausted so nobody tries again */
+#define REPLICA_NONE ((struct cache_replica *) 1)
+
+/* 0 while placement is off */
+static int count = 0;
+static unsigned int replicate_hits;
+static size_t replica_memory;
+/* Replica bytes allocated on each node, copies are refused past replica_memory */
+static size_t *replica_bytes = NULL;
+
+void nodes_init(configuration *cfg) {
+  if (!cfg->numa) return;
+
+#ifdef CACHR_HAVE_NUMA
+  if (numa_available() < 0) {
+    log_warn("[numa] No NUMA support in kernel, placement is off\n");
+    return;
+  }
+
+  count = numa_max_node() + 1;
+  replicate_hits = cfg->numa_replicate_hits;
+  replica_memory = (size_t) cfg->numa_replica_memory * 1024 * 1024;
+  replica_bytes = calloc((size_t) count, sizeof(size_t));
+
+  log_info("[numa] %d nodes, entries are copied to a node after %u remote hits (%u MiB per node)\n", count,
+           replicate_hits, cfg->numa_replica_memory);
+#else
+  log_warn("[numa] Built without libnuma, placement is off\n");
+#endif
+}
+
+int nodes_count() {
+  return count;
+}
+
+/* Moves calling thread to node's CPUs and its future allocations to node's memory, threads it creates inherit both */
+int nodes_bind(int node) {
+#ifdef CACHR_HAVE_NUMA
+  if (count == 0 || numa_run_on_node(node) != 0) return -1;
+  numa_set_localalloc();
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+/* Node whose memory holds address, -1 when unknown or placement is off */
+int nodes_of_memory(const void *address) {
+#ifdef CACHR_HAVE_NUMA
+  void *page = (void *) ((uintptr_t) address & ~((uintptr_t) numa_pagesize() - 1));
+  int status = -1;
+
+  if (count == 0 || address == NULL) return -1;
+  if (numa_move_pages(0, 1, &page, NULL, &status, 0) != 0 || status < 0) return -1;
+  return status;
+#else
+  return -1;
+#endif
+}
+
+static int current_node() {
+#ifdef CACHR_HAVE_NUMA
+  int cpu = sched_getcpu();
+
+  return cpu < 0 ? -1 : numa_node_of_cpu(cpu);
+#else
+  return -1;
+#endif
+}
+
+/* Page-granular allocation on node, fine for the few hot entries that get copied */
+static void *replica_alloc(int node, size_t size) {
+  size_t used = __atomic_load_n(&replica_bytes[node], __ATOMIC_RELAXED);
+  void *allocated = NULL;
+
+  do {
+    if (used + size > replica_memory) return NULL;
+  } while (!__atomic_compare_exchange_n(&replica_bytes[node], &used, used + size, 1, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED));
+
+#ifdef CACHR_HAVE_NUMA
+  allocated = numa_alloc_onnode(size, node);
+#endif
+  if (allocated == NULL) __atomic_sub_fetch(&replica_bytes[node], size, __ATOMIC_RELAXED);
+  return allocated;
+}
+
+static void replica_free(int node, struct cache_replica *replica) {
+  size_t size = replica->size;
+
+#ifdef CACHR_HAVE_NUMA
+  numa_free(replica, size);
+#endif
+  __atomic_sub_fetch(&replica_bytes[node], size, __ATOMIC_RELAXED);
+}
+
+/* Copies entry's identity response to node, bodies up to one slice only */
+static void replicate(struct cache_entry *entry, int node) {
+  struct cache_replica **replicas = __atomic_load_n(&entry->replicas, __ATOMIC_ACQUIRE), *replica, *expected = NULL;
+  uint64_t bytes = entry->body.bytes;
+  size_t size = sizeof(struct cache_replica) + sizeof(char *) + entry->headers_size + bytes;
+  char *copy;
+
+  if (bytes > SLICE_SIZE) return;
+
+  if (replicas == NULL) {
+    struct cache_replica **created = calloc((size_t) count, sizeof(struct cache_replica *));
+
+    if (__atomic_compare_exchange_n(&entry->replicas, &replicas, created, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      replicas = created;
+    } else {
+      free(created);
+    }
+  }
+
+  if (!__atomic_compare_exchange_n(&replicas[node], &expected, REPLICA_NONE, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+    return;
+  }
+
+  copy = replica_alloc(node, size);
+  if (copy == NULL) {
+    log_debug("[numa] No replica memory left on node %d\n", node);
+    return;
+  }
+
+  replica = (struct cache_replica *) copy;
+  memset(replica, 0, sizeof(struct cache_replica));
+  replica->size = size;
+  replica->body.slices = (char **) (copy + sizeof(struct cache_replica));
+  replica->head = copy + sizeof(struct cache_replica) + sizeof(char *);
+  memcpy(replica->head, entry->head, entry->headers_size);
+
+  if (bytes > 0) {
+    replica->body.slices[0] = replica->head + entry->headers_size;
+    memcpy(replica->body.slices[0], entry->body.slices[0], (size_t) bytes);
+    replica->body.count = replica->body.capacity = 1;
+    replica->body.tail_capacity = (size_t) bytes;
+    replica->body.bytes = bytes;
+  }
+
+  __atomic_store_n(&replicas[node], replica, __ATOMIC_RELEASE);
+  metrics_add(METRIC_NUMA_REPLICAS, 1);
+}
+
+/* Counts a hit as local or remote, returns copy on this thread's node to serve instead of entry or NULL */
+struct cache_replica *nodes_hit(struct cache_entry *entry) {
+  struct cache_replica **replicas, *replica;
+  int node;
+
+  if (count == 0 || entry->node < 0 || (node = current_node()) < 0) return NULL;
+
+  if (entry->node == node) {
+    metrics_add(METRIC_NUMA_LOCAL_HITS, 1);
+    return NULL;
+  }
+
+  replicas = __atomic_load_n(&entry->replicas, __ATOMIC_ACQUIRE);
+  if (replicas != NULL && (replica = __atomic_load_n(&replicas[node], __ATOMIC_ACQUIRE)) != NULL &&
+      replica != REPLICA_NONE) {
+    metrics_add(METRIC_NUMA_LOCAL_HITS, 1);
+    return replica;
+  }
+
+  metrics_add(METRIC_NUMA_REMOTE_HITS, 1);
+  if (replicate_hits > 0 && __atomic_add_fetch(&entry->remote_hits, 1, __ATOMIC_RELAXED) >= replicate_hits) {
+    replicate(entry, node);
+  }
+  return NULL;
+}
+
+/* Frees entry's copies, called when the entry itself is freed */
+void nodes_release(struct cache_entry *entry) {
+  struct cache_replica **replicas = entry->replicas;
+
+  if (replicas == NULL) return;
+
+  for (int node = 0; node < count; node++) {
+    if (replicas[node] != NULL && replicas[node] != REPLICA_NONE) replica_free(node, replicas[node]);
+  }
+  free(replicas);
+}
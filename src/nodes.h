@@ -0,0 +1,23 @@
+#ifndef CACHR_NODES_H
+#define CACHR_NODES_H
+
+#include "cache.h"
+#include "configutils.h"
+#include "slices.h"
+
+/* Copy of an entry's identity response in one node's memory, published once and freed with its entry */
+struct cache_replica {
+  char *head;
+  struct slice_buffer body;
+  /* Whole allocation, header and copied bytes */
+  size_t size;
+};
+
+void nodes_init(configuration *cfg);
+int nodes_count();
+int nodes_bind(int node);
+int nodes_of_memory(const void *address);
+struct cache_replica *nodes_hit(struct cache_entry *entry);
+void nodes_release(struct cache_entry *entry);
+
+#endif //CACHR_NODES_H
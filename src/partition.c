@@ -0,0 +1,148 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <sys/sysinfo.h>
+
+#include "partition.h"
+#include "utils.h"
+#include "log.h"
+
+/*
+ * Experimental partitions: each owner thread, pinned to its CPU, is the only one touching its partition's state.
+ * Others hand it calls over SPSC rings and block on a semaphore until it's done, which costs more than the shared
+ * index's mutex unless owners have idle cores to spin on. Producers are connection threads, which come and go, so rings
+ * belong to per-CPU producer slots: a thread takes its CPU's slot, a spin-and-yield lock, for the push, then releases
+ * it. Another thread only finds the slot taken when it preempted or migrated next to the holder.
+ */
+
+struct producer_slot {
+  int busy;
+} __attribute__((aligned(64)));
+
+int partitions_count = 0;
+
+static struct partition *partitions = NULL;
+static struct producer_slot *slots = NULL;
+static int slots_count = 0;
+/* Spinning only helps when the other side runs on another CPU at the same time */
+static int spin = PARTITION_SPIN;
+
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+/* Polls sem for a while before sleeping on it, posts come within microseconds under load */
+static void spin_wait(sem_t *sem) {
+  for (int i = 0; i < spin; i++) {
+    if (sem_trywait(sem) == 0) return;
+    cpu_relax();
+  }
+  while (sem_wait(sem) != 0);
+}
+
+static void *partition_thread(void *ctx) {
+  struct partition *partition = ctx;
+  cpu_set_t set;
+  int next = 0;
+
+  CPU_ZERO(&set);
+  CPU_SET(partition->cpu, &set);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+    log_warn("[partition] Failed to pin owner thread to CPU %d\n", partition->cpu);
+  }
+
+  while (1) {
+    struct partition_call *call = NULL;
+
+    spin_wait(&partition->pending);
+
+    /*
+     * A call can be taken before its post arrives, then a full pass finds nothing and that post is simply consumed.
+     * Rings are scanned from where last call was found, so no slot starves.
+     */
+    for (int i = 0; i < slots_count && call == NULL; i++, next = (next + 1) % slots_count) {
+      struct partition_ring *ring = &partition->rings[next];
+      uint32_t tail = ring->tail;
+
+      if (tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) continue;
+
+      call = ring->calls[tail & (PARTITION_RING_SIZE - 1)];
+      __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    }
+    if (call == NULL) continue;
+
+    call->fn(&partition->state, call->arg);
+    sem_post(&call->done);
+  }
+
+  return NULL;
+}
+
+/* Starts count owner threads, partition i on CPU i modulo CPUs */
+int partition_start(int count) {
+  int cpus = get_nprocs_conf();
+
+  slots_count = cpus;
+  if (get_nprocs() < 2) spin = 0;
+  slots = aligned_alloc(64, sizeof(struct producer_slot) * slots_count);
+  memset(slots, 0, sizeof(struct producer_slot) * slots_count);
+
+  partitions = aligned_alloc(64, sizeof(struct partition) * count);
+  memset(partitions, 0, sizeof(struct partition) * count);
+
+  for (int i = 0; i < count; i++) {
+    struct partition *partition = &partitions[i];
+
+    partition->cpu = i % cpus;
+    partition->rings = aligned_alloc(64, sizeof(struct partition_ring) * slots_count);
+    memset(partition->rings, 0, sizeof(struct partition_ring) * slots_count);
+    sem_init(&partition->pending, 0, 0);
+
+    if (pthread_create(&partition->thread, NULL, partition_thread, partition) != 0) {
+      log_error("[partition] Failed to create owner thread.\n");
+      return -1;
+    }
+    pthread_detach(partition->thread);
+  }
+
+  partitions_count = count;
+  log_info("[partition] %d partitions, rings from %d producer slots\n", count, slots_count);
+  return 0;
+}
+
+/* Bits above the ones picking front cache sets, so keys of one partition still spread over them */
+int partition_of(uint64_t key) {
+  return (int) ((mix64(key) >> 32) % (uint64_t) partitions_count);
+}
+
+/* Runs fn(state, arg) on owner thread of partition index and returns once it's done */
+void partition_call(int index, partition_fn fn, void *arg) {
+  struct partition *partition = &partitions[index];
+  struct partition_call call = {.fn = fn, .arg = arg};
+  struct partition_ring *ring;
+  struct producer_slot *slot;
+  int cpu = sched_getcpu();
+  uint32_t head;
+
+  sem_init(&call.done, 0, 0);
+
+  slot = &slots[(cpu < 0 ? 0 : cpu) % slots_count];
+  while (__atomic_exchange_n(&slot->busy, 1, __ATOMIC_ACQUIRE)) sched_yield();
+
+  ring = &partition->rings[slot - slots];
+  head = ring->head;
+  while (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == PARTITION_RING_SIZE) sched_yield();
+
+  ring->calls[head & (PARTITION_RING_SIZE - 1)] = &call;
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&slot->busy, 0, __ATOMIC_RELEASE);
+
+  sem_post(&partition->pending);
+  spin_wait(&call.done);
+  sem_destroy(&call.done);
+}
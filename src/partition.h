@@ -0,0 +1,46 @@
+#ifndef CACHR_PARTITION_H
+#define CACHR_PARTITION_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+/* Calls in flight from one producer slot to one partition, power of two */
+#define PARTITION_RING_SIZE 64
+
+/* Polls before owner or caller falls asleep on its semaphore */
+#define PARTITION_SPIN 2000
+
+/* Runs on owner thread with the partition's private state, nothing else ever touches state */
+typedef void (*partition_fn)(void **state, void *arg);
+
+struct partition_call {
+  partition_fn fn;
+  void *arg;
+  sem_t done;
+};
+
+/* Lock-free single producer, single consumer ring, head and tail on their own cache lines */
+struct partition_ring {
+  uint32_t head __attribute__((aligned(64)));
+  uint32_t tail __attribute__((aligned(64)));
+  struct partition_call *calls[PARTITION_RING_SIZE] __attribute__((aligned(64)));
+};
+
+struct partition {
+  void *state;
+  int cpu;
+  /* Posted once per queued call */
+  sem_t pending;
+  /* One ring per producer slot */
+  struct partition_ring *rings;
+  pthread_t thread;
+} __attribute__((aligned(64)));
+
+extern int partitions_count;
+
+int partition_start(int count);
+int partition_of(uint64_t key);
+void partition_call(int index, partition_fn fn, void *arg);
+
+#endif //CACHR_PARTITION_H
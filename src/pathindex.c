@@ -0,0 +1,287 @@
+#include <stdlib.h>
+#include <string.h>
+#include <fnmatch.h>
+#include <pthread.h>
+
+#include "pathindex.h"
+#include "cache.h"
+#include "utils.h"
+
+/*
+ * Radix tree over normalized request paths, each node holds entries whose path ends there. Every entry keeps its
+ * node and slot so removal is a swap with the node's last entry. Emptied leaves are pruned, inner nodes are not
+ * merged back.
+ */
+struct path_node {
+  char *label;
+  uint32_t label_len;
+  struct path_node *parent;
+  struct path_node **children;
+  uint32_t children_count;
+  struct cache_entry **entries;
+  uint32_t count;
+  uint32_t capacity;
+};
+
+static struct path_node root = {0};
+
+/* Same nesting as tags: inside cache_mutex or a partition owner on insert, alone on purge. Shared by all partitions */
+static pthread_mutex_t path_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Path part of request target: without scheme/authority and fragment, repeated slashes collapsed */
+char *path_index_key(const char *path, size_t path_len) {
+  char *key = malloc(path_len + 2);
+  size_t i = 0, len = 0;
+
+  if (path_len > 7 && strncmp(path, "http://", 7) == 0) i = 7;
+  else if (path_len > 8 && strncmp(path, "https://", 8) == 0) i = 8;
+  if (i > 0) {
+    while (i < path_len && path[i] != '/') i++;
+  }
+
+  for (; i < path_len && path[i] != '#'; i++) {
+    if (path[i] == '/' && len > 0 && key[len - 1] == '/') continue;
+    key[len++] = path[i];
+  }
+  if (len == 0) key[len++] = '/';
+  key[len] = '\0';
+
+  return key;
+}
+
+static struct path_node *find_child(struct path_node *node, char first) {
+  for (uint32_t i = 0; i < node->children_count; i++) {
+    if (node->children[i]->label[0] == first) return node->children[i];
+  }
+  return NULL;
+}
+
+static void add_child(struct path_node *node, struct path_node *child) {
+  node->children = realloc(node->children, sizeof(struct path_node *) * (node->children_count + 1));
+  node->children[node->children_count++] = child;
+  child->parent = node;
+}
+
+static void remove_child(struct path_node *node, struct path_node *child) {
+  for (uint32_t i = 0; i < node->children_count; i++) {
+    if (node->children[i] == child) {
+      node->children[i] = node->children[--node->children_count];
+      return;
+    }
+  }
+}
+
+static struct path_node *new_node(const char *label, size_t label_len) {
+  struct path_node *node = calloc(1, sizeof(struct path_node));
+
+  node->label = strndup(label, label_len);
+  node->label_len = (uint32_t) label_len;
+  return node;
+}
+
+static size_t common_prefix(const char *a, size_t a_len, const char *b, size_t b_len) {
+  size_t i = 0;
+
+  while (i < a_len && i < b_len && a[i] == b[i]) i++;
+  return i;
+}
+
+/* Node for path, created (splitting an edge if needed) in one pass over the path */
+static struct path_node *insert_node(const char *path, size_t path_len) {
+  struct path_node *node = &root;
+  size_t i = 0;
+
+  while (i < path_len) {
+    struct path_node *child = find_child(node, path[i]), *middle;
+    size_t common;
+
+    if (child == NULL) {
+      child = new_node(path + i, path_len - i);
+      add_child(node, child);
+      return child;
+    }
+
+    common = common_prefix(child->label, child->label_len, path + i, path_len - i);
+    if (common < child->label_len) {
+      char *rest = strndup(child->label + common, child->label_len - common);
+
+      middle = new_node(child->label, common);
+      remove_child(node, child);
+      add_child(node, middle);
+
+      free(child->label);
+      child->label = rest;
+      child->label_len -= (uint32_t) common;
+      add_child(middle, child);
+      child = middle;
+    }
+
+    node = child;
+    i += common;
+  }
+
+  return node;
+}
+
+static void free_node(struct path_node *node) {
+  remove_child(node->parent, node);
+  free(node->children);
+  free(node->entries);
+  free(node->label);
+  free(node);
+}
+
+/* Frees node and then its ancestors for as long as they are left empty */
+static void prune(struct path_node *node) {
+  while (node != &root && node->count == 0 && node->children_count == 0) {
+    struct path_node *parent = node->parent;
+
+    free_node(node);
+    node = parent;
+  }
+}
+
+static void remove_entry(struct path_node *node, uint32_t slot) {
+  struct cache_entry *last = node->entries[--node->count];
+
+  node->entries[slot]->path_node = NULL;
+  if (slot != node->count) {
+    node->entries[slot] = last;
+    last->path_slot = slot;
+  }
+}
+
+void path_index_attach(struct cache_entry *entry, const char *path) {
+  struct path_node *node;
+
+  pthread_mutex_lock(&path_mutex);
+  node = insert_node(path, strlen(path));
+
+  if (node->count == node->capacity) {
+    node->capacity = node->capacity > 0 ? node->capacity * 2 : 2;
+    node->entries = realloc(node->entries, sizeof(struct cache_entry *) * node->capacity);
+  }
+  entry->path_node = node;
+  entry->path_slot = node->count;
+  node->entries[node->count++] = entry;
+  pthread_mutex_unlock(&path_mutex);
+}
+
+void path_index_detach(struct cache_entry *entry) {
+  struct path_node *node;
+
+  pthread_mutex_lock(&path_mutex);
+  node = entry->path_node;
+  if (node != NULL) {
+    remove_entry(node, entry->path_slot);
+    prune(node);
+  }
+  pthread_mutex_unlock(&path_mutex);
+}
+
+struct purge {
+  const char *pattern;
+  /* Pattern is a literal prefix followed by a single trailing '*', everything below start matches */
+  int prefix_only;
+  int soft;
+  long now;
+  char *path;
+  size_t path_len;
+  size_t path_capacity;
+  size_t purged;
+  /* Hard purged entries, retained until they are taken out of cache index */
+  struct cache_entry **removed;
+  size_t removed_count;
+};
+
+static void purge_node(struct purge *purge, struct path_node *node) {
+  size_t path_len = purge->path_len;
+
+  if (path_len + node->label_len + 1 > purge->path_capacity) {
+    purge->path_capacity = (path_len + node->label_len + 1) * 2;
+    purge->path = realloc(purge->path, purge->path_capacity);
+  }
+  memcpy(purge->path + path_len, node->label, node->label_len);
+  purge->path_len += node->label_len;
+  purge->path[purge->path_len] = '\0';
+
+  if (node->count > 0 && (purge->prefix_only || fnmatch(purge->pattern, purge->path, 0) == 0)) {
+    purge->purged += node->count;
+    if (!purge->soft) {
+      purge->removed = realloc(purge->removed, sizeof(struct cache_entry *) * (purge->removed_count + node->count));
+    }
+
+    /* Soft purge leaves entries servable as stale and indexed, hard purge expires and unindexes them */
+    for (uint32_t i = node->count; i > 0; i--) {
+      struct cache_entry *entry = node->entries[i - 1];
+
+      if (purge->soft) {
+        if (entry->timestamp > purge->now) __atomic_store_n(&entry->timestamp, purge->now, __ATOMIC_RELAXED);
+      } else {
+        __atomic_store_n(&entry->timestamp, 0, __ATOMIC_RELAXED);
+        cache_retain(entry);
+        purge->removed[purge->removed_count++] = entry;
+        remove_entry(node, i - 1);
+      }
+    }
+  }
+
+  for (uint32_t i = node->children_count; i > 0; i--) {
+    struct path_node *child = node->children[i - 1];
+
+    purge_node(purge, child);
+    if (child->count == 0 && child->children_count == 0) free_node(child);
+  }
+
+  purge->path_len = path_len;
+}
+
+/*
+ * Purges entries whose path matches glob pattern, a literal prefix followed by "*" being the common case. Returns
+ * number of entries. Only the subtree under the pattern's literal prefix is walked. Hard purged entries are taken out
+ * of cache index too, after path_mutex is released since cache_mutex nests outside it.
+ */
+size_t path_index_purge(const char *pattern, int soft) {
+  size_t literal = strcspn(pattern, "*?[\\"), pattern_len = strlen(pattern), i = 0, edge_start = 0;
+  struct purge purge = {pattern, pattern_len > 0 && literal == pattern_len - 1 && pattern[literal] == '*', soft,
+                       get_timestamp()};
+  struct path_node *node = &root;
+
+  pthread_mutex_lock(&path_mutex);
+
+  /* Descend to the node whose edge covers the literal prefix, it may end in the middle of that edge */
+  while (i < literal && node != NULL) {
+    struct path_node *child = find_child(node, pattern[i]);
+    size_t common = child != NULL ? common_prefix(child->label, child->label_len, pattern + i, literal - i) : 0;
+
+    if (child == NULL || (i + common < literal && common < child->label_len)) {
+      node = NULL;
+      break;
+    }
+
+    edge_start = i;
+    node = child;
+    i += common;
+  }
+
+  if (node != NULL) {
+    /* purge_node appends node's own label to path before it */
+    purge.path_capacity = edge_start + 64;
+    purge.path = malloc(purge.path_capacity);
+    purge.path_len = edge_start;
+    memcpy(purge.path, pattern, edge_start);
+
+    purge_node(&purge, node);
+    prune(node);
+  }
+
+  pthread_mutex_unlock(&path_mutex);
+
+  for (size_t j = 0; j < purge.removed_count; j++) {
+    cache_remove(purge.removed[j]);
+    cache_release(purge.removed[j]);
+  }
+  free(purge.removed);
+  free(purge.path);
+  return purge.purged;
+}
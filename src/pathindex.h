@@ -0,0 +1,15 @@
+#ifndef CACHR_PATHINDEX_H
+#define CACHR_PATHINDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct cache_entry;
+struct path_node;
+
+char *path_index_key(const char *path, size_t path_len);
+void path_index_attach(struct cache_entry *entry, const char *path);
+void path_index_detach(struct cache_entry *entry);
+size_t path_index_purge(const char *pattern, int soft);
+
+#endif //CACHR_PATHINDEX_H
@@ -0,0 +1,266 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "prefetch.h"
+#include "cache.h"
+#include "fetch.h"
+#include "metrics.h"
+#include "log.h"
+#include "utils.h"
+
+/*
+ * Warms cache from a list of URLs without client sockets. Requests are built as a client would send them (so they get
+ * the same cache key) and fetched by fetch_origin(). Every worker keeps one keep-alive connection per backend, so
+ * [prefetch] concurrency also bounds upstream connections.
+ */
+
+static configuration *prefetch_cfg;
+static char **urls;
+static size_t urls_count;
+/* Header lines added to every request, "\r\n"-terminated */
+static char *extra_headers = "";
+static char *default_host;
+static long interval_us;
+
+/* Shared by workers, updated atomically */
+static size_t next_url;
+static long next_slot;
+static uint64_t fetched, stored, skipped, failed, bytes_in;
+
+static char *trim(char *line) {
+  char *end = line + strlen(line);
+
+  while (isspace((unsigned char) *line)) line++;
+  while (end > line && isspace((unsigned char) end[-1])) end--;
+  *end = '\0';
+  return line;
+}
+
+/* Non-empty lines not starting with '#', NULL when file can't be read */
+static char **read_lines(const char *file, size_t *count) {
+  FILE *in = fopen(file, "r");
+  char *line = NULL, **lines = NULL;
+  size_t line_size = 0, capacity = 0;
+
+  *count = 0;
+  if (in == NULL) return NULL;
+
+  while (getline(&line, &line_size, in) != -1) {
+    char *trimmed = trim(line);
+
+    if (*trimmed == '\0' || *trimmed == '#') continue;
+    if (*count == capacity) {
+      capacity = capacity == 0 ? 64 : capacity * 2;
+      lines = realloc(lines, sizeof(char *) * capacity);
+    }
+    lines[(*count)++] = strdup(trimmed);
+  }
+
+  free(line);
+  fclose(in);
+  return lines != NULL ? lines : calloc(1, sizeof(char *));
+}
+
+/* Spaces requests rate_limit apart, slots missed while falling behind are not made up in a burst */
+static void wait_for_slot() {
+  long now, slot, next;
+
+  if (interval_us == 0) return;
+
+  now = get_time_us();
+  slot = __atomic_load_n(&next_slot, __ATOMIC_RELAXED);
+  do {
+    next = (slot > now ? slot : now) + interval_us;
+  } while (!__atomic_compare_exchange_n(&next_slot, &slot, next, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+  slot = next - interval_us;
+  if (slot > now) usleep((useconds_t) (slot - now));
+}
+
+/* "/path", "host/path" or "http://host/path" to request as a client would send it */
+static char *build_request(const char *url, size_t *len) {
+  const char *host = default_host, *path = url, *slash;
+  char *request;
+  int host_len = (int) strlen(default_host);
+
+  if (strncmp(url, "http://", 7) == 0) url += 7;
+  else if (strncmp(url, "https://", 8) == 0) url += 8;
+
+  if (*url != '/') {
+    slash = strchr(url, '/');
+    host = url;
+    host_len = slash != NULL ? (int) (slash - url) : (int) strlen(url);
+    path = slash != NULL ? slash : "/";
+  }
+
+  request = malloc(strlen(path) + host_len + strlen(extra_headers) + 32);
+  *len = (size_t) sprintf(request, "GET %s HTTP/1.1\r\nHost: %.*s\r\n%s\r\n", path, host_len, host, extra_headers);
+  return request;
+}
+
+/* Returns 1 when response was stored, 0 when it was fetched but isn't cacheable or already cached, -1 on failure */
+static int prefetch_url(struct fetch_pool *pool, const char *url) {
+  struct fetch_request request;
+  struct fetch_response response;
+  struct cache_entry *found;
+  int result;
+
+  request.buffer = build_request(url, &request.size);
+  if (fetch_parse_request(&request) != 0) {
+    log_warn("[prefetch] Can't build request for '%s'\n", url);
+    free(request.buffer);
+    return -1;
+  }
+
+  found = cache_find(request.key);
+  if (found != NULL && found->timestamp > get_timestamp()) {
+    cache_release(found);
+    __atomic_fetch_add(&skipped, 1, __ATOMIC_RELAXED);
+    free(request.buffer);
+    return 0;
+  }
+  cache_release(found);
+
+  if (fetch_origin(pool, &request, &response) != 0) {
+    log_warn("[prefetch] Fetching '%s' failed\n", url);
+    free(request.buffer);
+    return -1;
+  }
+
+  __atomic_fetch_add(&bytes_in, response.received, __ATOMIC_RELAXED);
+  if (response.entry == NULL) log_debug("[prefetch] '%s' answered %d, not cached\n", url, response.status);
+
+  result = response.entry != NULL;
+  fetch_response_free(&response);
+  free(request.buffer);
+  return result;
+}
+
+static void *prefetch_worker(void *ctx) {
+  struct fetch_pool pool;
+  size_t i;
+  int result;
+
+  fetch_pool_init(&pool, prefetch_cfg);
+
+  while ((i = __atomic_fetch_add(&next_url, 1, __ATOMIC_RELAXED)) < urls_count) {
+    wait_for_slot();
+    result = prefetch_url(&pool, urls[i]);
+
+    if (result < 0) {
+      __atomic_fetch_add(&failed, 1, __ATOMIC_RELAXED);
+      metrics_add(METRIC_PREFETCH_ERRORS, 1);
+    } else {
+      __atomic_fetch_add(&fetched, 1, __ATOMIC_RELAXED);
+      metrics_add(METRIC_PREFETCH_REQUESTS, 1);
+      if (result > 0) __atomic_fetch_add(&stored, 1, __ATOMIC_RELAXED);
+    }
+  }
+
+  fetch_pool_close(&pool);
+  return NULL;
+}
+
+static void log_progress(const char *what, long started, uint64_t last_done, long last_time) {
+  uint64_t done = __atomic_load_n(&fetched, __ATOMIC_RELAXED) + __atomic_load_n(&failed, __ATOMIC_RELAXED);
+  long now = get_time_us();
+  double elapsed = (double) (now - started) / 1e6, window = (double) (now - last_time) / 1e6;
+
+  log_info("[prefetch] %s %llu/%zu urls in %.1fs: %llu stored, %llu already cached, %llu failed, %.0f req/s, "
+           "%.2f MiB/s\n", what, (unsigned long long) done, urls_count, elapsed,
+           (unsigned long long) __atomic_load_n(&stored, __ATOMIC_RELAXED),
+           (unsigned long long) __atomic_load_n(&skipped, __ATOMIC_RELAXED),
+           (unsigned long long) __atomic_load_n(&failed, __ATOMIC_RELAXED),
+           window > 0 ? (double) (done - last_done) / window : 0,
+           elapsed > 0 ? (double) __atomic_load_n(&bytes_in, __ATOMIC_RELAXED) / elapsed / (1024 * 1024) : 0);
+}
+
+static void *prefetch_thread(void *ctx) {
+  unsigned int concurrency = prefetch_cfg->prefetch_concurrency > 0 ? prefetch_cfg->prefetch_concurrency : 1;
+  pthread_t *workers = calloc(concurrency, sizeof(pthread_t));
+  long started = get_time_us(), last_time = started;
+  uint64_t last_done = 0;
+  unsigned int running = 0;
+
+  for (unsigned int i = 0; i < concurrency && i < urls_count; i++) {
+    if (pthread_create(&workers[running], NULL, prefetch_worker, NULL) == 0) running++;
+  }
+
+  if (running == 0 && urls_count > 0) {
+    log_error("[prefetch] Failed to create worker threads.\n");
+    free(workers);
+    return NULL;
+  }
+
+  /* Progress once a second, throughput over the last second and average bandwidth since start */
+  while (__atomic_load_n(&fetched, __ATOMIC_RELAXED) + __atomic_load_n(&failed, __ATOMIC_RELAXED) < urls_count) {
+    sleep(1);
+    log_progress("Fetched", started, last_done, last_time);
+    last_done = __atomic_load_n(&fetched, __ATOMIC_RELAXED) + __atomic_load_n(&failed, __ATOMIC_RELAXED);
+    last_time = get_time_us();
+  }
+
+  for (unsigned int i = 0; i < running; i++) pthread_join(workers[i], NULL);
+  free(workers);
+
+  /* Whole run as the last line, rate is an average here */
+  log_progress("Finished", started, 0, started);
+  return NULL;
+}
+
+/* Reads [prefetch] file and starts fetching in background, proxy serves requests meanwhile */
+int prefetch_start(configuration *cfg) {
+  pthread_t thid;
+
+  if (cfg->prefetch_file == NULL) return 0;
+
+  prefetch_cfg = cfg;
+  urls = read_lines(cfg->prefetch_file, &urls_count);
+  if (urls == NULL) {
+    log_error("[prefetch] Can't read url list '%s'\n", cfg->prefetch_file);
+    return -1;
+  }
+
+  if (cfg->prefetch_headers != NULL) {
+    size_t count, size = 1, offset = 0;
+    char **lines = read_lines(cfg->prefetch_headers, &count);
+
+    if (lines == NULL) {
+      log_error("[prefetch] Can't read request headers '%s'\n", cfg->prefetch_headers);
+      return -1;
+    }
+
+    for (size_t i = 0; i < count; i++) size += strlen(lines[i]) + 2;
+    extra_headers = malloc(size);
+    for (size_t i = 0; i < count; i++) {
+      offset += (size_t) sprintf(extra_headers + offset, "%s\r\n", lines[i]);
+      free(lines[i]);
+    }
+    extra_headers[offset] = '\0';
+    free(lines);
+  }
+
+  if (cfg->prefetch_host != NULL) {
+    default_host = strdup(cfg->prefetch_host);
+  } else {
+    default_host = malloc(strlen(cfg->listen_host) + strlen(cfg->listen_port) + 2);
+    sprintf(default_host, "%s:%s", cfg->listen_host, cfg->listen_port);
+  }
+
+  interval_us = cfg->prefetch_rate > 0 ? 1000000L / cfg->prefetch_rate : 0;
+  next_slot = get_time_us();
+
+  if (pthread_create(&thid, NULL, prefetch_thread, NULL) != 0) {
+    log_error("[prefetch] Failed to create prefetch thread.\n");
+    return -1;
+  }
+
+  pthread_detach(thid);
+  log_info("[prefetch] Warming cache with %zu urls from '%s', concurrency=%u rate=%u/s\n", urls_count,
+           cfg->prefetch_file, cfg->prefetch_concurrency, cfg->prefetch_rate);
+  return 0;
+}
@@ -0,0 +1,8 @@
+#ifndef CACHR_PREFETCH_H
+#define CACHR_PREFETCH_H
+
+#include "configutils.h"
+
+int prefetch_start(configuration *cfg);
+
+#endif //CACHR_PREFETCH_H
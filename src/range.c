@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <sys/uio.h>
+
+#include "range.h"
+#include "netutils.h"
+#include "request.h"
+#include "libs/picohttpparser.h"
+
+#define RANGE_BOUNDARY "cachr0b1f3e9a7c5d"
+
+/* Status line, Content-Range and Content-Length (or multipart Content-Type) with 20 digit numbers, empty line */
+#define RANGE_HEAD_FIXED 256
+
+/*
+ * Parses "bytes=a-b, c-, -n" into absolute ranges clipped to total.
+ * Returns number of satisfiable ranges, 0 if none is satisfiable, -1 if header should be ignored.
+ */
+int parse_range(const char *value, uint64_t total, struct byte_range *ranges, int max_ranges) {
+  int count = 0;
+  const char *p;
+  char *end;
+
+  if (strncmp(value, "bytes=", 6) != 0) return -1;
+  p = value + 6;
+
+  while (*p != '\0') {
+    unsigned long long first, last;
+
+    while (*p == ' ' || *p == ',') p++;
+    if (*p == '\0') break;
+
+    if (*p == '-') {
+      /* Suffix range: last N bytes */
+      if (!isdigit(p[1])) return -1;
+      last = strtoull(p + 1, &end, 10);
+
+      if (last > 0 && total > 0) {
+        if (count == max_ranges) return -1;
+        ranges[count].first = last >= total ? 0 : total - last;
+        ranges[count].last = total - 1;
+        count++;
+      }
+    } else {
+      if (!isdigit(*p)) return -1;
+      first = strtoull(p, &end, 10);
+      if (*end != '-') return -1;
+      p = end + 1;
+
+      if (isdigit(*p)) {
+        last = strtoull(p, &end, 10);
+        if (last < first) return -1;
+      } else {
+        last = total - 1;
+        end = (char *) p;
+      }
+
+      if (first < total) {
+        if (count == max_ranges) return -1;
+        ranges[count].first = first;
+        ranges[count].last = last >= total ? total - 1 : last;
+        count++;
+      }
+    }
+
+    p = end;
+    while (*p == ' ') p++;
+    if (*p != '\0' && *p != ',') return -1;
+  }
+
+  return count;
+}
+
+static int header_is(struct phr_header *header, const char *name) {
+  return header->name != NULL && header->name_len == strlen(name) && strncasecmp(header->name, name, header->name_len) == 0;
+}
+
+/*
+ * Answers a Range request from a 200 response, pointing iovecs straight into the body slices.
+ * Returns status sent (206 or 416), or -1 if Range should be ignored and the full response sent instead.
+ */
+int send_range_response(int fd, const char *response_head, size_t headers_size, struct slice_buffer *body,
+                        const char *range_value) {
+  struct byte_range ranges[RANGE_MAX];
+  struct iovec *iov;
+  struct phr_header headers[100];
+  size_t num_headers, msg_len, content_type_len = 0, offset;
+  uint64_t total = body->bytes, content_length = 0;
+  const char *msg, *content_type = "application/octet-stream";
+  char *head, *parts = NULL;
+  int minor_version, status, count, iovcnt = 2;
+
+  count = parse_range(range_value, total, ranges, RANGE_MAX);
+  if (count < 0) return -1;
+
+  for (int i = 0; i < count; i++) {
+    iovcnt += 2 + slice_buffer_span(ranges[i].first, ranges[i].last - ranges[i].first + 1);
+  }
+
+  num_headers = sizeof(headers) / sizeof(headers[0]);
+  if (phr_parse_response(response_head, headers_size, &minor_version, &status, &msg, &msg_len, headers,
+                         &num_headers, 0) != (int) headers_size) {
+    return -1;
+  }
+
+  head = malloc(headers_emit_size(headers, num_headers) + RANGE_HEAD_FIXED);
+  iov = malloc(sizeof(struct iovec) * iovcnt);
+  iovcnt = 0;
+
+  if (count == 0) {
+    offset = (size_t) sprintf(head, "HTTP/1.%d 416 Range Not Satisfiable\r\nContent-Range: bytes */%llu\r\n"
+                                    "Content-Length: 0\r\n\r\n", minor_version, (unsigned long long) total);
+    iov[0].iov_base = head;
+    iov[0].iov_len = offset;
+    write_all(fd, iov, 1);
+    free(head);
+    free(iov);
+    return 416;
+  }
+
+  offset = (size_t) sprintf(head, "HTTP/1.%d 206 Partial Content\r\n", minor_version);
+
+  for (size_t i = 0; i < num_headers; i++) {
+    if (header_is(&headers[i], "Content-Type")) {
+      content_type = headers[i].value;
+      content_type_len = headers[i].value_len;
+      if (count > 1) continue;
+    } else if (headers[i].name == NULL || header_is(&headers[i], "Content-Length") ||
+               header_is(&headers[i], "Content-Range")) {
+      continue;
+    }
+    offset += sprintf(head + offset, "%.*s: %.*s\r\n", (int) headers[i].name_len, headers[i].name,
+                      (int) headers[i].value_len, headers[i].value);
+  }
+  if (content_type_len == 0) content_type_len = strlen(content_type);
+
+  iovcnt = 1;
+
+  if (count == 1) {
+    content_length = ranges[0].last - ranges[0].first + 1;
+    offset += sprintf(head + offset, "Content-Range: bytes %llu-%llu/%llu\r\nContent-Length: %llu\r\n\r\n",
+                      (unsigned long long) ranges[0].first, (unsigned long long) ranges[0].last,
+                      (unsigned long long) total, (unsigned long long) content_length);
+
+    iovcnt += slice_buffer_iovecs(body, ranges[0].first, content_length, iov + iovcnt);
+  } else {
+    /* multipart/byteranges: every part header is written into one buffer, slices point into cached body */
+    size_t parts_offset = 0, part_size = content_type_len + 160;
+    parts = malloc(part_size * (count + 1));
+
+    for (int i = 0; i < count; i++) {
+      int len = sprintf(parts + parts_offset, "\r\n--%s\r\nContent-Type: %.*s\r\nContent-Range: bytes %llu-%llu/%llu\r\n\r\n",
+                        RANGE_BOUNDARY, (int) content_type_len, content_type, (unsigned long long) ranges[i].first,
+                        (unsigned long long) ranges[i].last, (unsigned long long) total);
+
+      iov[iovcnt].iov_base = parts + parts_offset;
+      iov[iovcnt++].iov_len = (size_t) len;
+      iovcnt += slice_buffer_iovecs(body, ranges[i].first, ranges[i].last - ranges[i].first + 1, iov + iovcnt);
+
+      content_length += len + ranges[i].last - ranges[i].first + 1;
+      parts_offset += len;
+    }
+
+    iov[iovcnt].iov_base = parts + parts_offset;
+    iov[iovcnt].iov_len = (size_t) sprintf(parts + parts_offset, "\r\n--%s--\r\n", RANGE_BOUNDARY);
+    content_length += iov[iovcnt++].iov_len;
+
+    offset += sprintf(head + offset, "Content-Type: multipart/byteranges; boundary=%s\r\nContent-Length: %llu\r\n\r\n",
+                      RANGE_BOUNDARY, (unsigned long long) content_length);
+  }
+
+  iov[0].iov_base = head;
+  iov[0].iov_len = offset;
+
+  write_all(fd, iov, iovcnt);
+
+  free(head);
+  free(parts);
+  free(iov);
+  return 206;
+}
@@ -0,0 +1,20 @@
+#ifndef CACHR_RANGE_H
+#define CACHR_RANGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "slices.h"
+
+/* More ranges than this in one request are ignored and the full response is sent */
+#define RANGE_MAX 16
+
+struct byte_range {
+  uint64_t first;
+  uint64_t last;
+};
+
+int parse_range(const char *value, uint64_t total, struct byte_range *ranges, int max_ranges);
+int send_range_response(int fd, const char *response_head, size_t headers_size, struct slice_buffer *body,
+                        const char *range_value);
+
+#endif //CACHR_RANGE_H
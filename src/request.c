@@ -0,0 +1,130 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "request.h"
+#include "utils.h"
+#include "log.h"
+
+char *rewrite_request(char *response_buffer, struct phr_header *headers, int headers_size, int headers_count,
+                      int total_size, char* method, size_t method_len, char *path, size_t path_len, int minor_version,
+                      const char *host) {
+  size_t bufsize = method_len + path_len + 12, header_size = 0;
+  char *buffer = malloc(sizeof(char) * (bufsize + 1));
+
+  log_trace("Initial buffer: \n%s\n", response_buffer);
+
+  sprintf(buffer, "%.*s %.*s HTTP/1.%d\r\n\0", (int) method_len, method, (int) path_len, path, minor_version);
+
+  /* Rewrite headers */
+  for (int i = 0; i < headers_count; i++) {
+    char *name = malloc(sizeof(char) * (headers[i].name_len + 1));
+    char *value = malloc(sizeof(char) * (headers[i].value_len + 1));
+    sprintf(name, "%.*s\0", (int) headers[i].name_len, headers[i].name);
+    sprintf(value, "%.*s\0", (int) headers[i].value_len, headers[i].value);
+
+    /* Always fetch full object, Range requests are answered from it */
+    if (strcmp("Range", name) == 0 || strcmp("If-Range", name) == 0) {
+      free(name);
+      free(value);
+      continue;
+    }
+
+    header_size = headers[i].name_len + 4;
+
+    if (strcmp("Host", name) == 0) {
+      log_trace("[%d] Writing custom host...\n", (int) gettid());
+      free(value);
+      value = malloc(sizeof(char) * (strlen(host) + 2));
+      strcpy(value, host);
+      value[strlen(value)] = '\0';
+
+      header_size += strlen(host);
+    } else {
+      header_size += (int) headers[i].value_len;
+    }
+
+    buffer = realloc(buffer, sizeof(char) * (bufsize + header_size + 1));
+    sprintf(buffer + bufsize, "%s: %s\r\n\0", name, value);
+    bufsize += header_size;
+
+    free(name);
+    free(value);
+  }
+
+  /* Terminate headers and rewrite rest of request */
+  buffer = realloc(buffer, (size_t) (bufsize + total_size - headers_size + 3));
+  memcpy(buffer + bufsize, "\r\n", 2);
+  memcpy(buffer + bufsize + 2, response_buffer + headers_size, (size_t) (total_size - headers_size));
+  buffer[bufsize + 2 + total_size - headers_size] = '\0';
+
+  return buffer;
+}
+
+/* Hashes request without Range and If-Range lines, so partial requests share the full object's entry */
+uint64_t get_cache_key(char *buffer, size_t size, struct phr_header *headers, size_t num_headers) {
+  uint64_t hash = HASH_SEED;
+  size_t offset = 0, line_start, line_end;
+
+  for (size_t i = 0; i < num_headers; i++) {
+    if (!(headers[i].name_len == 5 && strncmp(headers[i].name, "Range", 5) == 0) &&
+        !(headers[i].name_len == 8 && strncmp(headers[i].name, "If-Range", 8) == 0)) {
+      continue;
+    }
+
+    line_start = headers[i].name - buffer;
+    line_end = headers[i].value + headers[i].value_len - buffer;
+    while (line_end < size && buffer[line_end++] != '\n');
+
+    hash = hash_bytes(hash, buffer + offset, line_start - offset);
+    offset = line_end;
+  }
+
+  return hash_bytes(hash, buffer + offset, size - offset);
+}
+
+/* Builds response head with the Transfer-Encoding line (te_start..te_end) replaced by Content-Length */
+char *rewrite_chunked_head(char *response_head, size_t headers_size, size_t te_start, size_t te_end,
+                           uint64_t body_size, size_t *new_headers_size) {
+  char content_length[48];
+  int content_length_size = sprintf(content_length, "Content-Length: %llu\r\n", (unsigned long long) body_size);
+  size_t head_size = headers_size - (te_end - te_start) + content_length_size;
+  char *buffer = malloc(head_size + 1);
+
+  /* Everything but Transfer-Encoding, then Content-Length before the empty line */
+  memcpy(buffer, response_head, te_start);
+  memcpy(buffer + te_start, response_head + te_end, headers_size - te_end - 2);
+  memcpy(buffer + head_size - content_length_size - 2, content_length, (size_t) content_length_size);
+  memcpy(buffer + head_size - 2, "\r\n", 2);
+  buffer[head_size] = '\0';
+
+  *new_headers_size = head_size;
+  return buffer;
+}
+
+/*
+ * Bytes needed to re-emit parsed headers as "name: value\r\n". Origin may have left out the space or used bare LF,
+ * so this can exceed the size of the head they came from.
+ */
+size_t headers_emit_size(struct phr_header *headers, size_t num_headers) {
+  size_t size = 0;
+
+  for (size_t i = 0; i < num_headers; i++) {
+    if (headers[i].name != NULL) size += headers[i].name_len + headers[i].value_len + 4;
+  }
+  return size;
+}
+
+/* Builds response head with header line (ending with CRLF) added before the empty line */
+char *append_header(char *response_head, size_t headers_size, const char *header, size_t *new_headers_size) {
+  size_t header_size = strlen(header), head_size = headers_size + header_size;
+  char *buffer = malloc(head_size + 1);
+
+  memcpy(buffer, response_head, headers_size - 2);
+  memcpy(buffer + headers_size - 2, header, header_size);
+  memcpy(buffer + head_size - 2, "\r\n", 2);
+  buffer[head_size] = '\0';
+
+  *new_headers_size = head_size;
+  return buffer;
+}
@@ -0,0 +1,17 @@
+#ifndef CACHR_REQUEST_H
+#define CACHR_REQUEST_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "libs/picohttpparser.h"
+
+char *rewrite_request(char *response_buffer, struct phr_header *headers, int headers_size, int headers_count,
+                      int total_size, char* method, size_t method_len, char *path, size_t path_len, int minor_version,
+                      const char *host);
+uint64_t get_cache_key(char *buffer, size_t size, struct phr_header *headers, size_t num_headers);
+char *rewrite_chunked_head(char *response_head, size_t headers_size, size_t te_start, size_t te_end,
+                           uint64_t body_size, size_t *new_headers_size);
+size_t headers_emit_size(struct phr_header *headers, size_t num_headers);
+char *append_header(char *response_head, size_t headers_size, const char *header, size_t *new_headers_size);
+
+#endif //CACHR_REQUEST_H
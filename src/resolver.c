@@ -0,0 +1,265 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <netinet/in.h>
+#include <resolv.h>
+
+#include "resolver.h"
+#include "utils.h"
+#include "log.h"
+
+static struct resolved_host *hosts = NULL;
+static unsigned int refresh_interval = 30000, min_ttl = 1000;
+
+const char *format_address(const struct sockaddr_storage *addr, char *out, size_t out_len) {
+  const void *src = addr->ss_family == AF_INET6 ? (const void *) &((struct sockaddr_in6 *) addr)->sin6_addr
+                                                : (const void *) &((struct sockaddr_in *) addr)->sin_addr;
+
+  if (inet_ntop(addr->ss_family, src, out, (socklen_t) out_len) == NULL) snprintf(out, out_len, "?");
+  return out;
+}
+
+/* Lowest TTL (seconds) among answers to a query of given type, -1 when it can't be queried */
+static long query_ttl(const char *host, int type) {
+  unsigned char answer[NS_PACKETSZ * 4];
+  ns_msg msg;
+  ns_rr rr;
+  long ttl = -1;
+  int len = res_query(host, ns_c_in, type, answer, sizeof(answer));
+
+  if (len < 0 || ns_initparse(answer, len, &msg) < 0) return -1;
+
+  for (int i = 0; i < ns_msg_count(msg, ns_s_an); i++) {
+    if (ns_parserr(&msg, ns_s_an, i, &rr) < 0) break;
+    if (ttl == -1 || (long) ns_rr_ttl(rr) < ttl) ttl = (long) ns_rr_ttl(rr);
+  }
+  return ttl;
+}
+
+/* How long the answer for host may be used, in milliseconds */
+static long address_lifetime(const char *host) {
+  unsigned char literal[sizeof(struct in6_addr)];
+  long ttl_a, ttl_aaaa, ttl;
+
+  /* Literal addresses never change */
+  if (inet_pton(AF_INET, host, literal) == 1 || inet_pton(AF_INET6, host, literal) == 1) return -1;
+
+  ttl_a = query_ttl(host, ns_t_a);
+  ttl_aaaa = query_ttl(host, ns_t_aaaa);
+
+  /* Names only known to /etc/hosts or NSS have no TTL, refresh them periodically */
+  if (ttl_a == -1 && ttl_aaaa == -1) return refresh_interval;
+  ttl = ttl_a == -1 || (ttl_aaaa != -1 && ttl_aaaa < ttl_a) ? ttl_aaaa : ttl_a;
+
+  ttl *= 1000;
+  if (ttl < min_ttl) ttl = min_ttl;
+  if (ttl > refresh_interval) ttl = refresh_interval;
+  return ttl;
+}
+
+static struct address_set *lookup(const char *host, unsigned short port) {
+  struct addrinfo hints, *result, *rp;
+  struct address_set *set;
+  char port_str[8];
+  int s;
+
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  sprintf(port_str, "%d", port);
+
+  s = getaddrinfo(host, port_str, &hints, &result);
+  if (s != 0) {
+    log_warn("[resolver] Failed to resolve %s: %s\n", host, gai_strerror(s));
+    return NULL;
+  }
+
+  set = calloc(1, sizeof(struct address_set));
+  for (rp = result; rp != NULL && set->count < RESOLVER_MAX_ADDRESSES; rp = rp->ai_next) {
+    memcpy(&set->addrs[set->count], rp->ai_addr, rp->ai_addrlen);
+    set->lens[set->count++] = rp->ai_addrlen;
+  }
+
+  freeaddrinfo(result);
+  return set;
+}
+
+static int contains_address(struct address_set *set, struct sockaddr_storage *addr, socklen_t len) {
+  for (int i = 0; i < set->count; i++) {
+    if (set->lens[i] == len && memcmp(&set->addrs[i], addr, len) == 0) return 1;
+  }
+  return 0;
+}
+
+/* Compared as sets, DNS servers rotating their answers don't cause a swap */
+static int same_addresses(struct address_set *a, struct address_set *b) {
+  if (a == NULL || b == NULL || a->count != b->count) return 0;
+
+  for (int i = 0; i < a->count; i++) {
+    if (!contains_address(b, &a->addrs[i], a->lens[i]) || !contains_address(a, &b->addrs[i], b->lens[i])) return 0;
+  }
+  return 1;
+}
+
+static void refresh(struct resolved_host *resolved) {
+  long lifetime = address_lifetime(resolved->host);
+  struct address_set *set = lookup(resolved->host, resolved->port), *old;
+
+  if (set == NULL) {
+    /* Keep serving last known addresses and retry soon */
+    resolved->expires_at = get_time_ms() + min_ttl;
+    return;
+  }
+
+  resolved->expires_at = lifetime == -1 ? LONG_MAX : get_time_ms() + lifetime;
+
+  pthread_mutex_lock(&resolved->lock);
+  if (same_addresses(set, resolved->addresses)) {
+    pthread_mutex_unlock(&resolved->lock);
+    free(set);
+    return;
+  }
+  old = resolved->addresses;
+  resolved->addresses = set;
+  pthread_mutex_unlock(&resolved->lock);
+
+  /* Readers only copy the set while holding lock, nobody uses old one anymore */
+  free(old);
+
+  for (int i = 0; i < set->count; i++) {
+    char address[INET6_ADDRSTRLEN];
+    log_info("[resolver] %s -> %s\n", resolved->host, format_address(&set->addrs[i], address, sizeof(address)));
+  }
+}
+
+static void *resolver_thread(void *ctx) {
+  while (1) {
+    long now = get_time_ms(), wait = 1000;
+
+    for (struct resolved_host *resolved = hosts; resolved != NULL; resolved = resolved->next_host) {
+      if (resolved->expires_at <= now) refresh(resolved);
+      if (resolved->expires_at - now < wait) wait = resolved->expires_at - now;
+    }
+
+    usleep((useconds_t) (wait < 10 ? 10 : wait) * 1000);
+  }
+
+  return NULL;
+}
+
+/* refresh caps record TTLs and is used for names without one, min_ttl is the floor for both */
+void resolver_configure(unsigned int refresh, unsigned int min) {
+  if (refresh > 0) refresh_interval = refresh;
+  min_ttl = min > 0 ? min : 1;
+  if (min_ttl > refresh_interval) min_ttl = refresh_interval;
+}
+
+/* Registers host for background refresh, first lookup happens synchronously at startup */
+struct resolved_host *resolver_add(const char *host, unsigned short port) {
+  struct resolved_host *resolved = calloc(1, sizeof(struct resolved_host));
+
+  resolved->host = strdup(host);
+  resolved->port = port;
+  pthread_mutex_init(&resolved->lock, NULL);
+  refresh(resolved);
+
+  resolved->next_host = hosts;
+  hosts = resolved;
+  return resolved;
+}
+
+int resolver_start() {
+  pthread_t thid;
+  int needed = 0;
+
+  for (struct resolved_host *resolved = hosts; resolved != NULL; resolved = resolved->next_host) {
+    if (resolved->expires_at != LONG_MAX) needed = 1;
+  }
+  if (!needed) return 0;
+
+  if (pthread_create(&thid, NULL, resolver_thread, NULL) != 0) {
+    log_error("[resolver] Failed to create resolver thread.\n");
+    return -1;
+  }
+
+  pthread_detach(thid);
+  return 0;
+}
+
+/*
+ * Copies host's addresses in the order to try them, never blocks. First one is picked round robin, then families
+ * alternate (in the spirit of happy eyeballs), so an unreachable family costs one failed attempt at a time.
+ * Returns -1 if host is unresolved.
+ */
+int resolver_addresses(struct resolved_host *resolved, struct address_set *out) {
+  int primary[RESOLVER_MAX_ADDRESSES], other[RESOLVER_MAX_ADDRESSES], primary_count = 0, other_count = 0, start;
+  struct address_set *set;
+
+  pthread_mutex_lock(&resolved->lock);
+  set = resolved->addresses;
+  if (set == NULL || set->count == 0) {
+    pthread_mutex_unlock(&resolved->lock);
+    return -1;
+  }
+
+  start = (int) (resolved->next++ % (unsigned int) set->count);
+  for (int i = 0; i < set->count; i++) {
+    int j = (start + i) % set->count;
+
+    if (set->addrs[j].ss_family == set->addrs[start].ss_family) primary[primary_count++] = j;
+    else other[other_count++] = j;
+  }
+
+  out->count = 0;
+  for (int i = 0; out->count < set->count; i++) {
+    if (i < primary_count) {
+      out->addrs[out->count] = set->addrs[primary[i]];
+      out->lens[out->count++] = set->lens[primary[i]];
+    }
+    if (i < other_count) {
+      out->addrs[out->count] = set->addrs[other[i]];
+      out->lens[out->count++] = set->lens[other[i]];
+    }
+  }
+  pthread_mutex_unlock(&resolved->lock);
+  return 0;
+}
+
+/*
+ * Connects to the first of host's addresses that answers within timeout (ms). Each attempt gets an equal share of
+ * the time left, so one unreachable address can't use it all. Returns a non-blocking socket, -1 on failure.
+ */
+int resolver_connect(struct resolved_host *resolved, unsigned int timeout) {
+  struct address_set addresses;
+  long deadline = get_time_ms() + timeout;
+
+  if (resolver_addresses(resolved, &addresses) != 0) return -1;
+
+  for (int i = 0; i < addresses.count; i++) {
+    socklen_t so_error_len = sizeof(int);
+    struct pollfd pfd;
+    int fd, so_error = 0;
+
+    if ((fd = socket(addresses.addrs[i].ss_family, SOCK_STREAM, 0)) < 0) continue;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    if ((connect(fd, (struct sockaddr *) &addresses.addrs[i], addresses.lens[i]) == 0 || errno == EINPROGRESS) &&
+        poll(&pfd, 1, (int) (time_left_ms(deadline) / (addresses.count - i))) == 1 &&
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &so_error, &so_error_len) == 0 && so_error == 0) {
+      return fd;
+    }
+    close(fd);
+  }
+  return -1;
+}
@@ -0,0 +1,35 @@
+#ifndef CACHR_RESOLVER_H
+#define CACHR_RESOLVER_H
+
+#include <pthread.h>
+#include <sys/socket.h>
+
+/* Maximum number of A/AAAA records kept per host */
+#define RESOLVER_MAX_ADDRESSES 16
+
+struct address_set {
+  int count;
+  struct sockaddr_storage addrs[RESOLVER_MAX_ADDRESSES];
+  socklen_t lens[RESOLVER_MAX_ADDRESSES];
+};
+
+struct resolved_host {
+  char *host;
+  unsigned short port;
+
+  /* Replaced by resolver thread and copied out by connecting threads, both under lock */
+  pthread_mutex_t lock;
+  struct address_set *addresses;
+  unsigned int next;
+  long expires_at;
+  struct resolved_host *next_host;
+};
+
+void resolver_configure(unsigned int refresh, unsigned int min_ttl);
+struct resolved_host *resolver_add(const char *host, unsigned short port);
+int resolver_start();
+int resolver_addresses(struct resolved_host *resolved, struct address_set *out);
+int resolver_connect(struct resolved_host *resolved, unsigned int timeout);
+const char *format_address(const struct sockaddr_storage *addr, char *out, size_t out_len);
+
+#endif //CACHR_RESOLVER_H
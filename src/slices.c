@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "slices.h"
+#include "arena.h"
+#include "log.h"
+
+/* Returns write position after last stored byte, allocating or growing the last slice as needed */
+char *slice_buffer_tail(struct slice_buffer *sb, size_t *available) {
+  size_t used = (size_t) (sb->bytes - (uint64_t) (sb->count > 0 ? sb->count - 1 : 0) * SLICE_SIZE);
+
+  if (sb->count == 0 || used == SLICE_SIZE) {
+    if (sb->count == sb->capacity) {
+      sb->capacity = sb->capacity == 0 ? 4 : sb->capacity * 2;
+      sb->slices = arena_realloc(sb->slices, sizeof(char *) * sb->capacity);
+    }
+
+    /* Only the first slice grows gradually, once past it the object is large anyway */
+    sb->tail_capacity = sb->count == 0 ? SLICE_INITIAL_SIZE : SLICE_SIZE;
+    sb->slices[sb->count++] = arena_malloc(sb->tail_capacity);
+    used = 0;
+  } else if (used == sb->tail_capacity) {
+    sb->tail_capacity *= 2;
+    sb->slices[sb->count - 1] = arena_realloc(sb->slices[sb->count - 1], sb->tail_capacity);
+  }
+
+  if (sb->slices[sb->count - 1] == NULL) {
+    log_error("Failed to allocate slice!\n");
+    exit(EXIT_FAILURE);
+  }
+
+  *available = sb->tail_capacity - used;
+  return sb->slices[sb->count - 1] + used;
+}
+
+/* Marks len bytes written at slice_buffer_tail() as stored */
+void slice_buffer_commit(struct slice_buffer *sb, size_t len) {
+  sb->bytes += len;
+}
+
+void slice_buffer_append(struct slice_buffer *sb, const char *data, size_t len) {
+  size_t available, n;
+
+  while (len > 0) {
+    char *tail = slice_buffer_tail(sb, &available);
+    n = len < available ? len : available;
+
+    memcpy(tail, data, n);
+    slice_buffer_commit(sb, n);
+    data += n;
+    len -= n;
+  }
+}
+
+/* Shrinks last slice to its content once body is complete */
+void slice_buffer_trim(struct slice_buffer *sb) {
+  size_t used;
+
+  if (sb->count == 0) return;
+
+  used = (size_t) (sb->bytes - (uint64_t) (sb->count - 1) * SLICE_SIZE);
+  if (used > 0 && used < sb->tail_capacity) {
+    sb->slices[sb->count - 1] = arena_realloc(sb->slices[sb->count - 1], used);
+    sb->tail_capacity = used;
+  }
+}
+
+/* Number of slices covering [offset, offset + len) */
+int slice_buffer_span(uint64_t offset, uint64_t len) {
+  if (len == 0) return 0;
+  return (int) ((offset + len - 1) / SLICE_SIZE - offset / SLICE_SIZE + 1);
+}
+
+/* Fills iov (slice_buffer_span() entries) with pointers straight into slices, returns entries used */
+int slice_buffer_iovecs(struct slice_buffer *sb, uint64_t offset, uint64_t len, struct iovec *iov) {
+  int count = 0;
+
+  while (len > 0) {
+    uint64_t index = offset / SLICE_SIZE;
+    size_t within = (size_t) (offset % SLICE_SIZE), n = SLICE_SIZE - within;
+
+    if (n > len) n = (size_t) len;
+    iov[count].iov_base = sb->slices[index] + within;
+    iov[count++].iov_len = n;
+    offset += n;
+    len -= n;
+  }
+
+  return count;
+}
+
+void slice_buffer_free(struct slice_buffer *sb) {
+  for (u_int32_t i = 0; i < sb->count; i++) {
+    arena_free(sb->slices[i]);
+  }
+
+  arena_free(sb->slices);
+  memset(sb, 0, sizeof(struct slice_buffer));
+}
@@ -0,0 +1,31 @@
+#ifndef CACHR_SLICES_H
+#define CACHR_SLICES_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* Large bodies are kept as fixed-size slices, slice i always holds bytes [i * SLICE_SIZE, (i + 1) * SLICE_SIZE) */
+#define SLICE_SIZE (1024 * 1024)
+
+/* First slice starts this small and doubles up to SLICE_SIZE, so small bodies stay small */
+#define SLICE_INITIAL_SIZE 4096
+
+struct slice_buffer {
+  char **slices;
+  u_int32_t count;
+  u_int32_t capacity;
+  size_t tail_capacity;
+  uint64_t bytes;
+};
+
+char *slice_buffer_tail(struct slice_buffer *sb, size_t *available);
+void slice_buffer_commit(struct slice_buffer *sb, size_t len);
+void slice_buffer_append(struct slice_buffer *sb, const char *data, size_t len);
+void slice_buffer_trim(struct slice_buffer *sb);
+int slice_buffer_span(uint64_t offset, uint64_t len);
+int slice_buffer_iovecs(struct slice_buffer *sb, uint64_t offset, uint64_t len, struct iovec *iov);
+void slice_buffer_free(struct slice_buffer *sb);
+
+#endif //CACHR_SLICES_H
@@ -0,0 +1,162 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "tags.h"
+#include "cache.h"
+#include "utils.h"
+
+/* Entries carrying one tag. Index is keyed by the tag's hash, tag strings are not kept */
+struct tag_set {
+  uint64_t tag;
+  struct cache_entry **entries;
+  uint32_t count;
+  uint32_t capacity;
+  UT_hash_handle hh;
+};
+
+static struct tag_set *tag_index = NULL;
+
+/*
+ * Taken inside cache_mutex (or by a partition owner, the tag index is shared by all partitions) on inserts, alone by
+ * purges, so purging never blocks cache lookups
+ */
+static pthread_mutex_t tags_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t tag_hash(const char *tag, size_t tag_len) {
+  return hash_bytes(HASH_SEED, tag, tag_len);
+}
+
+/* Hashes tags separated by spaces (Surrogate-Key) or commas (Cache-Tag), appending after count existing ones */
+int tags_parse(const char *value, size_t value_len, uint64_t *tags, int count) {
+  size_t i = 0;
+
+  while (i < value_len && count < CACHE_TAGS_MAX) {
+    size_t start;
+
+    while (i < value_len && (value[i] == ' ' || value[i] == ',' || value[i] == '\t')) i++;
+    start = i;
+    while (i < value_len && value[i] != ' ' && value[i] != ',' && value[i] != '\t') i++;
+
+    if (i > start) tags[count++] = tag_hash(value + start, i - start);
+  }
+
+  return count;
+}
+
+/* Adds entry to every tag's set, entry must already be in cache */
+void tags_attach(struct cache_entry *entry, uint64_t *tags, int count) {
+  if (count == 0) return;
+
+  entry->tags = malloc(sizeof(struct cache_tag_ref) * count);
+  entry->tags_count = (uint16_t) count;
+
+  pthread_mutex_lock(&tags_mutex);
+  for (int i = 0; i < count; i++) {
+    struct tag_set *set;
+
+    HASH_FIND(hh, tag_index, &tags[i], sizeof(uint64_t), set);
+    if (set == NULL) {
+      set = calloc(1, sizeof(struct tag_set));
+      set->tag = tags[i];
+      HASH_ADD(hh, tag_index, tag, sizeof(uint64_t), set);
+    }
+
+    if (set->count == set->capacity) {
+      set->capacity = set->capacity > 0 ? set->capacity * 2 : 4;
+      set->entries = realloc(set->entries, sizeof(struct cache_entry *) * set->capacity);
+    }
+
+    entry->tags[i].set = set;
+    entry->tags[i].slot = set->count;
+    set->entries[set->count++] = entry;
+  }
+  pthread_mutex_unlock(&tags_mutex);
+}
+
+static void free_set(struct tag_set *set) {
+  HASH_DEL(tag_index, set);
+  free(set->entries);
+  free(set);
+}
+
+/* Removes entry leaving cache from its tag sets, last entry of a set takes its slot */
+void tags_detach(struct cache_entry *entry) {
+  if (entry->tags_count == 0) return;
+
+  pthread_mutex_lock(&tags_mutex);
+  for (int i = 0; i < entry->tags_count; i++) {
+    struct tag_set *set = entry->tags[i].set;
+    struct cache_entry *last;
+
+    /* Set was purged already */
+    if (set == NULL) continue;
+
+    last = set->entries[--set->count];
+    if (last != entry) {
+      set->entries[entry->tags[i].slot] = last;
+      for (int j = 0; j < last->tags_count; j++) {
+        if (last->tags[j].set == set) last->tags[j].slot = entry->tags[i].slot;
+      }
+    }
+
+    if (set->count == 0) free_set(set);
+  }
+  entry->tags_count = 0;
+  pthread_mutex_unlock(&tags_mutex);
+
+  free(entry->tags);
+  entry->tags = NULL;
+}
+
+/*
+ * Expires every entry tagged with tag, returns their number. Soft purge only marks them stale, they can still be
+ * served within max_stale and stay cached and tagged. Hard purge also takes them out of cache index once tags_mutex
+ * is released (cache_mutex nests outside it), so their memory is freed even if their keys are never requested again.
+ */
+size_t tags_purge(const char *tag, size_t tag_len, int soft) {
+  uint64_t hash = tag_hash(tag, tag_len);
+  struct tag_set *set;
+  struct cache_entry **removed = NULL;
+  size_t purged = 0;
+  long now = get_timestamp();
+
+  pthread_mutex_lock(&tags_mutex);
+  HASH_FIND(hh, tag_index, &hash, sizeof(uint64_t), set);
+
+  if (set != NULL && soft) {
+    for (uint32_t i = 0; i < set->count; i++) {
+      struct cache_entry *entry = set->entries[i];
+      if (entry->timestamp > now) __atomic_store_n(&entry->timestamp, now, __ATOMIC_RELAXED);
+    }
+    purged = set->count;
+  } else if (set != NULL) {
+    removed = malloc(sizeof(struct cache_entry *) * set->count);
+
+    for (uint32_t i = 0; i < set->count; i++) {
+      struct cache_entry *entry = set->entries[i];
+
+      /* Expired long enough ago not to be served stale either. Index still holds it, so it can be retained here */
+      __atomic_store_n(&entry->timestamp, 0, __ATOMIC_RELAXED);
+      cache_retain(entry);
+      removed[i] = entry;
+      for (int j = 0; j < entry->tags_count; j++) {
+        if (entry->tags[j].set == set) entry->tags[j].set = NULL;
+      }
+    }
+
+    purged = set->count;
+    free_set(set);
+  }
+  pthread_mutex_unlock(&tags_mutex);
+
+  if (removed != NULL) {
+    for (size_t i = 0; i < purged; i++) {
+      cache_remove(removed[i]);
+      cache_release(removed[i]);
+    }
+    free(removed);
+  }
+
+  return purged;
+}
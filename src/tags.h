@@ -0,0 +1,24 @@
+#ifndef CACHR_TAGS_H
+#define CACHR_TAGS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Tags kept per response, further ones in Surrogate-Key/Cache-Tag are ignored */
+#define CACHE_TAGS_MAX 32
+
+struct cache_entry;
+struct tag_set;
+
+/* Entry's place in one tag's entry list, lets removal swap it out without searching */
+struct cache_tag_ref {
+  struct tag_set *set;
+  uint32_t slot;
+};
+
+int tags_parse(const char *value, size_t value_len, uint64_t *tags, int count);
+void tags_attach(struct cache_entry *entry, uint64_t *tags, int count);
+void tags_detach(struct cache_entry *entry);
+size_t tags_purge(const char *tag, size_t tag_len, int soft);
+
+#endif //CACHR_TAGS_H
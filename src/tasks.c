@@ -0,0 +1,237 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "tasks.h"
+#include "metrics.h"
+#include "log.h"
+
+/*
+ * Work-stealing pool for CPU-heavy background work. Tasks submitted by other threads go to a bounded shared queue,
+ * tasks submitted by a task go to its worker's own deque, idle workers steal from the others. Submitters that want to
+ * know when a task is done pass an eventfd they can poll next to their sockets.
+ */
+
+struct worker {
+  struct task_deque deque;
+  uint64_t seed;
+  pthread_t thread;
+} __attribute__((aligned(64)));
+
+static struct worker *workers = NULL;
+static int workers_count = 0;
+static __thread struct worker *current_worker = NULL;
+
+/* Shared injection queue, a ring of queue_max tasks */
+static struct task **queue = NULL;
+static int queue_max, queue_head = 0, queue_length = 0;
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Tasks queued and not taken yet, workers sleep while it's 0 */
+static int64_t pending = 0;
+static int sleeping = 0;
+static pthread_mutex_t idle_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+
+static int deque_push(struct task_deque *deque, struct task *task) {
+  int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+  int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+
+  if (bottom - top >= TASKS_DEQUE_SIZE) return -1;
+
+  __atomic_store_n(&deque->tasks[bottom & (TASKS_DEQUE_SIZE - 1)], task, __ATOMIC_RELAXED);
+  __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/* Owner's end, races thieves only for the last task */
+static struct task *deque_pop(struct task_deque *deque) {
+  int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1, top;
+  struct task *task = NULL;
+
+  __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+  if (top <= bottom) {
+    task = __atomic_load_n(&deque->tasks[bottom & (TASKS_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+    if (top == bottom) {
+      if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        task = NULL;
+      }
+      __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+  } else {
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+  }
+  return task;
+}
+
+static struct task *deque_steal(struct task_deque *deque) {
+  int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE), bottom;
+  struct task *task;
+
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+  if (top >= bottom) return NULL;
+
+  task = __atomic_load_n(&deque->tasks[top & (TASKS_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+  if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) return NULL;
+  return task;
+}
+
+static struct task *queue_take() {
+  struct task *task = NULL;
+
+  pthread_mutex_lock(&queue_mutex);
+  if (queue_length > 0) {
+    task = queue[queue_head];
+    queue_head = (queue_head + 1) % queue_max;
+    queue_length--;
+  }
+  pthread_mutex_unlock(&queue_mutex);
+  return task;
+}
+
+/* Own deque first (newest task, its data is still in cache), then shared queue, then others' oldest tasks */
+static struct task *find_task(struct worker *worker) {
+  struct task *task;
+  int start;
+
+  if ((task = deque_pop(&worker->deque)) != NULL) return task;
+  if ((task = queue_take()) != NULL) return task;
+
+  worker->seed ^= worker->seed << 13;
+  worker->seed ^= worker->seed >> 7;
+  worker->seed ^= worker->seed << 17;
+  start = (int) (worker->seed % (uint64_t) workers_count);
+
+  for (int i = 0; i < workers_count; i++) {
+    struct worker *victim = &workers[(start + i) % workers_count];
+
+    if (victim != worker && (task = deque_steal(&victim->deque)) != NULL) {
+      metrics_add(METRIC_TASKS_STOLEN, 1);
+      return task;
+    }
+  }
+  return NULL;
+}
+
+/* Either a sleeping worker sees pending raised or submitter sees it sleeping and signals, so no wakeup is lost */
+static void wake_worker() {
+  if (__atomic_load_n(&sleeping, __ATOMIC_SEQ_CST) > 0) {
+    pthread_mutex_lock(&idle_mutex);
+    pthread_cond_signal(&idle_cond);
+    pthread_mutex_unlock(&idle_mutex);
+  }
+}
+
+static void run_task(struct task *task) {
+  task->run(task->arg);
+
+  if (task->notify_fd >= 0) {
+    uint64_t one = 1;
+
+    while (write(task->notify_fd, &one, sizeof(one)) == -1 && errno == EINTR);
+  }
+  metrics_add(METRIC_TASKS_COMPLETED, 1);
+  free(task);
+}
+
+static void *worker_thread(void *ctx) {
+  struct worker *worker = ctx;
+  struct task *task;
+
+  current_worker = worker;
+
+  while (1) {
+    if ((task = find_task(worker)) != NULL) {
+      __atomic_sub_fetch(&pending, 1, __ATOMIC_SEQ_CST);
+      run_task(task);
+      continue;
+    }
+
+    pthread_mutex_lock(&idle_mutex);
+    __atomic_add_fetch(&sleeping, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&pending, __ATOMIC_SEQ_CST) == 0) pthread_cond_wait(&idle_cond, &idle_mutex);
+    __atomic_sub_fetch(&sleeping, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&idle_mutex);
+
+    /* Pending task may be on its way out of an owner's deque, let the owner run */
+    sched_yield();
+  }
+
+  return NULL;
+}
+
+int tasks_start(int threads, int queue_limit) {
+  queue_max = queue_limit > 0 ? queue_limit : 1;
+  queue = calloc((size_t) queue_max, sizeof(struct task *));
+
+  if (threads < 1 || posix_memalign((void **) &workers, 64, sizeof(struct worker) * threads) != 0) return -1;
+  memset(workers, 0, sizeof(struct worker) * threads);
+  for (int i = 0; i < threads; i++) workers[i].seed = 2317 + (uint64_t) i * 7919;
+  workers_count = threads;
+
+  for (int i = 0; i < threads; i++) {
+    if (pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i]) != 0) {
+      log_error("[tasks] Failed to create worker thread.\n");
+      workers_count = i;
+      break;
+    }
+    pthread_detach(workers[i].thread);
+  }
+
+  log_info("[tasks] %d workers, up to %d queued tasks\n", workers_count, queue_max);
+  return workers_count > 0 ? 0 : -1;
+}
+
+/*
+ * Queues run(arg) on the pool, notify_fd (from tasks_notifier(), or -1) is signalled once it has run.
+ * Returns -1 when pool is not running or its queue is full, then arg stays with the caller.
+ */
+int tasks_submit(task_fn run, void *arg, int notify_fd) {
+  struct task *task;
+
+  if (workers_count == 0) return -1;
+
+  task = malloc(sizeof(struct task));
+  task->run = run;
+  task->arg = arg;
+  task->notify_fd = notify_fd;
+
+  /* Counted before it's visible, so whoever takes it never sees pending go below zero */
+  __atomic_add_fetch(&pending, 1, __ATOMIC_SEQ_CST);
+  if (current_worker == NULL || deque_push(&current_worker->deque, task) != 0) {
+    pthread_mutex_lock(&queue_mutex);
+    if (queue_length == queue_max) {
+      pthread_mutex_unlock(&queue_mutex);
+      __atomic_sub_fetch(&pending, 1, __ATOMIC_SEQ_CST);
+      metrics_add(METRIC_TASKS_REJECTED, 1);
+      free(task);
+      return -1;
+    }
+    queue[(queue_head + queue_length++) % queue_max] = task;
+    pthread_mutex_unlock(&queue_mutex);
+  }
+
+  wake_worker();
+  return 0;
+}
+
+/* Non-blocking eventfd for completions, poll it for POLLIN */
+int tasks_notifier() {
+  return eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+/* Tasks completed since last call, resets the count */
+uint64_t tasks_completed(int notify_fd) {
+  uint64_t completed = 0;
+
+  if (read(notify_fd, &completed, sizeof(completed)) != sizeof(completed)) return 0;
+  return completed;
+}
@@ -0,0 +1,33 @@
+#ifndef CACHR_TASKS_H
+#define CACHR_TASKS_H
+
+#include <stdint.h>
+
+/* Tasks a worker queues for itself, beyond this they go to the shared queue. Power of two */
+#define TASKS_DEQUE_SIZE 256
+
+typedef void (*task_fn)(void *arg);
+
+struct task {
+  task_fn run;
+  void *arg;
+  /* eventfd written once task has run, -1 for none */
+  int notify_fd;
+};
+
+/*
+ * Chase-Lev deque: owner pushes and pops at bottom, other workers steal from top. top and bottom on their own cache
+ * lines, thieves only contend on top.
+ */
+struct task_deque {
+  int64_t top __attribute__((aligned(64)));
+  int64_t bottom __attribute__((aligned(64)));
+  struct task *tasks[TASKS_DEQUE_SIZE] __attribute__((aligned(64)));
+};
+
+int tasks_start(int threads, int queue_max);
+int tasks_submit(task_fn run, void *arg, int notify_fd);
+int tasks_notifier();
+uint64_t tasks_completed(int notify_fd);
+
+#endif //CACHR_TASKS_H
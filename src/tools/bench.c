@@ -0,0 +1,353 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <math.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "../libs/picohttpparser.h"
+#include "../metrics.h"
+
+/*
+ * cachr-bench: HTTP load generator.
+ * Closed loop by default (each connection sends the next request when previous one completes), open loop with -r:
+ * requests are scheduled at a fixed rate and latency is measured from the scheduled time, so a stalled server
+ * can't hide its queueing delay (coordinated omission).
+ */
+
+enum key_distribution {
+  KEYS_UNIFORM = 0,
+  KEYS_ZIPF,
+  KEYS_SCAN
+};
+
+struct worker {
+  pthread_t thread;
+  int id;
+  int fd;
+  uint64_t rng;
+  uint64_t requests;
+  uint64_t errors;
+  uint64_t reconnects;
+  uint64_t statuses[6];
+  uint64_t bytes;
+  struct histogram latency;
+};
+
+static const char *host = "127.0.0.1", *port = "3001", *prefix = "/bench/";
+static int connections = 16, duration = 10, warmup = 0, keep_alive = 1, distribution = KEYS_UNIFORM;
+static long keys = 1000;
+static double zipf_exponent = 0.99, rate = 0;
+static double *zipf_cdf = NULL;
+static long start_us, measure_from_us, stop_us;
+static long scan_position = 0;
+static struct addrinfo *target;
+
+static long now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* xorshift64*, one state per worker */
+static uint64_t next_random(uint64_t *state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 2685821657736338717ULL;
+}
+
+static void build_zipf() {
+  double sum = 0;
+
+  zipf_cdf = malloc(sizeof(double) * keys);
+  for (long i = 0; i < keys; i++) {
+    sum += 1.0 / pow((double) (i + 1), zipf_exponent);
+    zipf_cdf[i] = sum;
+  }
+  for (long i = 0; i < keys; i++) zipf_cdf[i] /= sum;
+}
+
+static long next_key(struct worker *worker) {
+  switch (distribution) {
+    case KEYS_ZIPF: {
+      double u = (next_random(&worker->rng) >> 11) * (1.0 / 9007199254740992.0);
+      long low = 0, high = keys - 1;
+
+      while (low < high) {
+        long mid = (low + high) / 2;
+        if (zipf_cdf[mid] < u) low = mid + 1;
+        else high = mid;
+      }
+      return low;
+    }
+    case KEYS_SCAN:
+      return __atomic_fetch_add(&scan_position, 1, __ATOMIC_RELAXED) % keys;
+    default:
+      return (long) (next_random(&worker->rng) % (uint64_t) keys);
+  }
+}
+
+static int connect_target() {
+  int fd = socket(target->ai_family, SOCK_STREAM, 0);
+
+  if (fd < 0) return -1;
+  if (connect(fd, target->ai_addr, target->ai_addrlen) != 0) {
+    close(fd);
+    return -1;
+  }
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+  return fd;
+}
+
+static int header_is(struct phr_header *header, const char *name) {
+  return header->name_len == strlen(name) && strncasecmp(header->name, name, header->name_len) == 0;
+}
+
+/*
+ * Reads one response. Returns status, 0 if connection was closed before any byte arrived (stale keep-alive
+ * connection, request may be retried) or -1 on error. *reusable is cleared when server closes after response.
+ */
+static int read_response(struct worker *worker, int *reusable) {
+  char buffer[65536];
+  size_t size = 0, last_len = 0, num_headers, msg_len;
+  struct phr_header headers[64];
+  struct phr_chunked_decoder decoder = {0};
+  const char *msg;
+  int minor_version, status, pret = -2, chunked = 0;
+  long long content_length = -1, received = 0;
+
+  while (pret == -2) {
+    ssize_t rsize = read(worker->fd, buffer + size, sizeof(buffer) - size);
+
+    if (rsize <= 0) return size == 0 && (rsize == 0 || errno == ECONNRESET) ? 0 : -1;
+    size += rsize;
+    worker->bytes += rsize;
+
+    num_headers = sizeof(headers) / sizeof(headers[0]);
+    pret = phr_parse_response(buffer, size, &minor_version, &status, &msg, &msg_len, headers, &num_headers,
+                              last_len);
+    last_len = size;
+    if (pret == -1 || (pret == -2 && size == sizeof(buffer))) return -1;
+  }
+
+  *reusable = keep_alive && minor_version == 1;
+  for (size_t i = 0; i < num_headers; i++) {
+    if (header_is(&headers[i], "Content-Length")) {
+      content_length = strtoll(headers[i].value, NULL, 10);
+    } else if (header_is(&headers[i], "Transfer-Encoding")) {
+      chunked = headers[i].value_len == 7 && strncasecmp(headers[i].value, "chunked", 7) == 0;
+    } else if (header_is(&headers[i], "Connection") && headers[i].value_len == 5 &&
+               strncasecmp(headers[i].value, "close", 5) == 0) {
+      *reusable = 0;
+    }
+  }
+
+  /* Body bytes that came with the headers */
+  size -= (size_t) pret;
+  memmove(buffer, buffer + pret, size);
+
+  while (1) {
+    ssize_t rsize;
+
+    if (chunked) {
+      size_t decoded = size;
+      ssize_t left = phr_decode_chunked(&decoder, buffer, &decoded);
+
+      if (left == -1) return -1;
+      if (left >= 0) break;
+    } else {
+      received += (long long) size;
+      if (content_length >= 0 && received >= content_length) break;
+    }
+
+    rsize = read(worker->fd, buffer, sizeof(buffer));
+    if (rsize < 0) return -1;
+    if (rsize == 0) {
+      /* Without length, end of connection ends the body */
+      *reusable = 0;
+      if (!chunked && content_length < 0) break;
+      return -1;
+    }
+    size = (size_t) rsize;
+    worker->bytes += rsize;
+  }
+
+  return status;
+}
+
+static void *run_worker(void *ctx) {
+  struct worker *worker = ctx;
+  char request[1024];
+  double interval_us = rate > 0 ? connections * 1e6 / rate : 0;
+  long scheduled = start_us + (long) (interval_us * worker->id / connections);
+  int reusable = 0;
+
+  worker->fd = -1;
+
+  while (1) {
+    long sent, done, key = next_key(worker);
+    int status = 0, len;
+
+    if (interval_us > 0) {
+      long wait = scheduled - now_us();
+      if (wait > 0) usleep((useconds_t) wait);
+    }
+
+    sent = interval_us > 0 ? scheduled : now_us();
+    if (sent >= stop_us) break;
+
+    len = snprintf(request, sizeof(request), "GET %s%ld HTTP/1.1\r\nHost: %s\r\n%s\r\n", prefix, key, host,
+                   keep_alive ? "" : "Connection: close\r\n");
+
+    /* Second attempt only when a reused connection turned out to be closed by server */
+    for (int attempt = 0; attempt < 2 && status == 0; attempt++) {
+      int fresh = worker->fd < 0 || !reusable;
+
+      if (fresh) {
+        if (worker->fd >= 0) close(worker->fd);
+        worker->fd = connect_target();
+      }
+
+      if (worker->fd < 0) {
+        status = -1;
+      } else if (write(worker->fd, request, (size_t) len) != len) {
+        status = fresh ? -1 : 0;
+      } else if ((status = read_response(worker, &reusable)) == 0 && fresh) {
+        status = -1;
+      }
+
+      if (status <= 0 && worker->fd >= 0) {
+        close(worker->fd);
+        worker->fd = -1;
+        if (status == 0) worker->reconnects++;
+      }
+    }
+
+    done = now_us();
+    if (sent >= measure_from_us) {
+      worker->requests++;
+      if (status < 0) {
+        worker->errors++;
+      } else {
+        worker->statuses[status / 100 < 6 ? status / 100 : 0]++;
+        worker->latency.counts[histogram_bucket((uint64_t) (done - sent))]++;
+        worker->latency.sum += (uint64_t) (done - sent);
+      }
+    }
+
+    scheduled += (long) interval_us;
+  }
+
+  if (worker->fd >= 0) close(worker->fd);
+  return NULL;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-H host] [-p port] [-c connections] [-d seconds] [-w warmup_seconds]\n"
+                  "          [-n keys] [-D uniform|zipf|scan] [-s zipf_exponent] [-r requests_per_second]\n"
+                  "          [-P path_prefix] [-K (no keep-alive)]\n", name);
+}
+
+int main(int argc, char **argv) {
+  struct addrinfo hints;
+  struct worker *workers;
+  struct histogram total = {{0}};
+  uint64_t requests = 0, errors = 0, reconnects = 0, bytes = 0, statuses[6] = {0}, completed;
+  double measured;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "H:p:c:d:w:n:D:s:r:P:K")) != -1) {
+    switch (opt) {
+      case 'H': host = optarg; break;
+      case 'p': port = optarg; break;
+      case 'c': connections = atoi(optarg); break;
+      case 'd': duration = atoi(optarg); break;
+      case 'w': warmup = atoi(optarg); break;
+      case 'n': keys = atol(optarg); break;
+      case 's': zipf_exponent = atof(optarg); break;
+      case 'r': rate = atof(optarg); break;
+      case 'P': prefix = optarg; break;
+      case 'K': keep_alive = 0; break;
+      case 'D':
+        if (strcmp(optarg, "zipf") == 0) distribution = KEYS_ZIPF;
+        else if (strcmp(optarg, "scan") == 0) distribution = KEYS_SCAN;
+        else if (strcmp(optarg, "uniform") == 0) distribution = KEYS_UNIFORM;
+        else {
+          usage(argv[0]);
+          return 2;
+        }
+        break;
+      default:
+        usage(argv[0]);
+        return 2;
+    }
+  }
+
+  if (connections < 1 || keys < 1 || duration < 1) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, port, &hints, &target) != 0) {
+    fprintf(stderr, "Can't resolve %s:%s\n", host, port);
+    return 1;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  if (distribution == KEYS_ZIPF) build_zipf();
+
+  workers = calloc((size_t) connections, sizeof(struct worker));
+  start_us = now_us();
+  measure_from_us = start_us + warmup * 1000000L;
+  stop_us = measure_from_us + duration * 1000000L;
+
+  for (int i = 0; i < connections; i++) {
+    workers[i].id = i;
+    workers[i].rng = 0x9e3779b97f4a7c15ULL * (uint64_t) (i + 1);
+    pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+  }
+
+  for (int i = 0; i < connections; i++) {
+    pthread_join(workers[i].thread, NULL);
+
+    requests += workers[i].requests;
+    errors += workers[i].errors;
+    reconnects += workers[i].reconnects;
+    bytes += workers[i].bytes;
+    for (int j = 0; j < 6; j++) statuses[j] += workers[i].statuses[j];
+    for (int j = 0; j < HISTOGRAM_BUCKETS; j++) total.counts[j] += workers[i].latency.counts[j];
+    total.sum += workers[i].latency.sum;
+  }
+
+  measured = duration;
+  completed = requests - errors;
+
+  printf("target        %s:%s%s, %d connections, %s, %ld keys (%s)\n", host, port, prefix, connections,
+         rate > 0 ? "open loop" : "closed loop", keys,
+         distribution == KEYS_ZIPF ? "zipf" : distribution == KEYS_SCAN ? "scan" : "uniform");
+  if (rate > 0) printf("target rate   %.0f req/s\n", rate);
+  printf("requests      %llu (%.0f req/s), errors %llu, reconnects %llu\n", (unsigned long long) requests,
+         completed / measured, (unsigned long long) errors, (unsigned long long) reconnects);
+  printf("status        2xx %llu, 3xx %llu, 4xx %llu, 5xx %llu\n", (unsigned long long) statuses[2],
+         (unsigned long long) statuses[3], (unsigned long long) statuses[4], (unsigned long long) statuses[5]);
+  printf("throughput    %.2f MiB/s\n", bytes / measured / 1024 / 1024);
+  printf("latency (ms)  mean %.3f, p50 %.3f, p90 %.3f, p99 %.3f, p999 %.3f, max %.3f\n",
+         completed > 0 ? total.sum / 1000.0 / completed : 0, histogram_quantile(&total, 0.5) / 1000,
+         histogram_quantile(&total, 0.9) / 1000, histogram_quantile(&total, 0.99) / 1000,
+         histogram_quantile(&total, 0.999) / 1000, histogram_quantile(&total, 1.0) / 1000);
+
+  return errors > 0 && completed == 0;
+}
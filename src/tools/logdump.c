@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../accesslog.h"
+
+/*
+ * cachr-logdump: prints access log segments as text or CSV.
+ * Usage: cachr-logdump [--csv] segment.clog [...]
+ */
+
+static const char *encoding_names[] = {"identity", "br", "zstd", "gzip"};
+
+static const char *encoding_label(uint8_t encoding) {
+  return encoding < sizeof(encoding_names) / sizeof(encoding_names[0]) ? encoding_names[encoding] : "?";
+}
+
+static void print_record(struct access_record *record, int csv) {
+  time_t seconds = (time_t) (record->timestamp_us / 1000000);
+  struct tm tm;
+  char date[32];
+
+  gmtime_r(&seconds, &tm);
+  strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", &tm);
+
+  if (csv) {
+    printf("%s.%06llu,%016llx,%u,%s,%s,%u,%llu,%llu,%u,%u\n", date,
+           (unsigned long long) (record->timestamp_us % 1000000), (unsigned long long) record->key, record->status,
+           access_result_name(record->result), encoding_label(record->encoding), record->bytes_in,
+           (unsigned long long) record->bytes_out, (unsigned long long) record->upstream_bytes, record->upstream_us,
+           record->total_us);
+  } else {
+    printf("%s.%06lluZ key=%016llx status=%u %s encoding=%s in=%u out=%llu upstream_bytes=%llu upstream=%.3fms "
+           "total=%.3fms\n", date, (unsigned long long) (record->timestamp_us % 1000000),
+           (unsigned long long) record->key, record->status, access_result_name(record->result),
+           encoding_label(record->encoding), record->bytes_in, (unsigned long long) record->bytes_out,
+           (unsigned long long) record->upstream_bytes, record->upstream_us / 1000.0, record->total_us / 1000.0);
+  }
+}
+
+static int dump_segment(const char *path, int csv) {
+  struct access_log_header header;
+  struct access_record record;
+  FILE *file = fopen(path, "rb");
+
+  if (file == NULL) {
+    perror(path);
+    return -1;
+  }
+
+  if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, ACCESS_LOG_MAGIC, 8) != 0) {
+    fprintf(stderr, "%s: not a cachr access log segment\n", path);
+    fclose(file);
+    return -1;
+  }
+
+  if (header.version != ACCESS_LOG_VERSION || header.record_size != sizeof(struct access_record)) {
+    fprintf(stderr, "%s: unsupported version %u (record size %u)\n", path, header.version, header.record_size);
+    fclose(file);
+    return -1;
+  }
+
+  /* Header count is what the writer committed, a live segment may have a torn last record past it */
+  for (uint64_t i = 0; i < header.count && fread(&record, sizeof(record), 1, file) == 1; i++) {
+    print_record(&record, csv);
+  }
+
+  fclose(file);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  int csv = 0, failed = 0, first = 1;
+
+  if (argc > 1 && strcmp(argv[1], "--csv") == 0) {
+    csv = 1;
+    first = 2;
+  }
+
+  if (first >= argc) {
+    fprintf(stderr, "Usage: %s [--csv] segment.clog [...]\n", argv[0]);
+    return 2;
+  }
+
+  if (csv) printf("timestamp,key,status,result,encoding,bytes_in,bytes_out,upstream_bytes,upstream_us,total_us\n");
+
+  for (int i = first; i < argc; i++) {
+    if (dump_segment(argv[i], csv) != 0) failed = 1;
+  }
+
+  return failed;
+}
@@ -0,0 +1,315 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <getopt.h>
+#include <sched.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#else
+#define HAVE_TSC 0
+#endif
+
+#include "../libs/picohttpparser.h"
+#include "../cache.h"
+#include "../request.h"
+#include "../utils.h"
+
+/*
+ * cachr-microbench: times request path internals in isolation and prints JSON.
+ * Every benchmark runs pinned to one CPU, is warmed up, calibrated so that one repetition takes about -t ms and
+ * then repeated -r times. Per-operation nanoseconds and TSC cycles are reported as min/median/mean/max.
+ * Usage: cachr-microbench [-C cpu] [-r repetitions] [-w warmup_ms] [-t repetition_ms] [-n cache_entries] [-f filter]
+ */
+
+struct benchmark {
+  const char *name;
+  void (*run)(uint64_t iterations);
+};
+
+struct sample {
+  double ns;
+  double cycles;
+};
+
+static const char request[] =
+  "GET /images/logo.png?v=3 HTTP/1.1\r\n"
+  "Host: localhost:3001\r\n"
+  "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0 Safari/537.36\r\n"
+  "Accept: image/avif,image/webp,image/apng,image/*,*/*;q=0.8\r\n"
+  "Accept-Encoding: gzip, deflate, br\r\n"
+  "Accept-Language: en-US,en;q=0.9\r\n"
+  "Range: bytes=0-1023\r\n"
+  "Connection: keep-alive\r\n"
+  "\r\n";
+
+static const char *method, *path;
+static size_t method_len, path_len, num_headers;
+static struct phr_header headers[100];
+static int minor_version, headers_size;
+
+static struct cache_entry *table = NULL, *entries, *spare;
+static uint64_t *keys;
+static long cache_entries = 100000;
+
+/* Results go here so the compiler can't drop the work */
+static volatile uint64_t sink;
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+static uint64_t cycles() {
+#if HAVE_TSC
+  uint64_t tsc;
+
+  /* Keeps earlier instructions from drifting past the read */
+  _mm_lfence();
+  tsc = __rdtsc();
+  _mm_lfence();
+  return tsc;
+#else
+  return 0;
+#endif
+}
+
+static void run_hash_path(uint64_t iterations) {
+  char path_copy[] = "/images/logo.png?v=3";
+
+  for (uint64_t i = 0; i < iterations; i++) sink += hash_buffer(path_copy);
+}
+
+static void run_hash_request(uint64_t iterations) {
+  for (uint64_t i = 0; i < iterations; i++) sink += hash_bytes(HASH_SEED, request, sizeof(request) - 1);
+}
+
+static void run_cache_key(uint64_t iterations) {
+  for (uint64_t i = 0; i < iterations; i++) {
+    sink += get_cache_key((char *) request, sizeof(request) - 1, headers, num_headers);
+  }
+}
+
+static void run_parse_request(uint64_t iterations) {
+  const char *m, *p;
+  size_t m_len, p_len, count;
+  struct phr_header parsed[100];
+  int version;
+
+  for (uint64_t i = 0; i < iterations; i++) {
+    count = sizeof(parsed) / sizeof(parsed[0]);
+    sink += (uint64_t) phr_parse_request(request, sizeof(request) - 1, &m, &m_len, &p, &p_len, &version, parsed,
+                                         &count, 0);
+  }
+}
+
+static void run_rewrite_request(uint64_t iterations) {
+  for (uint64_t i = 0; i < iterations; i++) {
+    char *rewritten = rewrite_request((char *) request, headers, headers_size, (int) num_headers,
+                                      (int) sizeof(request) - 1, (char *) method, method_len, (char *) path, path_len,
+                                      minor_version, "origin.example.com");
+    sink += (uint64_t) rewritten[0];
+    free(rewritten);
+  }
+}
+
+static void run_cache_find_hit(uint64_t iterations) {
+  struct cache_entry *found;
+
+  for (uint64_t i = 0; i < iterations; i++) {
+    HASH_FIND(hh, table, &keys[i % cache_entries], sizeof(uint64_t), found);
+    sink += (uint64_t) found->timestamp;
+  }
+}
+
+static void run_cache_find_miss(uint64_t iterations) {
+  struct cache_entry *found;
+
+  for (uint64_t i = 0; i < iterations; i++) {
+    uint64_t key = ~keys[i % cache_entries];
+    HASH_FIND(hh, table, &key, sizeof(uint64_t), found);
+    sink += found == NULL;
+  }
+}
+
+/* Same as storing a refreshed response: new entry takes the key, replaced one is kept for the next round */
+static void run_cache_replace(uint64_t iterations) {
+  struct cache_entry *replaced;
+
+  for (uint64_t i = 0; i < iterations; i++) {
+    spare->key = keys[i % cache_entries];
+    HASH_REPLACE(hh, table, key, sizeof(uint64_t), spare, replaced);
+    spare = replaced;
+  }
+}
+
+static void run_cache_add_delete(uint64_t iterations) {
+  for (uint64_t i = 0; i < iterations; i++) {
+    spare->key = ~keys[i % cache_entries];
+    HASH_ADD(hh, table, key, sizeof(uint64_t), spare);
+    HASH_DEL(table, spare);
+  }
+}
+
+static const struct benchmark benchmarks[] = {
+  {"hash_buffer/path", run_hash_path},
+  {"hash_bytes/request", run_hash_request},
+  {"get_cache_key/request", run_cache_key},
+  {"phr_parse_request/request", run_parse_request},
+  {"rewrite_request/request", run_rewrite_request},
+  {"cache/find_hit", run_cache_find_hit},
+  {"cache/find_miss", run_cache_find_miss},
+  {"cache/replace", run_cache_replace},
+  {"cache/add_delete", run_cache_add_delete},
+};
+
+static void prepare() {
+  char name[32];
+
+  num_headers = sizeof(headers) / sizeof(headers[0]);
+  headers_size = phr_parse_request(request, sizeof(request) - 1, &method, &method_len, &path, &path_len,
+                                   &minor_version, headers, &num_headers, 0);
+  if (headers_size <= 0) abort();
+
+  /* Keys are cache keys of distinct paths, looked up in shuffled order */
+  entries = calloc((size_t) cache_entries, sizeof(struct cache_entry));
+  spare = calloc(1, sizeof(struct cache_entry));
+  keys = malloc(sizeof(uint64_t) * cache_entries);
+
+  for (long i = 0; i < cache_entries; i++) {
+    snprintf(name, sizeof(name), "/bench/%ld", i);
+    entries[i].key = hash_buffer(name);
+    entries[i].timestamp = i;
+    HASH_ADD(hh, table, key, sizeof(uint64_t), &entries[i]);
+    keys[i] = entries[i].key;
+  }
+
+  srand(2317);
+  for (long i = cache_entries - 1; i > 0; i--) {
+    long j = rand() % (i + 1);
+    uint64_t key = keys[i];
+    keys[i] = keys[j];
+    keys[j] = key;
+  }
+}
+
+static int compare_samples(const void *a, const void *b) {
+  double x = ((const struct sample *) a)->ns, y = ((const struct sample *) b)->ns;
+  return (x > y) - (x < y);
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+static void print_stats(FILE *out, const char *name, double *values, int count) {
+  double sum = 0, variance = 0, mean;
+
+  for (int i = 0; i < count; i++) sum += values[i];
+  mean = sum / count;
+  for (int i = 0; i < count; i++) variance += (values[i] - mean) * (values[i] - mean);
+
+  qsort(values, (size_t) count, sizeof(double), compare_doubles);
+  fprintf(out, "\"%s\": {\"min\": %.3f, \"median\": %.3f, \"mean\": %.3f, \"max\": %.3f, \"stddev\": %.3f}", name,
+          values[0], values[count / 2], mean, values[count - 1], sqrt(variance / count));
+}
+
+static void run_benchmark(FILE *out, const struct benchmark *benchmark, int repetitions, int warmup_ms,
+                          int repetition_ms) {
+  struct sample *samples = calloc((size_t) repetitions, sizeof(struct sample));
+  double *values = calloc((size_t) repetitions, sizeof(double));
+  uint64_t iterations = 1, started, elapsed;
+
+  /* Calibration doubles as the first part of warmup */
+  while (1) {
+    started = now_ns();
+    benchmark->run(iterations);
+    elapsed = now_ns() - started;
+    if (elapsed >= (uint64_t) repetition_ms * 1000000ULL / 8 || iterations >= (1ULL << 40)) break;
+    iterations *= 2;
+  }
+  iterations = iterations * ((uint64_t) repetition_ms * 1000000ULL) / (elapsed > 0 ? elapsed : 1);
+  if (iterations == 0) iterations = 1;
+
+  started = now_ns();
+  while (now_ns() - started < (uint64_t) warmup_ms * 1000000ULL) benchmark->run(iterations / 8 + 1);
+
+  for (int i = 0; i < repetitions; i++) {
+    uint64_t start_cycles = cycles(), start_ns = now_ns();
+
+    benchmark->run(iterations);
+    samples[i].ns = (double) (now_ns() - start_ns) / iterations;
+    samples[i].cycles = (double) (cycles() - start_cycles) / iterations;
+  }
+  qsort(samples, (size_t) repetitions, sizeof(struct sample), compare_samples);
+
+  fprintf(out, "    {\"name\": \"%s\", \"iterations\": %llu, ", benchmark->name, (unsigned long long) iterations);
+  for (int i = 0; i < repetitions; i++) values[i] = samples[i].ns;
+  print_stats(out, "ns_per_op", values, repetitions);
+  if (HAVE_TSC) {
+    fprintf(out, ", ");
+    for (int i = 0; i < repetitions; i++) values[i] = samples[i].cycles;
+    print_stats(out, "cycles_per_op", values, repetitions);
+  }
+  fprintf(out, "}");
+
+  free(samples);
+  free(values);
+}
+
+int main(int argc, char **argv) {
+  int cpu = -1, repetitions = 10, warmup_ms = 100, repetition_ms = 50, opt, first = 1;
+  const char *filter = NULL;
+  cpu_set_t set;
+
+  while ((opt = getopt(argc, argv, "C:r:w:t:n:f:")) != -1) {
+    switch (opt) {
+      case 'C': cpu = atoi(optarg); break;
+      case 'r': repetitions = atoi(optarg); break;
+      case 'w': warmup_ms = atoi(optarg); break;
+      case 't': repetition_ms = atoi(optarg); break;
+      case 'n': cache_entries = atol(optarg); break;
+      case 'f': filter = optarg; break;
+      default:
+        fprintf(stderr, "Usage: %s [-C cpu] [-r repetitions] [-w warmup_ms] [-t repetition_ms] [-n cache_entries] "
+                        "[-f filter]\n", argv[0]);
+        return 2;
+    }
+  }
+
+  if (repetitions < 1 || repetition_ms < 1 || cache_entries < 1) {
+    fprintf(stderr, "Repetitions, repetition time and cache entries must be positive\n");
+    return 2;
+  }
+
+  /* Stay on one CPU so caches, frequency and TSC stay the same between repetitions */
+  if (cpu < 0) cpu = sched_getcpu();
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+    perror("sched_setaffinity");
+    cpu = -1;
+  }
+
+  prepare();
+
+  printf("{\n  \"cpu\": %d,\n  \"compiler\": \"%s\",\n  \"repetitions\": %d,\n  \"repetition_ms\": %d,\n"
+         "  \"cache_entries\": %ld,\n  \"benchmarks\": [\n", cpu, __VERSION__, repetitions, repetition_ms,
+         cache_entries);
+
+  for (size_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+    if (filter != NULL && strstr(benchmarks[i].name, filter) == NULL) continue;
+    if (!first) printf(",\n");
+    run_benchmark(stdout, &benchmarks[i], repetitions, warmup_ms, repetition_ms);
+    fflush(stdout);
+    first = 0;
+  }
+
+  printf("\n  ]\n}\n");
+  return 0;
+}
@@ -0,0 +1,206 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "../libs/uthash.h"
+#include "../partition.h"
+#include "../utils.h"
+
+/*
+ * cachr-partbench: cache index throughput with one uthash under a mutex (what cachr does with [cache] partitions = 0)
+ * against shared-nothing partitions owned by pinned threads. Worker threads look up random keys and replace a share
+ * of them, each mode runs for -d ms and results are printed as JSON.
+ * Usage: cachr-partbench [-t threads] [-p partitions] [-d duration_ms] [-n entries] [-i insert_percent]
+ */
+
+struct item {
+  uint64_t key;
+  uint64_t value;
+  UT_hash_handle hh;
+};
+
+struct operation {
+  uint64_t key;
+  struct item *item;
+};
+
+struct worker {
+  pthread_t thread;
+  uint64_t ops;
+  uint64_t seed;
+} __attribute__((aligned(64)));
+
+static struct item *table = NULL;
+static pthread_mutex_t table_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t *keys;
+static long entries = 100000;
+static int insert_percent = 5, partitioned = 0;
+static volatile int running;
+
+/* Results go here so the compiler can't drop the work */
+static volatile uint64_t sink;
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+static uint64_t next_random(uint64_t *seed) {
+  *seed ^= *seed << 13;
+  *seed ^= *seed >> 7;
+  *seed ^= *seed << 17;
+  return *seed;
+}
+
+static void partition_find(void **state, void *arg) {
+  struct item *index = *state;
+  struct operation *op = arg;
+
+  HASH_FIND(hh, index, &op->key, sizeof(uint64_t), op->item);
+}
+
+/* Replaced item is handed back, so inserts don't allocate */
+static void partition_replace(void **state, void *arg) {
+  struct item **index = (struct item **) state;
+  struct operation *op = arg;
+  struct item *item = op->item;
+
+  HASH_REPLACE(hh, *index, key, sizeof(uint64_t), item, op->item);
+}
+
+static void find(struct operation *op) {
+  if (partitioned) {
+    partition_call(partition_of(op->key), partition_find, op);
+    return;
+  }
+
+  pthread_mutex_lock(&table_mutex);
+  HASH_FIND(hh, table, &op->key, sizeof(uint64_t), op->item);
+  pthread_mutex_unlock(&table_mutex);
+}
+
+static void replace(struct operation *op) {
+  struct item *item = op->item;
+
+  if (partitioned) {
+    partition_call(partition_of(op->key), partition_replace, op);
+    return;
+  }
+
+  pthread_mutex_lock(&table_mutex);
+  HASH_REPLACE(hh, table, key, sizeof(uint64_t), item, op->item);
+  pthread_mutex_unlock(&table_mutex);
+}
+
+static void *worker_thread(void *ctx) {
+  struct worker *worker = ctx;
+  struct item *spare = calloc(1, sizeof(struct item));
+  struct operation op;
+
+  while (running) {
+    uint64_t random = next_random(&worker->seed);
+
+    op.key = keys[random % (uint64_t) entries];
+    if ((int) ((random >> 40) % 100) < insert_percent) {
+      spare->key = op.key;
+      spare->value = random;
+      op.item = spare;
+      replace(&op);
+      spare = op.item != NULL ? op.item : calloc(1, sizeof(struct item));
+    } else {
+      find(&op);
+      sink += op.item->value;
+    }
+    worker->ops++;
+  }
+
+  return NULL;
+}
+
+static void populate() {
+  for (long i = 0; i < entries; i++) {
+    struct operation op = {.key = keys[i], .item = calloc(1, sizeof(struct item))};
+
+    op.item->key = keys[i];
+    op.item->value = (uint64_t) i;
+    replace(&op);
+  }
+}
+
+static void run(const char *mode, int threads, int duration_ms, int first) {
+  struct worker *workers = aligned_alloc(64, sizeof(struct worker) * threads);
+  uint64_t ops = 0, started, elapsed;
+
+  populate();
+
+  memset(workers, 0, sizeof(struct worker) * threads);
+  running = 1;
+  started = now_ns();
+  for (int i = 0; i < threads; i++) {
+    workers[i].seed = 2317 + (uint64_t) i * 7919;
+    pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i]);
+  }
+
+  while (now_ns() - started < (uint64_t) duration_ms * 1000000ULL) {
+    struct timespec pause = {0, 10000000};
+    nanosleep(&pause, NULL);
+  }
+  running = 0;
+
+  for (int i = 0; i < threads; i++) {
+    pthread_join(workers[i].thread, NULL);
+    ops += workers[i].ops;
+  }
+  elapsed = now_ns() - started;
+
+  printf("%s    {\"mode\": \"%s\", \"ops\": %llu, \"ops_per_s\": %.0f, \"ns_per_op\": %.1f}", first ? "" : ",\n", mode,
+         (unsigned long long) ops, ops * 1e9 / elapsed, ops > 0 ? (double) elapsed * threads / ops : 0.0);
+  fflush(stdout);
+  free(workers);
+}
+
+int main(int argc, char **argv) {
+  int threads = 4, partitions = 4, duration_ms = 2000, opt;
+
+  while ((opt = getopt(argc, argv, "t:p:d:n:i:")) != -1) {
+    switch (opt) {
+      case 't': threads = atoi(optarg); break;
+      case 'p': partitions = atoi(optarg); break;
+      case 'd': duration_ms = atoi(optarg); break;
+      case 'n': entries = atol(optarg); break;
+      case 'i': insert_percent = atoi(optarg); break;
+      default:
+        fprintf(stderr, "Usage: %s [-t threads] [-p partitions] [-d duration_ms] [-n entries] [-i insert_percent]\n",
+                argv[0]);
+        return 2;
+    }
+  }
+
+  if (threads < 1 || partitions < 1 || duration_ms < 1 || entries < 1) {
+    fprintf(stderr, "Threads, partitions, duration and entries must be positive\n");
+    return 2;
+  }
+
+  keys = malloc(sizeof(uint64_t) * entries);
+  for (long i = 0; i < entries; i++) keys[i] = mix64((uint64_t) i + 1);
+
+  /* Owner threads sleep through the shared run, started first so their log line stays out of JSON */
+  if (partition_start(partitions) != 0) return 1;
+
+  printf("{\n  \"threads\": %d,\n  \"partitions\": %d,\n  \"entries\": %ld,\n  \"insert_percent\": %d,\n"
+         "  \"duration_ms\": %d,\n  \"results\": [\n", threads, partitions, entries, insert_percent, duration_ms);
+
+  run("shared", threads, duration_ms, 1);
+
+  partitioned = 1;
+  run("partitioned", threads, duration_ms, 0);
+
+  printf("\n  ]\n}\n");
+  return 0;
+}
@@ -0,0 +1,177 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "../libs/picohttpparser.h"
+
+/*
+ * cachr-stub-origin: minimal keep-alive HTTP origin for benchmarks.
+ * Usage: cachr-stub-origin [-p port] [-l latency_ms] [-j jitter_ms] [-b body_bytes] [-m max_age] [-c]
+ * max_age 0 answers with Cache-Control: no-store, -c sends the body chunked.
+ */
+
+static int latency_ms = 0, jitter_ms = 0, max_age = 60, chunked = 0;
+static size_t body_size = 1024;
+static char *body;
+
+static int write_full(int fd, struct iovec *iov, int iovcnt) {
+  while (iovcnt > 0) {
+    ssize_t written = writev(fd, iov, iovcnt);
+
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+
+    while (iovcnt > 0 && (size_t) written >= iov->iov_len) {
+      written -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *) iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+  return 0;
+}
+
+static int respond(int fd, unsigned int *seed, int keep_alive) {
+  char head[256], chunk_head[32];
+  struct iovec iov[4];
+  int iovcnt = 0, delay = latency_ms + (jitter_ms > 0 ? rand_r(seed) % (jitter_ms + 1) : 0);
+  size_t offset;
+
+  if (delay > 0) usleep((useconds_t) delay * 1000);
+
+  offset = (size_t) sprintf(head, "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n");
+  if (max_age > 0) offset += sprintf(head + offset, "Cache-Control: max-age=%d\r\n", max_age);
+  else offset += sprintf(head + offset, "Cache-Control: no-store\r\n");
+  if (!keep_alive) offset += sprintf(head + offset, "Connection: close\r\n");
+
+  if (chunked) {
+    offset += sprintf(head + offset, "Transfer-Encoding: chunked\r\n\r\n");
+    iov[iovcnt].iov_base = head;
+    iov[iovcnt++].iov_len = offset;
+    iov[iovcnt].iov_base = chunk_head;
+    iov[iovcnt++].iov_len = (size_t) sprintf(chunk_head, "%zx\r\n", body_size);
+    iov[iovcnt].iov_base = body;
+    iov[iovcnt++].iov_len = body_size;
+    iov[iovcnt].iov_base = "\r\n0\r\n\r\n";
+    iov[iovcnt++].iov_len = 7;
+  } else {
+    offset += sprintf(head + offset, "Content-Length: %zu\r\n\r\n", body_size);
+    iov[iovcnt].iov_base = head;
+    iov[iovcnt++].iov_len = offset;
+    iov[iovcnt].iov_base = body;
+    iov[iovcnt++].iov_len = body_size;
+  }
+
+  return write_full(fd, iov, iovcnt);
+}
+
+static int header_is(struct phr_header *header, const char *name) {
+  return header->name_len == strlen(name) && strncasecmp(header->name, name, header->name_len) == 0;
+}
+
+static void *serve_connection(void *ctx) {
+  int fd = (int) (long) ctx;
+  char buffer[16384];
+  size_t size = 0;
+  unsigned int seed = (unsigned int) fd ^ (unsigned int) (long) &seed;
+
+  while (1) {
+    const char *method, *path;
+    size_t method_len, path_len, num_headers = 64;
+    struct phr_header headers[64];
+    int minor_version, keep_alive, pret;
+    ssize_t rsize = read(fd, buffer + size, sizeof(buffer) - size);
+
+    if (rsize <= 0) break;
+    size += rsize;
+
+    pret = phr_parse_request(buffer, size, &method, &method_len, &path, &path_len, &minor_version, headers,
+                             &num_headers, size - rsize);
+    if (pret == -2 && size < sizeof(buffer)) continue;
+    if (pret < 0) break;
+
+    keep_alive = minor_version == 1;
+    for (size_t i = 0; i < num_headers; i++) {
+      if (header_is(&headers[i], "Connection")) {
+        keep_alive = headers[i].value_len == 10 && strncasecmp(headers[i].value, "keep-alive", 10) == 0;
+      }
+    }
+
+    if (respond(fd, &seed, keep_alive) != 0 || !keep_alive) break;
+
+    /* Requests carry no body here, anything past headers is the next pipelined request */
+    memmove(buffer, buffer + pret, size - (size_t) pret);
+    size -= (size_t) pret;
+  }
+
+  close(fd);
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  struct sockaddr_in addr;
+  int port = 8090, opt, sck;
+
+  while ((opt = getopt(argc, argv, "p:l:j:b:m:c")) != -1) {
+    switch (opt) {
+      case 'p': port = atoi(optarg); break;
+      case 'l': latency_ms = atoi(optarg); break;
+      case 'j': jitter_ms = atoi(optarg); break;
+      case 'b': body_size = (size_t) atol(optarg); break;
+      case 'm': max_age = atoi(optarg); break;
+      case 'c': chunked = 1; break;
+      default:
+        fprintf(stderr, "Usage: %s [-p port] [-l latency_ms] [-j jitter_ms] [-b body_bytes] [-m max_age] [-c]\n",
+                argv[0]);
+        return 2;
+    }
+  }
+
+  body = malloc(body_size + 1);
+  memset(body, 'x', body_size);
+  signal(SIGPIPE, SIG_IGN);
+
+  sck = socket(AF_INET, SOCK_STREAM, 0);
+  setsockopt(sck, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int));
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons((unsigned short) port);
+
+  if (bind(sck, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(sck, SOMAXCONN) != 0) {
+    perror("listen");
+    return 1;
+  }
+
+  printf("Stub origin on 127.0.0.1:%d: latency=%dms jitter=%dms body=%zu max-age=%d%s\n", port, latency_ms,
+         jitter_ms, body_size, max_age, chunked ? " chunked" : "");
+  fflush(stdout);
+
+  while (1) {
+    pthread_t thid;
+    int fd = accept(sck, NULL, NULL);
+
+    if (fd < 0) continue;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+    if (pthread_create(&thid, NULL, serve_connection, (void *) (long) fd) == 0) {
+      pthread_detach(thid);
+    } else {
+      close(fd);
+    }
+  }
+}
@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../tasks.h"
+#include "../metrics.h"
+#include "../utils.h"
+
+/*
+ * cachr-taskbench: a reactor thread hashes bodies itself, then offloads the same work to the task pool and waits for
+ * completions on an eventfd. Each job hashes one body in -s parts, the first part's task submits the others to its
+ * own deque, where idle workers steal them. Reports jobs per second and how long the reactor was busy as JSON.
+ * Usage: cachr-taskbench [-t threads] [-j jobs] [-b body_kib] [-s parts] [-q queue]
+ */
+
+struct part {
+  const char *data;
+  size_t len;
+  uint64_t hash;
+  int notify_fd;
+  /* Rest of the job's parts, submitted by the first one */
+  struct part *rest;
+  int rest_count;
+};
+
+static char *body;
+static size_t body_len;
+
+/* Results go here so the compiler can't drop the work */
+static volatile uint64_t sink;
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+static void hash_part(void *arg) {
+  struct part *part = arg;
+
+  /* Runs on a worker, so these land on its deque. Parts the pool refuses are hashed here */
+  for (int i = 0; i < part->rest_count; i++) {
+    if (tasks_submit(hash_part, &part->rest[i], part->notify_fd) != 0) {
+      uint64_t one = 1;
+
+      hash_part(&part->rest[i]);
+      if (write(part->notify_fd, &one, sizeof(one)) != sizeof(one)) abort();
+    }
+  }
+  part->hash = hash_bytes(HASH_SEED, part->data, part->len);
+}
+
+static void split(struct part *parts, int count, int notify_fd) {
+  size_t len = body_len / count;
+
+  for (int i = 0; i < count; i++) {
+    parts[i].data = body + len * i;
+    parts[i].len = i == count - 1 ? body_len - len * i : len;
+    parts[i].notify_fd = notify_fd;
+    parts[i].rest = NULL;
+    parts[i].rest_count = 0;
+  }
+  parts[0].rest = parts + 1;
+  parts[0].rest_count = count - 1;
+}
+
+static uint64_t stolen_total() {
+  char *text = NULL, *line;
+  size_t text_len = 0;
+  unsigned long long stolen = 0;
+  FILE *out = open_memstream(&text, &text_len);
+
+  metrics_render(out);
+  fclose(out);
+  if ((line = strstr(text, "\ncachr_tasks_stolen_total ")) != NULL) {
+    sscanf(line + 1, "cachr_tasks_stolen_total %llu", &stolen);
+  }
+  free(text);
+  return stolen;
+}
+
+static void print_result(const char *mode, int jobs, uint64_t elapsed, uint64_t busy, uint64_t stolen, int first) {
+  printf("%s    {\"mode\": \"%s\", \"jobs_per_s\": %.0f, \"elapsed_ms\": %.1f, \"reactor_busy_ms\": %.1f, "
+         "\"stolen\": %llu}", first ? "" : ",\n", mode, jobs * 1e9 / elapsed, elapsed / 1e6, busy / 1e6,
+         (unsigned long long) stolen);
+}
+
+int main(int argc, char **argv) {
+  int threads = 4, jobs = 2000, parts_count = 4, queue = 1024, opt, submitted = 0, completed = 0;
+  uint64_t started, busy = 0, expected;
+  struct part *parts;
+  struct pollfd pfd;
+
+  body_len = 256 * 1024;
+  while ((opt = getopt(argc, argv, "t:j:b:s:q:")) != -1) {
+    switch (opt) {
+      case 't': threads = atoi(optarg); break;
+      case 'j': jobs = atoi(optarg); break;
+      case 'b': body_len = (size_t) atol(optarg) * 1024; break;
+      case 's': parts_count = atoi(optarg); break;
+      case 'q': queue = atoi(optarg); break;
+      default:
+        fprintf(stderr, "Usage: %s [-t threads] [-j jobs] [-b body_kib] [-s parts] [-q queue]\n", argv[0]);
+        return 2;
+    }
+  }
+
+  if (threads < 1 || jobs < 1 || parts_count < 1 || body_len < (size_t) parts_count || queue < 1) {
+    fprintf(stderr, "Threads, jobs, parts and queue must be positive, body at least a byte per part\n");
+    return 2;
+  }
+
+  body = malloc(body_len);
+  for (size_t i = 0; i < body_len; i++) body[i] = (char) (i * 31 + 7);
+  parts = calloc((size_t) jobs * parts_count, sizeof(struct part));
+
+  /* Pool logs its start, keep that ahead of JSON */
+  if (tasks_start(threads, queue) != 0) return 1;
+  pfd.fd = tasks_notifier();
+  pfd.events = POLLIN;
+
+  printf("{\n  \"threads\": %d,\n  \"jobs\": %d,\n  \"body_kib\": %zu,\n  \"parts\": %d,\n  \"results\": [\n", threads,
+         jobs, body_len / 1024, parts_count);
+
+  started = now_ns();
+  for (int i = 0; i < jobs; i++) sink += hash_bytes(HASH_SEED, body, body_len);
+  busy = now_ns() - started;
+  print_result("inline", jobs, busy, busy, 0, 1);
+
+  /* Reactor only submits and counts completions, busy is time spent outside poll() */
+  expected = (uint64_t) jobs * parts_count;
+  busy = 0;
+  started = now_ns();
+  while ((uint64_t) completed < expected) {
+    uint64_t woke = now_ns();
+
+    while (submitted < jobs) {
+      struct part *job = &parts[(size_t) submitted * parts_count];
+
+      split(job, parts_count, pfd.fd);
+      if (tasks_submit(hash_part, job, pfd.fd) != 0) break;
+      submitted++;
+    }
+    completed += (int) tasks_completed(pfd.fd);
+    busy += now_ns() - woke;
+
+    if ((uint64_t) completed < expected) poll(&pfd, 1, 100);
+  }
+  print_result("pool", jobs, now_ns() - started, busy, stolen_total(), 0);
+
+  for (size_t i = 0; i < (size_t) jobs * parts_count; i++) sink += parts[i].hash;
+  printf("\n  ]\n}\n");
+  return 0;
+}
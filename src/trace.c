@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+#include "trace.h"
+#include "metrics.h"
+#include "log.h"
+
+static const char *phase_names[TRACE_PHASE_COUNT] = {
+  "client_read", "cache_lookup", "upstream_connect", "upstream_send", "upstream_ttfb", "upstream_body", "client_write"
+};
+
+int trace_tsc = 0;
+static double ticks_per_us = 1000;
+static uint64_t slow_threshold_us = 0;
+static unsigned int slow_sample = 1, slow_seen = 0;
+
+/* Measures TSC frequency against CLOCK_MONOTONIC, only used when TSC rate doesn't depend on core or power state */
+static void calibrate_tsc() {
+#if defined(__x86_64__) || defined(__i386__)
+  unsigned int eax, ebx, ecx, edx;
+  struct timespec start, end;
+  uint64_t start_ticks, end_ticks;
+
+  if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1 << 8))) return;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  start_ticks = __rdtsc();
+  usleep(20000);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  end_ticks = __rdtsc();
+
+  ticks_per_us = (end_ticks - start_ticks) /
+                 ((end.tv_sec - start.tv_sec) * 1e6 + (end.tv_nsec - start.tv_nsec) / 1e3);
+  trace_tsc = ticks_per_us > 0;
+  if (!trace_tsc) ticks_per_us = 1000;
+#endif
+}
+
+void trace_init(configuration *cfg) {
+  calibrate_tsc();
+  slow_threshold_us = (uint64_t) cfg->slow_request_threshold * 1000;
+  slow_sample = cfg->slow_request_sample > 0 ? cfg->slow_request_sample : 1;
+
+  log_info("Request tracing with %s clock (%.0f ticks/us)%s\n", trace_tsc ? "TSC" : "monotonic", ticks_per_us,
+           slow_threshold_us > 0 ? ", logging slow requests" : "");
+}
+
+/* Turns marks into phase durations, called once per request from its cleanup handler */
+void trace_finish(struct request_trace *trace, struct access_record *record) {
+  uint64_t phases[TRACE_PHASE_COUNT] = {0}, total;
+  int reached[TRACE_PHASE_COUNT] = {0}, last = TRACE_ACCEPTED;
+  char breakdown[512];
+  size_t offset = 0;
+
+  if (trace->marks[TRACE_ACCEPTED] == 0) return;
+  if (trace->marks[TRACE_RESPONSE_SENT] == 0) trace_mark(trace, TRACE_RESPONSE_SENT);
+
+  for (int mark = 1; mark < TRACE_MARK_COUNT; mark++) {
+    if (trace->marks[mark] == 0) continue;
+
+    phases[mark - 1] = (uint64_t) ((trace->marks[mark] - trace->marks[last]) / ticks_per_us);
+    reached[mark - 1] = 1;
+    metrics_observe(HISTOGRAM_PHASE_CLIENT_READ + mark - 1, phases[mark - 1]);
+    last = mark;
+  }
+
+  total = (uint64_t) ((trace->marks[TRACE_RESPONSE_SENT] - trace->marks[TRACE_ACCEPTED]) / ticks_per_us);
+  if (slow_threshold_us == 0 || total < slow_threshold_us) return;
+  if (__atomic_fetch_add(&slow_seen, 1, __ATOMIC_RELAXED) % slow_sample != 0) return;
+
+  for (int i = 0; i < TRACE_PHASE_COUNT; i++) {
+    if (!reached[i] || offset >= sizeof(breakdown)) continue;
+    offset += (size_t) snprintf(breakdown + offset, sizeof(breakdown) - offset, " %s=%.3fms", phase_names[i],
+                                phases[i] / 1000.0);
+  }
+  breakdown[offset < sizeof(breakdown) ? offset : sizeof(breakdown) - 1] = '\0';
+
+  log_warn("Slow request key=%016llx status=%u %s total=%.3fms%s\n", (unsigned long long) record->key,
+           record->status, access_result_name(record->result), total / 1000.0, breakdown);
+}
@@ -0,0 +1,52 @@
+#ifndef CACHR_TRACE_H
+#define CACHR_TRACE_H
+
+#include <stdint.h>
+#include <time.h>
+#include "configutils.h"
+#include "accesslog.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/* Points a request passes, phase N is the time between the last mark before N and mark N */
+enum trace_mark {
+  TRACE_ACCEPTED = 0,
+  TRACE_REQUEST_READ,
+  TRACE_CACHE_LOOKUP,
+  TRACE_UPSTREAM_CONNECTED,
+  TRACE_REQUEST_SENT,
+  TRACE_RESPONSE_HEADERS,
+  TRACE_RESPONSE_READ,
+  TRACE_RESPONSE_SENT,
+  TRACE_MARK_COUNT
+};
+
+#define TRACE_PHASE_COUNT (TRACE_MARK_COUNT - 1)
+
+/* Raw clock values, 0 for marks the request never reached (e.g. upstream ones on a hit) */
+struct request_trace {
+  uint64_t marks[TRACE_MARK_COUNT];
+};
+
+/* Non-zero when ticks come from an invariant TSC, CLOCK_MONOTONIC nanoseconds otherwise */
+extern int trace_tsc;
+
+void trace_init(configuration *cfg);
+void trace_finish(struct request_trace *trace, struct access_record *record);
+
+/* No syscall either way: rdtsc, or vDSO clock when TSC can't be trusted across cores */
+static inline uint64_t trace_ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+  if (trace_tsc) return __rdtsc();
+#endif
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+static inline void trace_mark(struct request_trace *trace, int mark) {
+  trace->marks[mark] = trace_ticks();
+}
+
+#endif //CACHR_TRACE_H
@@ -0,0 +1,401 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "upstream.h"
+#include "netutils.h"
+#include "utils.h"
+#include "metrics.h"
+#include "log.h"
+
+/* Points on consistent hashing ring per unit of backend weight */
+#define RING_POINTS_PER_WEIGHT 160
+
+/* AIMD: limit shrinks by these factors on failure / slow response and grows by 1/limit per fast one */
+#define LIMIT_ERROR_BACKOFF 0.5
+#define LIMIT_LATENCY_BACKOFF 0.9
+/* Latency baseline follows slower responses with this weight, faster ones immediately */
+#define BASELINE_DECAY (1.0 / 256)
+
+struct ring_point {
+  uint64_t hash;
+  int backend;
+};
+
+static struct backend *backends = NULL;
+static int backends_count = 0, balancing = BALANCING_LEAST_OUTSTANDING, total_weight = 0;
+static int max_fails = 3, ring_size = 0, limit_max = 0;
+static double latency_tolerance = 2.0;
+static unsigned int fail_timeout = 10000, check_interval = 0, check_timeout = 3000;
+static const char *check_path = "/";
+static struct ring_point *ring = NULL;
+
+static __thread unsigned int select_seed = 0;
+
+/* Whether backend can take one more request: healthy, under its limit and breaker closed (or due a probe) */
+static int backend_available(struct backend *backend, long now) {
+  if (!__atomic_load_n(&backend->healthy, __ATOMIC_RELAXED)) return 0;
+
+  switch (__atomic_load_n(&backend->breaker, __ATOMIC_ACQUIRE)) {
+    case BREAKER_CLOSED:
+      return __atomic_load_n(&backend->outstanding, __ATOMIC_RELAXED) <
+             __atomic_load_n(&backend->limit, __ATOMIC_RELAXED);
+    case BREAKER_OPEN:
+      return __atomic_load_n(&backend->open_until, __ATOMIC_RELAXED) <= now;
+    default:
+      return 0;
+  }
+}
+
+/*
+ * Claims a slot on chosen backend. Only one thread wins the half-open probe, slots under the limit are taken with a
+ * CAS so concurrent admissions can't push outstanding past it.
+ */
+static int backend_admit(struct backend *backend) {
+  int expected = BREAKER_OPEN, outstanding;
+
+  switch (__atomic_load_n(&backend->breaker, __ATOMIC_ACQUIRE)) {
+    case BREAKER_OPEN:
+      if (!__atomic_compare_exchange_n(&backend->breaker, &expected, BREAKER_HALF_OPEN, 0, __ATOMIC_ACQ_REL,
+                                       __ATOMIC_ACQUIRE)) {
+        return 0;
+      }
+      log_info("[upstream] %s:%d half-open, sending probe\n", backend->host, backend->port);
+      __atomic_add_fetch(&backend->outstanding, 1, __ATOMIC_RELAXED);
+      return 1;
+    case BREAKER_CLOSED:
+      outstanding = __atomic_load_n(&backend->outstanding, __ATOMIC_RELAXED);
+      do {
+        if (outstanding >= __atomic_load_n(&backend->limit, __ATOMIC_RELAXED)) return 0;
+      } while (!__atomic_compare_exchange_n(&backend->outstanding, &outstanding, outstanding + 1, 1, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED));
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+/* Whether a is less loaded than b relative to their weights */
+static int less_loaded(struct backend *a, struct backend *b) {
+  long load_a = (long) (__atomic_load_n(&a->outstanding, __ATOMIC_RELAXED) + 1) * b->weight;
+  long load_b = (long) (__atomic_load_n(&b->outstanding, __ATOMIC_RELAXED) + 1) * a->weight;
+  return load_a < load_b;
+}
+
+static struct backend *select_least_outstanding(long now) {
+  struct backend *chosen = NULL;
+
+  for (int i = 0; i < backends_count; i++) {
+    if (!backend_available(&backends[i], now)) continue;
+    if (chosen == NULL || less_loaded(&backends[i], chosen)) chosen = &backends[i];
+  }
+  return chosen;
+}
+
+static struct backend *random_backend() {
+  int r;
+
+  if (select_seed == 0) select_seed = (unsigned int) gettid() ^ (unsigned int) get_time_ms();
+  r = rand_r(&select_seed) % total_weight;
+
+  for (int i = 0; i < backends_count; i++) {
+    r -= backends[i].weight;
+    if (r < 0) return &backends[i];
+  }
+  return &backends[backends_count - 1];
+}
+
+/* Power of two choices: two weighted random picks, less loaded one wins */
+static struct backend *select_p2c(long now) {
+  struct backend *first = NULL, *second = NULL;
+
+  for (int attempt = 0; attempt < 2 * backends_count && second == NULL; attempt++) {
+    struct backend *candidate = random_backend();
+
+    if (!backend_available(candidate, now)) continue;
+    if (first == NULL) first = candidate;
+    else if (candidate != first) second = candidate;
+  }
+
+  if (first == NULL) return select_least_outstanding(now);
+  if (second == NULL) return first;
+  return less_loaded(second, first) ? second : first;
+}
+
+/* Consistent hashing on cache key, walks the ring past backends out of rotation */
+static struct backend *select_hash(uint64_t key, long now) {
+  uint64_t hash = mix64(key);
+  int low = 0, high = ring_size;
+
+  while (low < high) {
+    int mid = (low + high) / 2;
+    if (ring[mid].hash < hash) low = mid + 1;
+    else high = mid;
+  }
+
+  for (int i = 0; i < ring_size; i++) {
+    struct backend *candidate = &backends[ring[(low + i) % ring_size].backend];
+    if (backend_available(candidate, now)) return candidate;
+  }
+  return NULL;
+}
+
+static int compare_ring_points(const void *a, const void *b) {
+  uint64_t hash_a = ((struct ring_point *) a)->hash, hash_b = ((struct ring_point *) b)->hash;
+  return hash_a < hash_b ? -1 : hash_a > hash_b;
+}
+
+static void build_ring() {
+  int point = 0;
+
+  ring_size = total_weight * RING_POINTS_PER_WEIGHT;
+  ring = malloc(sizeof(struct ring_point) * ring_size);
+
+  for (int i = 0; i < backends_count; i++) {
+    char name[300];
+    int name_len = sprintf(name, "%s:%d", backends[i].host, backends[i].port);
+
+    for (int j = 0; j < backends[i].weight * RING_POINTS_PER_WEIGHT; j++) {
+      ring[point].hash = mix64(hash_bytes(HASH_SEED + j, name, (size_t) name_len));
+      ring[point++].backend = i;
+    }
+  }
+
+  qsort(ring, (size_t) ring_size, sizeof(struct ring_point), compare_ring_points);
+}
+
+/* Active check: connect, GET health_check_path and treat anything below 500 as healthy */
+static int check_backend(struct backend *backend) {
+  char request[512], response[64];
+  int sockfd, minor_version, status;
+  struct pollfd pfd;
+  ssize_t bytes;
+
+  /* Healthy when any of its addresses answers, same as connections made for clients */
+  if ((sockfd = resolver_connect(backend->resolved, check_timeout)) < 0) return 0;
+
+  pfd.fd = sockfd;
+  sprintf(request, "GET %.200s HTTP/1.0\r\nHost: %.200s\r\nConnection: close\r\n\r\n", check_path, backend->host);
+  pfd.events = POLLIN;
+
+  if (write(sockfd, request, strlen(request)) <= 0 || poll(&pfd, 1, (int) check_timeout) != 1 ||
+      (bytes = read(sockfd, response, sizeof(response) - 1)) <= 0) {
+    close(sockfd);
+    return 0;
+  }
+
+  close(sockfd);
+  response[bytes] = '\0';
+  return sscanf(response, "HTTP/1.%d %d", &minor_version, &status) == 2 && status < 500;
+}
+
+static void *health_checker(void *ctx) {
+  while (1) {
+    for (int i = 0; i < backends_count; i++) {
+      int healthy = check_backend(&backends[i]);
+
+      if (__atomic_exchange_n(&backends[i].healthy, healthy, __ATOMIC_RELAXED) != healthy) {
+        log_warn("[upstream] %s:%d is %s\n", backends[i].host, backends[i].port, healthy ? "healthy" : "unhealthy");
+      }
+    }
+    usleep(check_interval * 1000);
+  }
+
+  return NULL;
+}
+
+/* Parses "host:port [weight=N]", IPv6 literals go in brackets: "[::1]:port" */
+static int parse_backend(const char *line, struct backend *backend) {
+  char host[256];
+  unsigned int port;
+  const char *weight = strstr(line, "weight=");
+
+  if (sscanf(line, "[%255[^]]]:%u", host, &port) != 2 && sscanf(line, "%255[^:]:%u", host, &port) != 2) return -1;
+
+  memset(backend, 0, sizeof(struct backend));
+  backend->host = strdup(host);
+  backend->port = (unsigned short) port;
+  backend->weight = weight != NULL ? atoi(weight + 7) : 1;
+  if (backend->weight < 1) backend->weight = 1;
+  backend->resolved = resolver_add(backend->host, backend->port);
+  backend->healthy = 1;
+  pthread_mutex_init(&backend->lock, NULL);
+  return 0;
+}
+
+/* Builds backend list from [upstream], falling back to single [target] */
+int upstream_init(configuration *cfg) {
+  pthread_t thid;
+
+  resolver_configure(cfg->dns_refresh, cfg->dns_min_ttl);
+
+  if (cfg->backends_count == 0) {
+    char line[300];
+    sprintf(line, strchr(cfg->target_host, ':') != NULL ? "[%.255s]:%d" : "%.255s:%d", cfg->target_host, cfg->target_port);
+
+    backends = malloc(sizeof(struct backend));
+    if (parse_backend(line, &backends[0]) != 0) return -1;
+    backends_count = 1;
+  } else {
+    backends = malloc(sizeof(struct backend) * cfg->backends_count);
+
+    for (int i = 0; i < cfg->backends_count; i++) {
+      if (parse_backend(cfg->backends[i], &backends[backends_count]) != 0) {
+        log_error("[upstream] Invalid backend '%s'\n", cfg->backends[i]);
+        continue;
+      }
+      backends_count++;
+    }
+    if (backends_count == 0) return -1;
+  }
+
+  for (int i = 0; i < backends_count; i++) {
+    total_weight += backends[i].weight;
+    log_info("[upstream] Backend %s:%d weight=%d\n", backends[i].host, backends[i].port, backends[i].weight);
+  }
+
+  if (cfg->balancing != NULL && strcasecmp(cfg->balancing, "p2c") == 0) {
+    balancing = BALANCING_P2C;
+  } else if (cfg->balancing != NULL && strcasecmp(cfg->balancing, "hash") == 0) {
+    balancing = BALANCING_HASH;
+    build_ring();
+  }
+
+  /* Without concurrency_limit backends take any number of requests */
+  limit_max = cfg->concurrency_max > 0 ? cfg->concurrency_max : INT_MAX;
+  if (cfg->latency_tolerance > 1.0) latency_tolerance = cfg->latency_tolerance;
+
+  for (int i = 0; i < backends_count; i++) {
+    backends[i].limit = cfg->concurrency_limit > 0 ? cfg->concurrency_limit : INT_MAX;
+    if (cfg->concurrency_limit > 0 && backends[i].limit > limit_max) backends[i].limit = limit_max;
+    backends[i].limit_estimate = backends[i].limit;
+  }
+
+  max_fails = cfg->max_fails;
+  fail_timeout = cfg->fail_timeout;
+  check_interval = cfg->health_check_interval;
+  check_timeout = cfg->connect_timeout;
+  if (cfg->health_check_path != NULL) check_path = cfg->health_check_path;
+
+  resolver_start();
+
+  if (check_interval > 0) {
+    if (pthread_create(&thid, NULL, health_checker, NULL) == 0) {
+      pthread_detach(thid);
+    } else {
+      log_error("[upstream] Failed to create health check thread.\n");
+    }
+  }
+
+  return 0;
+}
+
+/* Returns backend for a miss, or NULL when every backend is at its limit or behind an open breaker */
+struct backend *upstream_select(uint64_t key) {
+  long now = get_time_ms();
+
+  /* Losing a half-open probe race or the last slot makes that backend unavailable, so retrying picks another one */
+  for (int attempt = 0; attempt <= backends_count; attempt++) {
+    struct backend *chosen;
+
+    switch (balancing) {
+      case BALANCING_HASH:
+        chosen = select_hash(key, now);
+        break;
+      case BALANCING_P2C:
+        chosen = select_p2c(now);
+        break;
+      default:
+        chosen = select_least_outstanding(now);
+    }
+
+    if (chosen == NULL) return NULL;
+    if (backend_admit(chosen)) return chosen;
+  }
+
+  return NULL;
+}
+
+static void set_breaker(struct backend *backend, int state) {
+  if (state == BREAKER_OPEN) {
+    __atomic_store_n(&backend->open_until, get_time_ms() + (long) fail_timeout, __ATOMIC_RELAXED);
+    log_warn("[upstream] %s:%d circuit open for %u ms\n", backend->host, backend->port, fail_timeout);
+  } else {
+    log_info("[upstream] %s:%d circuit closed\n", backend->host, backend->port);
+  }
+  backend->fails = 0;
+  __atomic_store_n(&backend->breaker, state, __ATOMIC_RELEASE);
+}
+
+/* AIMD on time to response headers: failures and responses slower than baseline * tolerance shrink the limit */
+static void update_limit(struct backend *backend, int success, long latency) {
+  double estimate = backend->limit_estimate;
+
+  if (!success) {
+    estimate *= LIMIT_ERROR_BACKOFF;
+  } else {
+    if (backend->baseline_latency == 0 || latency < backend->baseline_latency) {
+      backend->baseline_latency = latency;
+    } else {
+      backend->baseline_latency += (latency - backend->baseline_latency) * BASELINE_DECAY;
+    }
+
+    if (latency > backend->baseline_latency * latency_tolerance) {
+      estimate *= LIMIT_LATENCY_BACKOFF;
+    } else if (__atomic_load_n(&backend->outstanding, __ATOMIC_RELAXED) * 2 >= backend->limit) {
+      /* Only grow while the current limit is actually being used */
+      estimate += 1.0 / estimate;
+    }
+  }
+
+  if (estimate < 1) estimate = 1;
+  if (estimate > limit_max) estimate = limit_max;
+  backend->limit_estimate = estimate;
+
+  if ((int) estimate != backend->limit) {
+    __atomic_store_n(&backend->limit, (int) estimate, __ATOMIC_RELAXED);
+    log_debug("[upstream] %s:%d concurrency limit %d (latency %ld us, baseline %.0f us)\n", backend->host, backend->port,
+              (int) estimate, latency, backend->baseline_latency);
+  }
+}
+
+/* Ends request admitted by upstream_select(), latency is time to response headers in us */
+void upstream_release(struct backend *backend, int success, long latency) {
+  if (backend == NULL) return;
+
+  __atomic_sub_fetch(&backend->outstanding, 1, __ATOMIC_RELAXED);
+
+  metrics_add(METRIC_UPSTREAM_REQUESTS, 1);
+  if (!success) metrics_add(METRIC_UPSTREAM_ERRORS, 1);
+  if (latency > 0) metrics_observe(HISTOGRAM_UPSTREAM_LATENCY, (uint64_t) latency);
+
+  pthread_mutex_lock(&backend->lock);
+
+  /* Fixed limit (INT_MAX) is left alone */
+  if (backend->limit != INT_MAX) update_limit(backend, success, latency);
+
+  switch (__atomic_load_n(&backend->breaker, __ATOMIC_ACQUIRE)) {
+    case BREAKER_HALF_OPEN:
+      set_breaker(backend, success ? BREAKER_CLOSED : BREAKER_OPEN);
+      break;
+    case BREAKER_CLOSED:
+      if (success) {
+        backend->fails = 0;
+      } else if (max_fails > 0 && ++backend->fails >= max_fails) {
+        set_breaker(backend, BREAKER_OPEN);
+      }
+      break;
+    default:
+      /* Stragglers finishing after breaker opened don't extend it */
+      break;
+  }
+
+  pthread_mutex_unlock(&backend->lock);
+}
@@ -0,0 +1,48 @@
+#ifndef CACHR_UPSTREAM_H
+#define CACHR_UPSTREAM_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "configutils.h"
+#include "resolver.h"
+
+enum breaker_state {
+  BREAKER_CLOSED = 0,
+  BREAKER_OPEN,
+  /* Open long enough, a single probe request decides whether to close */
+  BREAKER_HALF_OPEN
+};
+
+enum balancing {
+  BALANCING_LEAST_OUTSTANDING = 0,
+  BALANCING_P2C,
+  BALANCING_HASH
+};
+
+struct backend {
+  char *host;
+  unsigned short port;
+  struct resolved_host *resolved;
+  int weight;
+
+  /* Updated concurrently by connection threads and health checker */
+  int outstanding;
+  int healthy;
+
+  /* Circuit breaker, opened after max_fails consecutive failures */
+  int breaker;
+  int fails;
+  long open_until;
+
+  /* Adaptive concurrency limit, estimate and latency baseline change under lock, limit is read lock-free */
+  int limit;
+  double limit_estimate;
+  double baseline_latency;
+  pthread_mutex_t lock;
+};
+
+int upstream_init(configuration *cfg);
+struct backend *upstream_select(uint64_t key);
+void upstream_release(struct backend *backend, int success, long latency);
+
+#endif //CACHR_UPSTREAM_H
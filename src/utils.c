@@ -1,4 +1,5 @@
 #include <sys/time.h>
+#include <time.h>
 #include <stdint.h>
 #include <string.h>
 #include <pthread.h>
@@ -8,15 +9,56 @@ long get_timestamp() {
   return (unsigned long) time(NULL);
 }
 
+/* Monotonic milliseconds, for deadlines */
+long get_time_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Monotonic microseconds, for latency measurements */
+long get_time_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Wall clock microseconds, for timestamps written out */
+uint64_t get_epoch_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+}
+
+/* Poll timeout left until deadline, never negative */
+long time_left_ms(long deadline) {
+  long left = deadline - get_time_ms();
+  return left > 0 ? left : 0;
+}
+
 uint64_t hash_buffer(char* str) {
-  uint64_t c, hash = 2317;
-  while ((c = (uint64_t) *str++)) {
-    hash = ((hash << 5) + hash) + c;
+  return hash_bytes(HASH_SEED, str, strlen(str));
+}
+
+/* Continues hash over len bytes, so a buffer can be hashed in several segments */
+uint64_t hash_bytes(uint64_t hash, const char* str, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    hash = ((hash << 5) + hash) + (uint64_t) str[i];
   }
 
   return hash;
 }
 
+/* splitmix64 finalizer, spreads cache keys and ring points evenly */
+uint64_t mix64(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
 uint64_t gettid() {
   pthread_t ptid = pthread_self();
   uint64_t threadId = 0;
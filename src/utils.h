@@ -1,8 +1,18 @@
 #ifndef CACHR_UTILS_H
 #define CACHR_UTILS_H
 
+#include <stddef.h>
+
+#define HASH_SEED 2317
+
 long get_timestamp();
+long get_time_ms();
+long get_time_us();
+uint64_t get_epoch_us();
+long time_left_ms(long deadline);
 uint64_t hash_buffer(char* str);
+uint64_t hash_bytes(uint64_t hash, const char* str, size_t len);
+uint64_t mix64(uint64_t x);
 uint64_t gettid();
 
 #endif //CACHR_UTILS_H
@@ -0,0 +1,50 @@
+import socket
+import sys
+import threading
+import time
+
+# Trickles a request into cachr one byte at a time to exercise incremental parsing.
+# Usage: python slow_client.py [clients] [padding_headers] [host] [port]
+
+CLIENTS = int(sys.argv[1]) if len(sys.argv) > 1 else 10
+PADDING = int(sys.argv[2]) if len(sys.argv) > 2 else 50
+HOST = sys.argv[3] if len(sys.argv) > 3 else "localhost"
+PORT = int(sys.argv[4]) if len(sys.argv) > 4 else 3001
+
+
+def build_request():
+    request = "GET /one_second HTTP/1.1\r\nHost: %s\r\n" % HOST
+    for i in range(PADDING):
+        request += "X-Padding-%d: %s\r\n" % (i, "x" * 32)
+    return (request + "\r\n").encode()
+
+
+def client(request, results, idx):
+    sck = socket.create_connection((HOST, PORT))
+    sck.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    start = time.time()
+    for i in range(len(request)):
+        sck.send(request[i:i + 1])
+    sent = time.time()
+    while sck.recv(4096):
+        pass
+    sck.close()
+    results[idx] = (sent - start, time.time() - sent)
+
+
+if __name__ == "__main__":
+    request = build_request()
+    results = [None] * CLIENTS
+    threads = [threading.Thread(target=client, args=(request, results, i)) for i in range(CLIENTS)]
+    start = time.time()
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    total = time.time() - start
+
+    send_times = sorted(r[0] for r in results)
+    response_times = sorted(r[1] for r in results)
+    print("clients=%d request_bytes=%d total=%.3fs" % (CLIENTS, len(request), total))
+    print("send p50=%.3fs max=%.3fs" % (send_times[len(send_times) // 2], send_times[-1]))
+    print("response p50=%.3fs max=%.3fs" % (response_times[len(response_times) // 2], response_times[-1]))